@@ -26,10 +26,14 @@ using namespace std;
 #include <fstream>
 #include <vector>
 #include <string>
+#include <sstream>
 #include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
 #include "util.h"
 #include "math.h"
 #include "lmtable.h"
+#include "lmview.h"
 
 
 /* GLOBAL OPTIONS ***************/
@@ -43,8 +47,94 @@ std::string sdebug = "0";
 std::string smemmap = "0";
 std::string sdub = "10000000";//10^7
 std::string skeepunigrams = "yes";
+std::string sview = "no";
+std::string sthreads = "1";
+std::string skeyindex = "no";
+std::string spacked = "";   //default: layout of the input LM
+std::string scolumnar = "";
+std::string shash = "no";
+std::string sreversed = "no";
+std::string sinterleave = "0";
+std::string stopk = "no";
+std::string smatch = "no";
+std::string stopwords = "0";
+std::string sstprob = "16";
+std::string sloadcaches = "";
+std::string ssavecaches = "";
 /********************************/
 
+//n-grams scored together by --eval with interleaved lookups
+#define EVALBLOCK 4096
+
+//data of a thread evaluating a portion of the text in concurrent mode
+
+struct evalchunk{
+  lmtable* lmt;
+  lmview* view;            //restriction of the LM to a word list, if any
+  std::vector<int>* codes; //encoded text
+  size_t start,end;        //portion of the text to be evaluated
+  int debug;
+  int bos,eos;
+  //results
+  int Nbo,Nw,Noov;
+  double logPr;
+  std::ostringstream out;
+};
+
+void* evalthread(void* arg){
+  evalchunk* c=(evalchunk*) arg;
+  lmtable* lmt=c->lmt;
+  ngram ng(lmt->dict);
+  double bow,Pr; int bol=0;
+
+  c->out.setf(ios::fixed);
+  c->out.precision(c->debug>0?8:2);
+  c->Nbo=c->Nw=c->Noov=0; c->logPr=0;
+
+  if (c->debug==0 && !c->view){
+    //sentences are scored as a whole, from each <s> to the next one
+    const int* codes=(c->codes->size()>0?&(*c->codes)[0]:NULL);
+    std::vector<int> sbol;
+    for (size_t i=c->start,j;i<c->end;i=j){
+      for (j=i+1;j<c->end && codes[j]!=c->bos;j++);
+      sbol.resize(j-i);
+      c->logPr+=lmt->score_sentence(codes+i,j-i,NULL,&sbol[0]);
+      for (size_t k=i;k<j;k++){
+        if (codes[k]==c->bos) continue;
+        if (codes[k]==lmt->dict->oovcode()) c->Noov++;
+        if (sbol[k-i]) c->Nbo++;
+        c->Nw++;
+      }
+    }
+    return NULL;
+  }
+
+  for (size_t i=c->start;i<c->end;i++){
+    ng.pushc((*c->codes)[i]); ng.freq=1;
+    if (ng.size>lmt->maxlevel()) ng.size=lmt->maxlevel();
+
+    // reset ngram at begin of sentence
+    if (*ng.wordp(1)==c->bos) {ng.size=1;continue;}
+
+    c->logPr+=(Pr=(c->view?c->view->lprob(ng,&bow,&bol):lmt->lprob(ng,&bow,&bol)));
+
+    if (c->debug==1){
+      c->out << ng.dict->decode(*ng.wordp(1)) << "[" << ng.size-bol << "]" << " ";
+      if (*ng.wordp(1)==c->eos) c->out << std::endl;
+    }
+    if (c->debug==2)
+      c->out << ng << "[" << ng.size-bol << "-gram]" << " " << Pr << std::endl;
+    if (c->debug==3)
+      c->out << ng << "[" << ng.size-bol << "-gram]" << " " << Pr << " bow:" << bow << std::endl;
+
+    int w=(c->view?c->view->code(*ng.wordp(1)):*ng.wordp(1));
+    if (w == lmt->dict->oovcode()) c->Noov++;
+    if (bol) c->Nbo++;
+    c->Nw++;
+  }
+  return NULL;
+}
+
 void usage(const char *msg = 0) {
 
 	if (msg) { std::cerr << msg << std::endl; }
@@ -57,11 +147,25 @@ void usage(const char *msg = 0) {
     << "--text|-t [yes|no]  (output is again in text format)" << std::endl
     << "--filter|-f wordlist (filter a binary language model with a word list)"<< std::endl
     << "--keepunigrams|-ku [yes|no] (filter by keeping all unigrams in the table: default yes)"<< std::endl
+    << "--view|-vw [yes|no] (--eval filters the LM through a view restricted to the word list instead of a copy: default no)"<< std::endl
 	<< "--eval|-e text-file (computes perplexity of text-file and returns)"<< std::endl
-    << "--randcalls|-r N (computes N random calls on the eval text-file)"<< std::endl
+    << "--randcalls|-r N (computes N random calls on the eval text-file and reports speed and memory)"<< std::endl
 	<< "--dub dict-size (dictionary upperbound to compute OOV word penalty: default 10^7)"<< std::endl
 	<< "--score|-s [yes|no]  (computes log-prob scores from standard input)"<< std::endl
-	<< "--debug|-d 1 (verbose output for --eval option)"<< std::endl
+	<< "--loadcaches|-lc file (--score starts with the caches of a snapshot saved with the same LM)"<< std::endl
+	<< "--savecaches|-svc file (--score saves a snapshot of its caches at the end)"<< std::endl
+	<< "--match|-mt [yes|no]  (outputs the longest matching n-gram order of each word of the sentences read from standard input)"<< std::endl
+	<< "--topwords|-tw K (outputs the K most probable words following each history read from standard input, with their log10 probs)"<< std::endl
+	<< "--debug|-d 1 (verbose output for --eval and --match options)"<< std::endl
+	<< "--threads|-th N (number of threads sharing the LM for --eval option: default 1)"<< std::endl
+	<< "--stprobcache|-sp B (--eval caches the scores of 2^B pairs of LM state and word; 0 disables the cache: default 16)"<< std::endl
+	<< "--interleave|-il K (--eval with 1 thread looks up K n-grams in turn, prefetching their table entries; pays off, e.g. with K=16, for LMs larger than the CPU caches: default 0)"<< std::endl
+	<< "--keyindex|-ki [yes|no] (adds a sorted key index for faster search to the binary LM: default no)"<< std::endl
+	<< "--topk|-k [yes|no] (adds an index of the successors of each context sorted by probability to the binary LM: default no)"<< std::endl
+	<< "--hash|-hs [yes|no] (queries the LM through hash tables instead of the trie: default no)"<< std::endl
+	<< "--reversed|-rv [yes|no] (stores n-grams from their most recent word, so that a query is a single descent: default no)"<< std::endl
+	<< "--packed|-pk [yes|no] (bit-packs the levels of the binary LM with minimal field widths: default as the input LM, else no)"<< std::endl
+	<< "--columnar|-co [yes|no] (stores words, probs, bows and bounds of the binary LM in separate arrays: default as the input LM, else no)"<< std::endl
 	<< "--memmap|-mm 1 (uses memory map to read a binary LM)\n";
 }
 
@@ -102,6 +206,9 @@ void handle_option(const std::string& opt, int argc, const char **argv, int& arg
   else
   if (starts_with(opt, "--keepunigrams") || starts_with(opt, "-ku"))
     skeepunigrams = get_param(opt, argc, argv, argi);
+  else
+  if (starts_with(opt, "--view") || starts_with(opt, "-vw"))
+    sview = get_param(opt, argc, argv, argi);
   else
     if (starts_with(opt, "--eval") || starts_with(opt, "-e"))
       seval = get_param(opt, argc, argv, argi);
@@ -111,9 +218,48 @@ void handle_option(const std::string& opt, int argc, const char **argv, int& arg
   else
     if (starts_with(opt, "--score") || starts_with(opt, "-s"))
       sscore = get_param(opt, argc, argv, argi);  
+  else
+    if (starts_with(opt, "--loadcaches") || starts_with(opt, "-lc"))
+      sloadcaches = get_param(opt, argc, argv, argi);
+  else
+    if (starts_with(opt, "--savecaches") || starts_with(opt, "-svc"))
+      ssavecaches = get_param(opt, argc, argv, argi);
+  else
+    if (starts_with(opt, "--match") || starts_with(opt, "-mt"))
+      smatch = get_param(opt, argc, argv, argi);
+  else
+    if (starts_with(opt, "--topwords") || starts_with(opt, "-tw"))
+      stopwords = get_param(opt, argc, argv, argi);
   else
     if (starts_with(opt, "--debug") || starts_with(opt, "-d"))
       sdebug = get_param(opt, argc, argv, argi);
+  else
+    if (starts_with(opt, "--threads") || starts_with(opt, "-th"))
+      sthreads = get_param(opt, argc, argv, argi);
+  else
+    if (starts_with(opt, "--stprobcache") || starts_with(opt, "-sp"))
+      sstprob = get_param(opt, argc, argv, argi);
+  else
+    if (starts_with(opt, "--interleave") || starts_with(opt, "-il"))
+      sinterleave = get_param(opt, argc, argv, argi);
+  else
+    if (starts_with(opt, "--keyindex") || starts_with(opt, "-ki"))
+      skeyindex = get_param(opt, argc, argv, argi);
+  else
+    if (starts_with(opt, "--topk") || starts_with(opt, "-k"))
+      stopk = get_param(opt, argc, argv, argi);
+  else
+    if (starts_with(opt, "--hash") || starts_with(opt, "-hs"))
+      shash = get_param(opt, argc, argv, argi);
+  else
+    if (starts_with(opt, "--reversed") || starts_with(opt, "-rv"))
+      sreversed = get_param(opt, argc, argv, argi);
+  else
+    if (starts_with(opt, "--packed") || starts_with(opt, "-pk"))
+      spacked = get_param(opt, argc, argv, argi);
+  else
+    if (starts_with(opt, "--columnar") || starts_with(opt, "-co"))
+      scolumnar = get_param(opt, argc, argv, argi);
   else
     if (starts_with(opt, "--memmap") || starts_with(opt, "-mm") || starts_with(opt, "-m"))
       smemmap = get_param(opt, argc, argv, argi);     
@@ -148,7 +294,7 @@ int main(int argc, const char **argv)
 	OUTFILE_TYPE outtype;
 	if (stxt == "yes") outtype=TEXT;
 	else
-		if (seval != "" || sscore == "yes") outtype=NONE;
+		if (seval != "" || sscore == "yes" || smatch == "yes" || stopwords != "0") outtype=NONE;
 		else  outtype=BINARY;
 	
 	
@@ -156,6 +302,21 @@ int main(int argc, const char **argv)
 	int memmap = atoi(smemmap.c_str());
 	int dub = atoi(sdub.c_str());
 	int randcalls = atoi(srandcalls.c_str());
+	int threads = atoi(sthreads.c_str());
+	int interleave = atoi(sinterleave.c_str());
+	int stprob = atoi(sstprob.c_str());
+	int topwords = atoi(stopwords.c_str());
+	
+	if (threads < 1) { usage("Number of threads must be a positive integer"); exit(1); }
+	if (interleave < 0) { usage("Number of interleaved lookups must be non negative"); exit(1); }
+	if (sreversed == "yes" && (stopk == "yes" || shash == "yes")) { usage("--reversed cannot be combined with --topk or --hash"); exit(1); }
+	if (sreversed == "yes" && memmap) { usage("--reversed cannot be combined with --memmap"); exit(1); }
+	if (stprob < 0 || stprob > 30) { usage("Size of the state-keyed prob cache must be 0 (no cache) to 30"); exit(1); }
+	if (topwords < 0) { usage("Number of top words must be non negative"); exit(1); }
+	if (threads > 1 && debug > 3){
+		std::cerr << "debug level " << debug << " is only available with 1 thread" << std::endl;
+		threads=1;
+	}
 	
 	
 	std::string infile = files[0];
@@ -194,7 +355,15 @@ int main(int argc, const char **argv)
 		exit(1);
 	}  
     
-	if (sfilter != ""){
+	lmview* view=NULL;
+	if (sfilter != "" && sview == "yes"){
+		if (seval == ""){ usage("--view requires --eval"); exit(1); }
+		lmt->load(inp,infile.c_str(),outfile.c_str(),memmap,outtype);
+		dictionary *dict; dict=new dictionary((char *)sfilter.c_str());
+		view=new lmview(lmt,dict,(skeepunigrams=="yes"));
+		delete dict;
+	}
+	else if (sfilter != ""){
 		std::cerr << "loading filtered version of LM ... \n";
 		lmt->load(inp,infile.c_str(),outfile.c_str(),memmap=1,outtype);
 		dictionary *dict; dict=new dictionary((char *)sfilter.c_str());
@@ -208,6 +377,16 @@ int main(int argc, const char **argv)
 	}
 	
 	if (dub) lmt->setlogOOVpenalty((int)dub);
+	if (dub && view) view->setlogOOVpenalty((int)dub);
+	
+	if (lmt->isReversedTable() && (stopk == "yes" || shash == "yes")) { usage("Reversed-context LMs cannot be combined with --topk or --hash"); exit(1); }
+	if (sreversed == "yes") lmt->reverse();
+	if (skeyindex == "yes") lmt->build_keyindex();
+	if (stopk == "yes") lmt->build_topk();
+	if (shash == "yes") lmt->build_hash();
+	
+	//sentences scored as a whole share the scores of (state,word) pairs
+	if (seval != "" && stprob > 0) lmt->init_stprobcache(stprob);
 	
 	if (seval != "") {
 		
@@ -224,6 +403,7 @@ int main(int argc, const char **argv)
 			ngram ng(lmt->dict); 
 			srand(1234);
 			double bow; int bol=0; 
+			clock_t start=clock();
 			
 			for (int n=0;n<randcalls;n++){
 				//extracts a random word from dict
@@ -235,13 +415,12 @@ int main(int argc, const char **argv)
 					std::cout << ng.dict->decode(*ng.wordp(1)) << "[" << lmt->maxlevel()-bol << "]" << " "; 
 					std::cout << std::endl;
 				}
-				
-				if ((n % 100000)==0){ 
-					std::cerr << "check cache levels" << std::endl;
-					lmt->check_cache_levels();   
-				}
 			}
 			
+			double secs=(double)(clock()-start)/CLOCKS_PER_SEC;
+			std::cout << "%% calls=" << randcalls << " seconds=" << secs
+			<< " qps=" << (secs>0?randcalls/secs:0) << std::endl;
+			lmt->stat();
 		}
 		else
 		{
@@ -263,42 +442,106 @@ int main(int argc, const char **argv)
 			int eos=ng.dict->encode(ng.dict->EoS());
 			ng.dict->incflag(0);
 			
+			//without interleaving and debug output, whole sentences are scored at once
+			bool whole=(view || threads>1 || (interleave==0 && debug==0));
+			
+			if (whole){
+				//words are encoded in advance so that threads only read the LM
+				std::vector<int> codes;
+				while(inptxt >> ng) codes.push_back(*ng.wordp(1));
+				
+				//split text at sentence starts, where the history is reset
+				std::vector<size_t> starts; starts.push_back(0);
+				for (int t=1;t<threads;t++){
+					size_t p=MAX(starts.back()+1,codes.size() * t / threads);
+					while (p<codes.size() && codes[p]!=bos) p++;
+					if (p<codes.size()) starts.push_back(p);
+				}
+				starts.push_back(codes.size());
+				
+				int nc=starts.size()-1;
+				if (nc>1) std::cerr << "evaluating with " << nc << " threads" << std::endl;
+				evalchunk* chunk=new evalchunk[nc];
+				pthread_t* tid=new pthread_t[nc];
+				
+				if (nc>1) lmt->setConcurrent(true);
+				for (int t=0;t<nc;t++){
+					chunk[t].lmt=lmt; chunk[t].view=view; chunk[t].codes=&codes;
+					chunk[t].start=starts[t]; chunk[t].end=starts[t+1];
+					chunk[t].debug=debug; chunk[t].bos=bos; chunk[t].eos=eos;
+					if (nc>1) pthread_create(&tid[t],NULL,evalthread,&chunk[t]);
+					else evalthread(&chunk[t]);
+				}
+				for (int t=0;t<nc;t++){
+					if (nc>1) pthread_join(tid[t],NULL);
+					std::cout << chunk[t].out.str();
+					logPr+=chunk[t].logPr;
+					Nbo+=chunk[t].Nbo; Nw+=chunk[t].Nw; Noov+=chunk[t].Noov;
+				}
+				if (nc>1) lmt->setConcurrent(false);
+				
+				delete [] chunk;
+				delete [] tid;
+			}
 			
 #ifdef TRACE_CACHE
 			lmt.init_probcache();
 #endif
 			double bow; int bol=0; 
-			while(inptxt >> ng){      
+			
+			//with interleaved lookups n-grams are read and scored in blocks
+			size_t bsize=(interleave>0 && debug<4?EVALBLOCK:1);
+			std::vector<ngram> block;
+			std::vector<double> blockpr(bsize),blockbow(bsize);
+			std::vector<int> blockbol(bsize);
+			std::vector<double> dist; //next word distribution for debug 4
+			lmt->setInterleave(interleave);
+			
+			bool more=!whole;
+			while(more){
 				
-				if (ng.size>lmt->maxlevel()) ng.size=lmt->maxlevel();
+				block.clear();
+				while (block.size()<bsize){
+					if (!(inptxt >> ng)){ more=false; break; }
+					
+					if (ng.size>lmt->maxlevel()) ng.size=lmt->maxlevel();
+					
+					// reset ngram at begin of sentence
+					//if (*ng.wordp(1)==bos) continue;
+					if (*ng.wordp(1)==bos) {ng.size=1;continue;}
+					
+					if (ng.size>=1) block.push_back(ng);
+				}
 				
-				// reset ngram at begin of sentence
-				//if (*ng.wordp(1)==bos) continue;
-				if (*ng.wordp(1)==bos) {ng.size=1;continue;}
+				if (bsize>1 && block.size()>0)
+					lmt->lprob_batch(&block[0],block.size(),&blockpr[0],&blockbol[0],NULL,NULL,&blockbow[0]);
 				
-				if (ng.size>=1){ 
-					logPr+=(Pr=lmt->lprob(ng,&bow,&bol)); 
+				for (size_t b=0;b<block.size();b++){
+					ngram& g=block[b];
+					
+					if (bsize>1){ Pr=blockpr[b]; bow=blockbow[b]; bol=blockbol[b]; }
+					else Pr=lmt->lprob(g,&bow,&bol);
+					logPr+=Pr;
 					
 					if (debug==1){
-						std::cout << ng.dict->decode(*ng.wordp(1)) << "[" << ng.size-bol << "]" << " "; 
-						if (*ng.wordp(1)==eos) std::cout << std::endl;
+						std::cout << g.dict->decode(*g.wordp(1)) << "[" << g.size-bol << "]" << " "; 
+						if (*g.wordp(1)==eos) std::cout << std::endl;
 					}
 					if (debug==2)
-						std::cout << ng << "[" << ng.size-bol << "-gram]" << " " << Pr << std::endl; 
+						std::cout << g << "[" << g.size-bol << "-gram]" << " " << Pr << std::endl; 
 					
 					if (debug==3)
-						std::cout << ng << "[" << ng.size-bol << "-gram]" << " " << Pr << " bow:" << bow << std::endl; 
+						std::cout << g << "[" << g.size-bol << "-gram]" << " " << Pr << " bow:" << bow << std::endl; 
 					
 					if (debug>3){
-						lmt->maxsuffptr(ng,&statesize);	
-						std::cout << ng << "[" << ng.size-bol << "-gram: recombine:" << statesize << "]" << " " << Pr << " bow:" << bow;
-						double totp=0.0; int oldw=*ng.wordp(1);
+						lmt->maxsuffptr(g,&statesize);	
+						std::cout << g << "[" << g.size-bol << "-gram: recombine:" << statesize << "]" << " " << Pr << " bow:" << bow;
 						double oovp=lmt->getlogOOVpenalty();lmt->setlogOOVpenalty2(0);
 						
-						for (int c=0;c<ng.dict->size();c++){
-							*ng.wordp(1)=c;totp+=pow(10.0,lmt->lprob(ng));
-						}
-						*ng.wordp(1)=oldw;
+						//total probability of the words following the history
+						ngram h=g; h.shift();
+						if (dist.size()<(size_t)g.dict->size()) dist.resize(g.dict->size());
+						double totp=lmt->distmass(h,&dist[0]);
 						
 						if ( totp < (1.0 - 1e-5) || totp > (1.0 + 1e-5))
 							std::cout << "  [t=" << totp << "] POSSIBLE ERROR\n";
@@ -308,7 +551,7 @@ int main(int argc, const char **argv)
 						lmt->setlogOOVpenalty2((double)oovp);
 					}
 					
-					if (*ng.wordp(1) == lmt->dict->oovcode()) Noov++; 
+					if (*g.wordp(1) == lmt->dict->oovcode()) Noov++; 
 					if (bol) Nbo++;       
 					Nw++;                 
 				}
@@ -316,12 +559,14 @@ int main(int argc, const char **argv)
 			
 			PP=exp((-logPr * log(10.0)) /Nw);
 			
-			PPwp= PP * (1 - 1/exp((Noov *  lmt->getlogOOVpenalty()) * log(10.0) / Nw));
+			double oovp=(view?view->getlogOOVpenalty():lmt->getlogOOVpenalty());
+			PPwp= PP * (1 - 1/exp((Noov * oovp) * log(10.0) / Nw));
 			
 			std::cout << "%% Nw=" << Nw << " PP=" << PP << " PPwp=" << PPwp
 			<< " Nbo=" << Nbo << " Noov=" << Noov 
 			<< " OOV=" << (float)Noov/Nw * 100.0 << "%" << std::endl;
 			
+			if (view) delete view;
 			delete lmt;
 			return 0;    
 		}
@@ -334,9 +579,9 @@ int main(int argc, const char **argv)
 		std::cout.setf(ios::scientific);
 		std::cout << "> ";
 		
-		//use caches to save time
-		//lmt->init_probcache();
-		//lmt->init_lmtcaches(lmt->maxlevel());
+		//use caches to save time, possibly warmed up by a snapshot
+		lmt->init_lmtcaches(lmt->maxlevel());
+		if (sloadcaches != "") lmt->load_caches(sloadcaches.c_str());
 		
 		unsigned int n=0; int bol; double bow;
 		while(std::cin >> ng){
@@ -347,10 +592,6 @@ int main(int argc, const char **argv)
 				std::cout << ng << " p= " << lmt->lprob(ng,&bow,&bol) * M_LN10;
 				
 				std::cout << " bo= " << bol << std::endl;
-				if ((n % 10000000)==0){ 
-					std::cerr << "check cache levels" << std::endl;
-					lmt->check_cache_levels();   
-				}        
                 
 			}
 			else
@@ -358,6 +599,62 @@ int main(int argc, const char **argv)
 			std::cout << "> ";                 
 		}
 		
+		if (ssavecaches != "") lmt->save_caches(ssavecaches.c_str());
+		delete lmt;
+		return 0;
+	}
+	
+	if (smatch == "yes"){
+		
+		//sentences are read one per line and preceded by <s> if missing
+		lmt->dict->incflag(1);
+		int bos=lmt->dict->encode(lmt->dict->BoS());
+		lmt->dict->incflag(0);
+		
+		std::string line,w;
+		std::vector<int> ids,order;
+		while(std::getline(std::cin,line)){
+			std::istringstream words(line);
+			ids.clear(); ids.push_back(bos);
+			while(words >> w) ids.push_back(lmt->dict->encode(w.c_str()));
+			size_t first=(ids.size()>1 && ids[1]==bos?1:0);
+			
+			order.resize(ids.size());
+			lmt->longestmatch(&ids[first],ids.size()-first,&order[first]);
+			
+			for (size_t i=1;i<ids.size();i++){
+				if (i>1) std::cout << " ";
+				if (debug>0) std::cout << lmt->dict->decode(ids[i]) << "[" << order[i] << "]";
+				else std::cout << order[i];
+			}
+			std::cout << "\n";
+		}
+		
+		delete lmt;
+		return 0;
+	}
+	
+	if (topwords > 0){
+		
+		//histories are read one per line: words not in the LM are OOV
+		std::vector<int> words(topwords);
+		std::vector<double> logpr(topwords);
+		std::string line,w;
+		while(std::getline(std::cin,line)){
+			std::istringstream hwords(line);
+			ngram h(lmt->dict);
+			while(hwords >> w) h.pushw(w.c_str());
+			if (h.size>=lmt->maxlevel()) h.size=lmt->maxlevel()-1;
+			
+			int k=lmt->topk(h,topwords,&words[0],&logpr[0]);
+			for (int i=h.size;i>0;i--)
+				std::cout << lmt->dict->decode(*h.wordp(i)) << " ";
+			std::cout << "=> " << k;
+			for (int i=0;i<k;i++)
+				std::cout << " " << lmt->dict->decode(words[i]) << " " << logpr[i];
+			std::cout << "\n";
+		}
+		
 		delete lmt;
 		return 0;
 	}
@@ -367,7 +664,10 @@ int main(int argc, const char **argv)
 		lmt->savetxt(outfile.c_str());    
 	} else if (!memmap) {
 		std::cout << "Saving in bin format to " << outfile << std::endl;
-		lmt->savebin(outfile.c_str());
+		//the layout of a binary input LM is kept unless another is requested
+		bool packed=(spacked == "yes" || (spacked == "" && scolumnar != "yes" && lmt->isPackedTable()));
+		bool columnar=(scolumnar == "yes" || (scolumnar == "" && spacked != "yes" && lmt->isColumnarTable()));
+		lmt->savebin(outfile.c_str(),packed,columnar);
 	}
 	delete lmt;
 	return 0;
@@ -32,6 +32,7 @@ using namespace std;
 #include "math.h"
 //#include "dictionary.h"
 #include "lmtable.h"
+#include "lmmixture.h"
 
 /* GLOBAL OPTIONS ***************/
 
@@ -42,11 +43,19 @@ std::string sscore = "no";
 std::string sdebug = "0";
 std::string smemmap = "0";
 std::string sdub = "10000000"; // 10^7
+std::string sinterleave = "0";
+std::string smerge = "";
+std::string squantize = "no";
+std::string scollapse = "";
+std::string scachebudget = "0";
+std::string scacheperiod = "1000000";
+std::string scacheminhit = "0.2";
 
 
 /********************************/
 
-lmtable *load_lm(std::string file,int dub,int memmap);
+lmtable *load_lm(std::string file,int dub,int memmap,int interleave,size_t cachebudget=0,int cacheperiod=LMTADAPTPERIOD,double cacheminhit=LMTCACHEMINHIT);
+int mixcodes(lmmixture* mix,std::vector<int>& tmap,ngram& ng,int* codes);
 
 void usage(const char *msg = 0) {
   if (msg) { std::cerr << msg << std::endl; }
@@ -57,7 +66,8 @@ void usage(const char *msg = 0) {
             << "  It estimates new weights on a development text, " << std::endl
 			<< "  computes the perplexity on an evaluation text, " << std::endl
 			<< "  computes probabilities of n-grams read from stdin." << std::endl
-			<< "  It reads LMs in ARPA and IRSTLM binary format." << std::endl  << std::endl;
+			<< "  It reads LMs in ARPA and IRSTLM binary format." << std::endl
+			<< "  The LM list file can also be a merged LM saved by --merge." << std::endl  << std::endl;
 			
   std::cerr << "Options:\n"
             << "--learn|-l text-file learn optimal interpolation for text-file"<< std::endl
@@ -66,6 +76,13 @@ void usage(const char *msg = 0) {
             << "--dub dict-size      dictionary upperbound (default 10^7)"<< std::endl
             << "--score|-s [yes|no]  compute log-probs of n-grams from stdin"<< std::endl
             << "--debug|-d [1-3]     verbose output for --eval option (see compile-lm)"<< std::endl
+            << "--interleave|-il K   --eval looks up K n-grams in turn (see compile-lm)"<< std::endl
+            << "--merge|-mg file     save the LMs merged in one trie into file and use it"<< std::endl
+            << "--quantize|-q [yes|no] quantize probs of the merged LM (default no)"<< std::endl
+            << "--collapse|-cl file  save the mixture as a single back-off LM (ARPA, or binary if file ends with .blm)"<< std::endl
+            << "--cachebudget|-cb M  tune the caches of each LM within M Mb (default 0: fixed caches)"<< std::endl
+            << "--cacheperiod|-cp N  table lookups between two tunings of the caches (default 10^6)"<< std::endl
+            << "--cacheminhit|-cm R  drop the level caches hitting less than R of their lookups (default 0.2)"<< std::endl
             << "--memmap| -mm 1      use memory map to read a binary LM\n" ;
 }
 
@@ -122,6 +139,34 @@ void handle_option(const std::string& opt, int argc, const char **argv, int& arg
     if (starts_with(opt, "--dub") || starts_with(opt, "-dub"))
       sdub = get_param(opt, argc, argv, argi);     
   
+  else
+    if (starts_with(opt, "--interleave") || starts_with(opt, "-il"))
+      sinterleave = get_param(opt, argc, argv, argi);     
+  
+  else
+    if (starts_with(opt, "--merge") || starts_with(opt, "-mg"))
+      smerge = get_param(opt, argc, argv, argi);     
+  
+  else
+    if (starts_with(opt, "--quantize") || starts_with(opt, "-q"))
+      squantize = get_param(opt, argc, argv, argi);     
+  
+  else
+    if (starts_with(opt, "--collapse") || starts_with(opt, "-cl"))
+      scollapse = get_param(opt, argc, argv, argi);     
+  
+  else
+    if (starts_with(opt, "--cachebudget") || starts_with(opt, "-cb"))
+      scachebudget = get_param(opt, argc, argv, argi);     
+  
+  else
+    if (starts_with(opt, "--cacheperiod") || starts_with(opt, "-cp"))
+      scacheperiod = get_param(opt, argc, argv, argi);     
+  
+  else
+    if (starts_with(opt, "--cacheminhit") || starts_with(opt, "-cm"))
+      scacheminhit = get_param(opt, argc, argv, argi);     
+  
   else {
     usage(("Don't understand option " + opt).c_str());
     exit(1);
@@ -145,8 +190,14 @@ int main(int argc, const char **argv)
 	int debug = atoi(sdebug.c_str()); 
 	int memmap = atoi(smemmap.c_str());
 	int dub = atoi(sdub.c_str()); //dictionary upper bound
+	int interleave = atoi(sinterleave.c_str());
+	size_t cachebudget = (size_t)(atof(scachebudget.c_str()) * 1024 * 1024);
+	int cacheperiod = atoi(scacheperiod.c_str());
+	double cacheminhit = atof(scacheminhit.c_str());
 
 	if (sorder != "" && order < 1) {usage("Order must be a positive integer"); exit(1);} 
+	if (cacheperiod < 1) {usage("Cache period must be a positive integer"); exit(1);} 
+	if (cacheminhit < 0 || cacheminhit > 1) {usage("Cache min hit rate must be between 0 and 1"); exit(1);} 
 
 	if (files.size() > 2) { usage("Too many arguments"); exit(1); }
 	if (files.size() < 1) { usage("Please specify a LM list file to read from"); exit(1); }
@@ -177,6 +228,7 @@ int main(int argc, const char **argv)
 	
 	lmtable *lmt[100], *start_lmt[100]; //interpolated language models
 	std::string lmf[100]; //lm filenames
+	lmmixture *mix=NULL; //LMs merged in one trie
 		
 	float w[100]; //interpolation weights
 	int N;
@@ -185,16 +237,33 @@ int main(int argc, const char **argv)
 	//Loading Language Models
 	std::cerr << "Reading " << infile << "..." << std::endl;  
 	std::fstream inptxt(infile.c_str(),std::ios::in);
-	inptxt >> N; std::cerr << "Number of LMs: " << N << "..." << std::endl;   
-	
-	if(N > 100) {
-		std::cerr << "Can't interpolate more than 100 language models." << std::endl;
-		exit(1);
+	std::string header;
+	inptxt >> header;
+
+	if (lmmixture::mixheader(header.c_str())){ //merged LMs
+		mix=new lmmixture;
+		mix->load(inptxt,header.c_str());
+		N=mix->components(); std::cerr << "Number of merged LMs: " << N << "..." << std::endl;
+		for (int i=0;i<N;i++){
+			w[i]=mix->getweight(i);
+			lmf[i]=mix->getlmfile(i);
+			start_lmt[i] = lmt[i] = NULL;
+		}
+		if (dub) mix->setlogOOVpenalty(dub);
+		if (smerge != ""){ usage("LMs are already merged"); exit(1); }
 	}
+	else{
+		N=atoi(header.c_str()); std::cerr << "Number of LMs: " << N << "..." << std::endl;   
+	
+		if(N > 100) {
+			std::cerr << "Can't interpolate more than 100 language models." << std::endl;
+			exit(1);
+		}
 
-	for (int i=0;i<N;i++){
-		inptxt >> w[i] >> lmf[i];
-		start_lmt[i] = lmt[i] = load_lm(lmf[i],dub,memmap);
+		for (int i=0;i<N;i++){
+			inptxt >> w[i] >> lmf[i];
+			start_lmt[i] = lmt[i] = load_lm(lmf[i],dub,memmap,interleave,cachebudget,cacheperiod,cacheminhit);
+		}
 	}
 	inptxt.close();
 	
@@ -209,6 +278,7 @@ int main(int argc, const char **argv)
 		dictionary* dict;dict=new dictionary((char*)slearn.c_str(),1000000,(char*)NULL,(char*)NULL);
 		ngram ng(dict); 
 		int bos=ng.dict->encode(ng.dict->BoS());
+		std::vector<int> tmap; //codes of dict words in the merged LM
 		std::ifstream dev(slearn.c_str(),std::ios::in);
 
 		for(;;) {
@@ -229,24 +299,45 @@ int main(int argc, const char **argv)
 					std::cerr << "LM id out of range." << std::endl;
 					return 1;
 				}
+				if (mix){
+					std::cerr << "LMs cannot be replaced in a merged LM." << std::endl;
+					return 1;
+				}
 				id--; // count from 0 now
 				if(lmt[id] != start_lmt[id])
 					delete lmt[id];
-				lmt[id] = load_lm(newlm,dub,memmap);
+				lmt[id] = load_lm(newlm,dub,memmap,interleave,cachebudget,cacheperiod,cacheminhit);
 				continue;
 			}
+			std::vector<ngram> ngs;
 			while(lstream >> ng){     
 				
 				// reset ngram at begin of sentence
 				if (*ng.wordp(1)==bos) {ng.size=1;continue;}
 				if (order > 0 && ng.size > order) ng.size=order;				
-				for (int i=0;i<N;i++){
-					ngram ong(lmt[i]->dict);ong.trans(ng);
-					p[i].push_back(pow(10.0,lmt[i]->clprob(ong))); //LM log-prob						
-				}	
+				ngs.push_back(ng);
 			}	
-		
-			for (int i=0;i<N;i++) lmt[i]->check_cache_levels();
+			
+			//n-grams of a line are scored together
+			if (ngs.size()>0 && mix){
+				std::vector<double> lp(N);
+				int codes[LMTMAXLEV];
+				for (unsigned j=0;j<ngs.size();j++){
+					int m=mixcodes(mix,tmap,ngs[j],codes);
+					mix->lprobs(codes,m,&lp[0]);
+					for (int i=0;i<N;i++)
+						p[i].push_back(pow(10.0,lp[i])); //LM log-prob
+				}
+			}
+			else if (ngs.size()>0)
+				for (int i=0;i<N;i++){
+					std::vector<ngram> ong(ngs.size(),ngram(lmt[i]->dict));
+					std::vector<double> lp(ngs.size());
+					for (unsigned j=0;j<ngs.size();j++) ong[j].trans(ngs[j]);
+					lmt[i]->clprob_batch(&ong[0],ngs.size(),&lp[0]);
+					for (unsigned j=0;j<ngs.size();j++)
+						p[i].push_back(pow(10.0,lp[j])); //LM log-prob
+				}
 		}
 		dev.close();
 
@@ -291,6 +382,33 @@ int main(int argc, const char **argv)
 			lmt[i] = start_lmt[i];
 		}
 
+	//merging the LMs: the merged trie replaces them
+	if ((smerge != "" || scollapse != "") && !mix){
+		mix=new lmmixture;
+		mix->build(lmt,N,w,lmf,squantize=="yes");
+		mix->stat();
+		if (smerge != "") mix->save(smerge.c_str());
+		for (int i=0;i<N;i++){
+			delete lmt[i];
+			start_lmt[i] = lmt[i] = NULL;
+		}
+	}
+
+	//static mixture with the current weights
+	if (scollapse != ""){
+		mix->setweights(w);
+		if (scollapse.size()>4 && scollapse.compare(scollapse.size()-4,4,".blm")==0){
+			std::string arpa=scollapse+".arpa";
+			mix->collapse(arpa.c_str());
+			lmtable *clmt=load_lm(arpa,0,0,0);
+			clmt->savebin(scollapse.c_str());
+			delete clmt;
+			removefile(arpa.c_str());
+		}
+		else
+			mix->collapse(scollapse.c_str());
+	}
+
 	if (seval != ""){
 		std::cerr << "Start Eval" << std::endl;
 		
@@ -307,6 +425,7 @@ int main(int argc, const char **argv)
 		ngram ng(dict); 
 		int bos=ng.dict->encode(ng.dict->BoS()); 
 		int eos=ng.dict->encode(ng.dict->EoS());
+		std::vector<int> tmap; //codes of dict words in the merged LM
    
 		std::fstream inptxt(seval.c_str(),std::ios::in);
 		
@@ -340,54 +459,83 @@ int main(int argc, const char **argv)
 					std::cerr << "LM id out of range." << std::endl;
 					return 1;
 				}
+				if (mix){
+					std::cerr << "LMs cannot be replaced in a merged LM." << std::endl;
+					return 1;
+				}
 				id--; // count from 0 now
 				delete lmt[id];
-				lmt[id] = load_lm(newlm,dub,memmap);
+				lmt[id] = load_lm(newlm,dub,memmap,interleave,cachebudget,cacheperiod,cacheminhit);
 				continue;
 			}
 
-			double bow; int bol=0;
-			
-					
+			std::vector<ngram> ngs;
 			while(lstream >> ng){      
 				
 				// reset ngram at begin of sentence
 				if (*ng.wordp(1)==bos) {ng.size=1;continue;}
 				if (order > 0 && ng.size > order) ng.size=order;	
 				
-				if (ng.size>=1){	
-				
-					int  minbol=MAX_NGRAM; //minimum backoff level of the mixture			
-					bool OOVflag=true;	  //OOV flag
-								
-					for (i=0,Pr=0;i<N;i++){
-						ngram ong(lmt[i]->dict);ong.trans(ng);
-						Pr+=w[i] * pow(10.0,lmt[i]->lprob(ong,&bow,&bol)); //LM log-prob	
-						if (bol < minbol) minbol=bol; //backoff of LM[i]						
-			        	if (*ong.wordp(1) != lmt[i]->dict->oovcode()) OOVflag=false;  //OOV wrt to LM[i]						
-					}
-					
-					logPr+=(log(Pr)/M_LN10);
-					
-					if (debug==1){
-						std::cout << ng.dict->decode(*ng.wordp(1)) << "[" << ng.size-minbol << "]" << " "; 
-						if (*ng.wordp(1)==eos) std::cout << std::endl;
+				if (ng.size>=1) ngs.push_back(ng);
+			}
+			if (ngs.size()==0) continue;
+			
+			//n-grams of a line are scored together by each LM
+			unsigned n=ngs.size(),j;
+			std::vector<double> mixpr(n,0.0),lp(n),bow(n);
+			std::vector<int> minbol(n,MAX_NGRAM),bol(n); //minimum backoff level of the mixture
+			std::vector<bool> OOVflag(n,true);  //OOV flag
+			
+			if (mix){ //all LMs are looked up together
+				std::vector<double> mlp(N),mbow(N);
+				std::vector<int> mbol(N);
+				int codes[LMTMAXLEV];
+				for (j=0;j<n;j++){
+					int m=mixcodes(mix,tmap,ngs[j],codes);
+					mix->lprobs(codes,m,&mlp[0],&mbol[0],&mbow[0]);
+					for (i=0;i<N;i++){
+						mixpr[j]+=w[i] * pow(10.0,mlp[i]); //LM log-prob
+						if (mbol[i] < minbol[j]) minbol[j]=mbol[i]; //backoff of LM[i]
 					}
-					if (debug==2)
-						std::cout << ng << "[" << ng.size-minbol << "-gram]" << " " << logPr << std::endl; 
-					
-					if (debug==3)
-						std::cout << ng << "[" << ng.size-minbol << "-gram]" << " " << logPr << " bow:" << bow << std::endl; 
-					
-					
-					if (minbol) Nbo++; //all LMs have back-offed by at least one
-					
-					if (OOVflag) Noov++;
+					bow[j]=mbow[N-1];
+					if (codes[m-1] != mix->dict->oovcode()) OOVflag[j]=false; //OOV wrt to all LMs
+				}
+			}
+			else
+			for (i=0;i<N;i++){
+				std::vector<ngram> ong(n,ngram(lmt[i]->dict));
+				for (j=0;j<n;j++) ong[j].trans(ngs[j]);
+				lmt[i]->lprob_batch(&ong[0],n,&lp[0],&bol[0],NULL,NULL,&bow[0]);
+				for (j=0;j<n;j++){
+					mixpr[j]+=w[i] * pow(10.0,lp[j]); //LM log-prob
+					if (bol[j] < minbol[j]) minbol[j]=bol[j]; //backoff of LM[i]
+					if (*ong[j].wordp(1) != lmt[i]->dict->oovcode()) OOVflag[j]=false;  //OOV wrt to LM[i]
+				}
+			}
+			
+			for (j=0;j<n;j++){
+				ngram& g=ngs[j];
 				
-					Nw++;  
-					
-					if ((Nw % 10000)==0) std::cerr << ".";
+				logPr+=(log(mixpr[j])/M_LN10);
+				
+				if (debug==1){
+					std::cout << g.dict->decode(*g.wordp(1)) << "[" << g.size-minbol[j] << "]" << " "; 
+					if (*g.wordp(1)==eos) std::cout << std::endl;
 				}
+				if (debug==2)
+					std::cout << g << "[" << g.size-minbol[j] << "-gram]" << " " << logPr << std::endl; 
+				
+				if (debug==3) //bow of the last LM
+					std::cout << g << "[" << g.size-minbol[j] << "-gram]" << " " << logPr << " bow:" << bow[j] << std::endl; 
+				
+				
+				if (minbol[j]) Nbo++; //all LMs have back-offed by at least one
+				
+				if (OOVflag[j]) Noov++;
+				
+				Nw++;  
+				
+				if ((Nw % 10000)==0) std::cerr << ".";
 			}
 		}
 
@@ -407,6 +555,7 @@ int main(int argc, const char **argv)
 		dict->incflag(1); // start generating the dictionary;
 		ngram ng(dict); 
 		double Pr,logPr;
+		std::vector<int> tmap; //codes of dict words in the merged LM
 		
 		//use caches to save time
 		//lmt.init_probcache();
@@ -418,6 +567,15 @@ int main(int argc, const char **argv)
 		while(std::cin >> ng){
 			n++;
 			maxstatesize=0;
+			if (mix){
+				std::vector<double> lp(N);
+				int codes[LMTMAXLEV];
+				int m=mixcodes(mix,tmap,ng,codes);
+				mix->lprobs(codes,m,&lp[0]);
+				for (i=0,Pr=0;i<N;i++) Pr+=w[i] * pow(10.0,lp[i]); //LM log-prob
+				maxstatesize=mix->statesize(codes,m);
+			}
+			else
 			for (i=0,Pr=0;i<N;i++){
 				Pr+=w[i] * pow(10.0,lmt[i]->clprob(ng)); //LM log-prob	
 				lmt[i]->maxsuffptr(ng,&statesize);
@@ -428,11 +586,6 @@ int main(int argc, const char **argv)
 			ng.size=maxstatesize;
 			std::cout << "recombine= " << maxstatesize << " " << ng << " p= " << logPr  << std::endl;
 			
-			if ((n % 10000000)==0){ 
-				std::cerr << "check cache levels" << std::endl;
-				for (i=0;i<N;i++) lmt[i]->check_cache_levels();   
-			}
-			
 			
 			std::cout << "> ";                 
 		}
@@ -440,12 +593,17 @@ int main(int argc, const char **argv)
 
 	}
 
+	if (cachebudget)
+		for (int i=0;i<N;i++)
+			if (lmt[i]){ std::cerr << "LM " << i+1 << " "; lmt[i]->stat_caches(std::cerr); }
+	
 	for (int i=0;i<N;i++) delete lmt[i];
+	if (mix) delete mix;
 	
 	return 0;
 }
 
-lmtable *load_lm(std::string file,int dub,int memmap) {
+lmtable *load_lm(std::string file,int dub,int memmap,int interleave,size_t cachebudget,int cacheperiod,double cacheminhit) {
 	inputfilestream inplm(file.c_str());
 	std::cerr << "Reading " << file.c_str() << "..." << std::endl;  
 	lmtable *lmt=new lmtable;
@@ -454,6 +612,22 @@ lmtable *load_lm(std::string file,int dub,int memmap) {
 	else 
 		lmt->load(inplm,file.c_str(),NULL,memmap,NONE);   		
 	if (dub) lmt->setlogOOVpenalty(dub);	//set OOV Penalty for each LM
+	lmt->setInterleave(interleave);
 	lmt->init_probcache();
+	if (cachebudget) lmt->init_adaptive_caches(cachebudget,cacheperiod,cacheminhit);
 	return lmt;
 }
+
+//codes of the (most recent) words of ng in the dictionary of the merged
+//LM: each word of the dictionary of ng is translated once
+
+int mixcodes(lmmixture* mix,std::vector<int>& tmap,ngram& ng,int* codes){
+	int n=(ng.size>mix->maxlevel()?mix->maxlevel():ng.size);
+	for (int k=0;k<n;k++){
+		int c=*ng.wordp(n-k);
+		if (c>=(int)tmap.size()) tmap.resize(c+1,-1);
+		if (tmap[c]<0) tmap[c]=mix->dict->encode(ng.dict->decode(c));
+		codes[k]=tmap[c];
+	}
+	return n;
+}
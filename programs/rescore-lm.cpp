@@ -0,0 +1,614 @@
+// $Id$
+
+/******************************************************************************
+ IrstLM: IRST Language Model Toolkit, rescore n-best lists and lattices
+ Copyright (C) 2006 Marcello Federico, ITC-irst Trento, Italy
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+
+******************************************************************************/
+
+using namespace std;
+
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <string>
+#include <sstream>
+#include <map>
+#include <algorithm>
+#include <stdlib.h>
+#include <pthread.h>
+#include "util.h"
+#include "math.h"
+#include "lmtable.h"
+
+
+/* GLOBAL OPTIONS ***************/
+
+std::string snbest = "";
+std::string sslf = "";
+std::string soutdir = "";
+std::string sthreads = "1";
+std::string sdub = "10000000";//10^7
+std::string smemmap = "0";
+std::string sstprob = "16";
+/********************************/
+
+//sentences (or lattices) read and rescored at once by the threads
+#define RESCOREBLOCK 256
+
+//code of the words without LM score (!NULL of lattices)
+#define NULLWORD -1
+
+void usage(const char *msg = 0) {
+
+  if (msg) { std::cerr << msg << std::endl; }
+  std::cerr << "Usage: rescore-lm [options] lm-file" << std::endl;
+  if (!msg) std::cerr << std::endl
+    << "  rescore-lm adds the LM log-prob (natural log) of each hypothesis" << std::endl
+    << "  of n-best lists or HTK lattices. Hypotheses of a sentence are" << std::endl
+    << "  scored through a prefix tree of their LM states, so that each" << std::endl
+    << "  distinct pair of state and word is scored only once." << std::endl << std::endl;
+
+  std::cerr << "Options:\n"
+    << "--nbest|-n file (n-best list in the format: id ||| hypothesis ||| features ||| score;" << std::endl
+    << "                 the LM score is appended to the features as: irstlm= score;" << std::endl
+    << "                 the result is written to standard output)" << std::endl
+    << "--slf|-l file (list of HTK SLF lattices, one per line, which are expanded on the LM" << std::endl
+    << "               states and written with the LM scores in the l= fields of their links)" << std::endl
+    << "--outdir|-o dir (directory of the rescored lattices: default, next to each lattice with suffix .lm)" << std::endl
+    << "--threads|-th N (number of threads sharing the LM, each rescoring different sentences: default 1)" << std::endl
+    << "--stprobcache|-sp B (caches the scores of 2^B pairs of LM state and word across sentences; 0 disables the cache: default 16)" << std::endl
+    << "--dub dict-size (dictionary upperbound to compute OOV word penalty: default 10^7)" << std::endl
+    << "--memmap|-mm 1 (uses memory map to read a binary LM)\n";
+}
+
+bool starts_with(const std::string &s, const std::string &pre) {
+  if (pre.size() > s.size()) return false;
+
+  if (pre == s) return true;
+  std::string pre_equals(pre+'=');
+  if (pre_equals.size() > s.size()) return false;
+  return (s.substr(0,pre_equals.size()) == pre_equals);
+}
+
+std::string get_param(const std::string& opt, int argc, const char **argv, int& argi)
+{
+  std::string::size_type equals = opt.find_first_of('=');
+  if (equals != std::string::npos && equals < opt.size()-1) {
+    return opt.substr(equals+1);
+  }
+  std::string nexto;
+  if (argi + 1 < argc) {
+    nexto = argv[++argi];
+  } else {
+    usage((opt + " requires a value!").c_str());
+    exit(1);
+  }
+  return nexto;
+}
+
+void handle_option(const std::string& opt, int argc, const char **argv, int& argi)
+{
+  if (opt == "--help" || opt == "-h") { usage(); exit(1); }
+
+  if (starts_with(opt, "--nbest") || starts_with(opt, "-n"))
+    snbest = get_param(opt, argc, argv, argi);
+  else
+    if (starts_with(opt, "--slf") || starts_with(opt, "-l"))
+      sslf = get_param(opt, argc, argv, argi);
+  else
+    if (starts_with(opt, "--outdir") || starts_with(opt, "-o"))
+      soutdir = get_param(opt, argc, argv, argi);
+  else
+    if (starts_with(opt, "--threads") || starts_with(opt, "-th"))
+      sthreads = get_param(opt, argc, argv, argi);
+  else
+    if (starts_with(opt, "--stprobcache") || starts_with(opt, "-sp"))
+      sstprob = get_param(opt, argc, argv, argi);
+  else
+    if (starts_with(opt, "--memmap") || starts_with(opt, "-mm"))
+      smemmap = get_param(opt, argc, argv, argi);
+  else
+    if (starts_with(opt, "--dub"))
+      sdub = get_param(opt, argc, argv, argi);
+  else {
+    usage(("Don't understand option " + opt).c_str());
+    exit(1);
+  }
+}
+
+
+//scores of the words following the states of a sentence: as lprob of a
+//word only depends on the state of its history (see lmtstate), each
+//distinct pair of state entry and word is scored once; pairs of other
+//sentences are found in the state-keyed prob cache of the LM, if any
+
+struct stateword{
+  const char* link;
+  int lev,w;
+  bool operator<(const stateword& s) const {
+    if (link!=s.link) return link<s.link;
+    if (lev!=s.lev) return lev<s.lev;
+    return w<s.w;
+  }
+};
+
+struct statescore{
+  double lpr;
+  lmtstate st; //state of the extended history
+};
+
+class statescorer{
+  lmtable* lmt;
+  std::map<stateword,statescore> scored;
+ public:
+  long calls,lookups; //scores requested and computed
+
+  statescorer(lmtable* l):lmt(l),calls(0),lookups(0){}
+
+  void clear(){scored.clear();}
+
+  //log10 prob of w after state st, and the state after w
+  double score(const lmtstate& st,int w,lmtstate& outst){
+    stateword k; k.link=st.link; k.lev=st.lev; k.w=w;
+    calls++;
+    std::map<stateword,statescore>::iterator it=scored.find(k);
+    if (it==scored.end()){
+      statescore s;
+      s.lpr=lmt->clprob(st,w,&s.st);
+      it=scored.insert(std::make_pair(k,s)).first;
+      lookups++;
+    }
+    outst=it->second.st;
+    return it->second.lpr;
+  }
+};
+
+
+//n-best lists: hypotheses of a sentence, encoded in advance so that
+//threads only read the LM
+
+struct nbestsent{
+  std::vector<std::string> lines;
+  std::vector<size_t> ins;               //end of the features in the lines
+  std::vector< std::vector<int> > words; //including </s>
+  std::vector<double> logpr;
+};
+
+//hypotheses of a sentence are scored in lexicographic order, so that
+//the prefix shared with the previous one, i.e. a path of the prefix tree
+//of the hypotheses, is not scored again
+
+struct hypless{
+  const std::vector< std::vector<int> >* words;
+  bool operator()(int a,int b) const {return (*words)[a]<(*words)[b];}
+};
+
+void rescorenbest(statescorer& sc,lmtstate& start,nbestsent& s){
+
+  std::vector<int> order(s.words.size());
+  for (size_t h=0;h<order.size();h++) order[h]=h;
+  hypless less; less.words=&s.words;
+  std::sort(order.begin(),order.end(),less);
+
+  //states and log-probs of the prefixes of the previous hypothesis
+  std::vector<lmtstate> st(1,start);
+  std::vector<double> lp(1,0.0);
+  const std::vector<int>* prev=NULL;
+  sc.clear();
+
+  s.logpr.resize(s.words.size());
+  for (size_t k=0;k<order.size();k++){
+    const std::vector<int>& hyp=s.words[order[k]];
+    size_t c=0;
+    if (prev) while (c<hyp.size() && c<prev->size() && hyp[c]==(*prev)[c]) c++;
+
+    if (st.size()<hyp.size()+1){ st.resize(hyp.size()+1); lp.resize(hyp.size()+1); }
+    for (size_t i=c;i<hyp.size();i++)
+      lp[i+1]=lp[i]+sc.score(st[i],hyp[i],st[i+1]);
+
+    s.logpr[order[k]]=lp[hyp.size()];
+    prev=&hyp;
+  }
+}
+
+
+//SLF lattices: nodes and links with their other fields, which are copied
+//to the expanded lattice; words are those of the links or of their end
+//nodes
+
+struct lattice{
+  std::string name;
+  std::vector<std::string> header;
+  double base;                   //base of the logs (e if 0)
+  bool linkwords;                //words are given on links
+  std::vector<std::string> nattr;
+  std::vector<int> nword;
+  std::vector<int> ls,le,lw;
+  std::vector<std::string> lattr;
+  bool ok;
+  //expanded lattice
+  std::ostringstream out;
+  long nodes,links;
+};
+
+int slfword(lmtable* lmt,std::string w){
+  if (w=="!NULL") return NULLWORD;
+  if (w=="!SENT_START") w=lmt->dict->BoS();
+  if (w=="!SENT_END") w=lmt->dict->EoS();
+  return lmt->dict->encode(w.c_str());
+}
+
+void readslf(lmtable* lmt,lattice& lat){
+
+  inputfilestream inp(lat.name.c_str());
+  lat.ok=inp.good();
+  lat.base=0; lat.linkwords=false;
+  if (!lat.ok) return;
+
+  std::string line,f;
+  while (std::getline(inp,line)){
+    std::istringstream fields(line);
+    std::string attr="";
+    int id=-1,s=-1,e=-1,w=NULLWORD;
+    bool node=false,link=false,hasw=false;
+
+    while (fields >> f){
+      std::string::size_type eq=f.find('=');
+      std::string k=f.substr(0,eq),v=(eq==std::string::npos?"":f.substr(eq+1));
+      if (k=="I"){ node=true; id=atoi(v.c_str()); }
+      else if (k=="J"){ link=true; id=atoi(v.c_str()); }
+      else if (k=="S" && link) s=atoi(v.c_str());
+      else if (k=="E" && link) e=atoi(v.c_str());
+      else if (k=="W" && (node || link)){ hasw=true; w=slfword(lmt,v); if (node) attr+=" "+f; }
+      else if (k=="l" && link) continue; //replaced by the LM score
+      else{
+        if (k=="base" && !node && !link) lat.base=atof(v.c_str());
+        attr+=" "+f;
+      }
+    }
+
+    if (node){
+      if (id>=(int)lat.nword.size()){ lat.nword.resize(id+1,NULLWORD); lat.nattr.resize(id+1); }
+      lat.nword[id]=w; lat.nattr[id]=attr;
+    }
+    else if (link){
+      if (id>=(int)lat.ls.size()){
+        lat.ls.resize(id+1,-1); lat.le.resize(id+1,-1); lat.lw.resize(id+1,NULLWORD); lat.lattr.resize(id+1);
+      }
+      lat.ls[id]=s; lat.le[id]=e; lat.lw[id]=w; lat.lattr[id]=attr;
+      if (hasw) lat.linkwords=true;
+    }
+    else if (line.size()>0 && line.compare(0,2,"N=")!=0) //sizes are those of the expanded lattice
+      lat.header.push_back(line);
+  }
+
+  for (size_t j=0;j<lat.ls.size();j++){
+    if (lat.ls[j]<0 || lat.ls[j]>=(int)lat.nword.size() || lat.le[j]<0 || lat.le[j]>=(int)lat.nword.size()){
+      std::cerr << lat.name << ": link " << j << " has no valid start or end node" << std::endl;
+      lat.ok=false; return;
+    }
+    if (!lat.linkwords) lat.lw[j]=lat.nword[lat.le[j]];
+  }
+}
+
+//expands the lattice on the LM states: a node of the new lattice is a
+//node of the input one with the state of the histories reaching it, so
+//that the LM score of each link only depends on its start node
+
+void rescoreslf(lmtable* lmt,statescorer& sc,lmtstate& start,int bos,lattice& lat){
+
+  int nn=lat.nword.size(),nl=lat.ls.size();
+  sc.clear();
+
+  //nodes in topological order, from the ones without incoming links
+  std::vector<int> indeg(nn,0),order;
+  std::vector< std::vector<int> > outl(nn);
+  for (int j=0;j<nl;j++){ outl[lat.ls[j]].push_back(j); indeg[lat.le[j]]++; }
+  for (int i=0;i<nn;i++) if (indeg[i]==0) order.push_back(i);
+  size_t sources=order.size();
+  for (size_t k=0;k<order.size();k++)
+    for (size_t j=0;j<outl[order[k]].size();j++)
+      if (--indeg[lat.le[outl[order[k]][j]]]==0) order.push_back(lat.le[outl[order[k]][j]]);
+  if ((int)order.size()<nn){
+    std::cerr << lat.name << ": lattice is not acyclic" << std::endl;
+    lat.ok=false; return;
+  }
+
+  //expanded nodes: input node and state
+  std::vector<int> enode;
+  std::vector<lmtstate> estate;
+  std::vector< std::vector<int> > expanded(nn);
+  std::map<stateword,int> eid;
+
+  std::ostringstream links;
+  lat.links=0;
+  double scale=M_LN10/(lat.base>0?log(lat.base):1.0);
+
+  for (size_t k=0;k<sources;k++){
+    expanded[order[k]].push_back(enode.size());
+    enode.push_back(order[k]); estate.push_back(start);
+  }
+
+  for (size_t k=0;k<order.size();k++){
+    int i=order[k];
+    for (size_t x=0;x<expanded[i].size();x++){
+      int from=expanded[i][x];
+      for (size_t j=0;j<outl[i].size();j++){
+        int l=outl[i][j],w=lat.lw[l];
+        lmtstate st;
+        double lpr=0.0;
+
+        if (w==NULLWORD) st=estate[from];
+        else if (w==bos) st=start;
+        else lpr=sc.score(estate[from],w,st);
+
+        stateword key; key.link=st.link; key.lev=st.lev; key.w=lat.le[l];
+        std::map<stateword,int>::iterator it=eid.find(key);
+        if (it==eid.end()){
+          it=eid.insert(std::make_pair(key,(int)enode.size())).first;
+          expanded[lat.le[l]].push_back(enode.size());
+          enode.push_back(lat.le[l]); estate.push_back(st);
+        }
+
+        links << "J=" << lat.links++ << " S=" << from << " E=" << it->second;
+        if (lat.linkwords) links << " W=" << (w==NULLWORD?"!NULL":lmt->dict->decode(w));
+        links << lat.lattr[l] << " l=" << lpr * scale << "\n";
+      }
+    }
+  }
+
+  lat.nodes=enode.size();
+  for (size_t h=0;h<lat.header.size();h++) lat.out << lat.header[h] << "\n";
+  lat.out << "N=" << lat.nodes << " L=" << lat.links << "\n";
+  for (size_t n=0;n<enode.size();n++) lat.out << "I=" << n << lat.nattr[enode[n]] << "\n";
+  lat.out << links.str();
+}
+
+
+//data of a thread rescoring some sentences (or lattices) of a block
+
+struct rescorejob{
+  lmtable* lmt;
+  int first,step;
+  std::vector<nbestsent>* sents;
+  std::vector<lattice*>* lats;
+  int bos;
+  lmtstate start; //state of <s>
+  long calls,lookups;
+};
+
+void* rescorethread(void* arg){
+  rescorejob* j=(rescorejob*) arg;
+  statescorer sc(j->lmt);
+
+  if (j->sents)
+    for (size_t s=j->first;s<j->sents->size();s+=j->step)
+      rescorenbest(sc,j->start,(*j->sents)[s]);
+  else
+    for (size_t s=j->first;s<j->lats->size();s+=j->step)
+      if ((*j->lats)[s]->ok) rescoreslf(j->lmt,sc,j->start,j->bos,*(*j->lats)[s]);
+
+  j->calls=sc.calls; j->lookups=sc.lookups;
+  return NULL;
+}
+
+//runs the threads on a block and returns the scores requested and computed
+
+void rescoreblock(std::vector<rescorejob>& jobs,std::vector<nbestsent>* sents,std::vector<lattice*>* lats,
+                  long& calls,long& lookups){
+
+  int nt=jobs.size();
+  std::vector<pthread_t> tid(nt);
+  for (int t=0;t<nt;t++){
+    jobs[t].sents=sents; jobs[t].lats=lats;
+    if (nt>1) pthread_create(&tid[t],NULL,rescorethread,&jobs[t]);
+    else rescorethread(&jobs[t]);
+  }
+  for (int t=0;t<nt;t++){
+    if (nt>1) pthread_join(tid[t],NULL);
+    calls+=jobs[t].calls; lookups+=jobs[t].lookups;
+  }
+}
+
+//reads a n-best line: its id, the end of its features, where the LM
+//score is added, and the codes of its words
+
+std::string parsenbest(lmtable* lmt,const std::string& line,size_t& ins,std::vector<int>& words){
+
+  std::string::size_type f1=line.find("|||"),f2,f3;
+  f2=(f1==std::string::npos?std::string::npos:line.find("|||",f1+3));
+  f3=(f2==std::string::npos?std::string::npos:line.find("|||",f2+3));
+
+  std::string::size_type b=line.find_first_not_of(" \t"),e=line.find_last_not_of(" \t",f1==0?0:f1-1);
+  std::string id=(b<f1 && e!=std::string::npos && e>=b?line.substr(b,e-b+1):"");
+
+  //features end at their last character, or at the field start if empty
+  if (f2==std::string::npos) ins=line.size();
+  else{
+    ins=(f3==std::string::npos?line.size():f3);
+    while (ins>f2+3 && (line[ins-1]==' ' || line[ins-1]=='\t')) ins--;
+  }
+
+  words.clear();
+  if (f1!=std::string::npos){
+    std::string w;
+    size_t end=(f2==std::string::npos?line.size():f2);
+    for (size_t i=f1+3;i<end;){
+      while (i<end && (line[i]==' ' || line[i]=='\t')) i++;
+      size_t j=i;
+      while (j<end && line[j]!=' ' && line[j]!='\t') j++;
+      if (j>i){ w.assign(line,i,j-i); words.push_back(lmt->dict->encode(w.c_str())); }
+      i=j;
+    }
+  }
+  return id;
+}
+
+
+int main(int argc, const char **argv)
+{
+
+  if (argc < 2) { usage(); exit(1); }
+  std::vector<std::string> files;
+  for (int i=1; i < argc; i++) {
+    std::string opt = argv[i];
+    if (opt[0] == '-' && opt.size()>1) { handle_option(opt, argc, argv, i); }
+    else files.push_back(opt);
+  }
+
+  if (files.size() > 1) { usage("Too many arguments"); exit(1); }
+  if (files.size() < 1) { usage("Please specify a LM file to read from"); exit(1); }
+  if ((snbest == "") == (sslf == "")) { usage("Please specify either a n-best list or a list of lattices"); exit(1); }
+
+  int threads = atoi(sthreads.c_str());
+  int memmap = atoi(smemmap.c_str());
+  int dub = atoi(sdub.c_str());
+  int stprob = atoi(sstprob.c_str());
+  if (threads < 1) { usage("Number of threads must be a positive integer"); exit(1); }
+  if (stprob < 0 || stprob > 30) { usage("Size of the state-keyed prob cache must be 0 (no cache) to 30"); exit(1); }
+
+  lmtable* lmt=new lmtable();
+
+  std::cerr << "Reading " << files[0] << "..." << std::endl;
+  inputfilestream inp(files[0].c_str());
+  if (!inp.good()) {
+    std::cerr << "Failed to open " << files[0] << "!" << std::endl;
+    exit(1);
+  }
+  lmt->load(inp,files[0].c_str(),NULL,memmap,NONE);
+  if (dub) lmt->setlogOOVpenalty(dub);
+  if (stprob > 0) lmt->init_stprobcache(stprob);
+
+  lmt->dict->incflag(1);
+  int bos=lmt->dict->encode(lmt->dict->BoS());
+  int eos=lmt->dict->encode(lmt->dict->EoS());
+  lmt->dict->incflag(0);
+
+  std::vector<rescorejob> jobs(threads);
+  for (int t=0;t<threads;t++){
+    jobs[t].lmt=lmt; jobs[t].first=t; jobs[t].step=threads; jobs[t].bos=bos;
+    lmt->lprob(lmtstate(),bos,&jobs[t].start);
+  }
+  if (threads>1) lmt->setConcurrent(true);
+
+  long items=0,hyps=0,words=0,calls=0,lookups=0;
+
+  if (snbest != ""){
+    inputfilestream nb(snbest.c_str());
+    if (!nb.good()) { std::cerr << "Failed to open " << snbest << "!" << std::endl; exit(1); }
+
+    std::cout.setf(ios::fixed);
+    std::cout.precision(4);
+
+    std::vector<nbestsent> block;
+    std::vector<int> hyp;
+    std::string line,id,lid;
+    size_t ins;
+
+    for (;;){
+      //a sentence is a group of consecutive lines with the same id
+      bool more=(bool)std::getline(nb,line),newsent=false;
+      if (more){
+        lid=parsenbest(lmt,line,ins,hyp);
+        newsent=(block.size()==0 || lid!=id);
+      }
+
+      if (block.size()>0 && (!more || (newsent && block.size()==RESCOREBLOCK))){
+        rescoreblock(jobs,&block,NULL,calls,lookups);
+        for (size_t s=0;s<block.size();s++)
+          for (size_t h=0;h<block[s].lines.size();h++){
+            const std::string& l=block[s].lines[h];
+            size_t p=block[s].ins[h];
+            std::cout.write(l.data(),p);
+            if (p==l.size() && l.find("|||")==l.rfind("|||")) std::cout << " |||";
+            std::cout << " irstlm= " << block[s].logpr[h] * M_LN10;
+            if (p<l.size()) std::cout << " " << (l.c_str()+p+(l[p]==' '?1:0));
+            std::cout << "\n";
+          }
+        block.clear();
+      }
+      if (!more) break;
+
+      if (newsent){
+        block.push_back(nbestsent());
+        id=lid;
+        items++;
+      }
+      nbestsent& s=block.back();
+      if (hyp.size()>0 && hyp[0]==bos) hyp.erase(hyp.begin());
+      if (hyp.size()==0 || hyp.back()!=eos) hyp.push_back(eos);
+      s.lines.push_back(line);
+      s.ins.push_back(ins);
+      s.words.push_back(hyp);
+      hyps++; words+=hyp.size();
+    }
+    std::cerr << "%% sentences=" << items << " hypotheses=" << hyps << " words=" << words;
+  }
+  else{
+    inputfilestream ls(sslf.c_str());
+    if (!ls.good()) { std::cerr << "Failed to open " << sslf << "!" << std::endl; exit(1); }
+
+    std::vector<lattice*> block;
+    std::string name;
+    bool more=true;
+    long nodes=0,links=0;
+
+    while (more){
+      more=(bool)(ls >> name);
+      if (more){
+        lattice* lat=new lattice;
+        lat->name=name;
+        readslf(lmt,*lat);
+        if (!lat->ok) std::cerr << "Failed to read " << name << "!" << std::endl;
+        block.push_back(lat);
+      }
+
+      if (block.size()==RESCOREBLOCK || (!more && block.size()>0)){
+        rescoreblock(jobs,NULL,&block,calls,lookups);
+        for (size_t k=0;k<block.size();k++){
+          lattice* lat=block[k];
+          if (lat->ok){
+            std::string outname=lat->name;
+            if (outname.compare(outname.size()>3?outname.size()-3:0,3,".gz")==0) outname.erase(outname.size()-3,3);
+            if (soutdir != ""){
+              std::string::size_type p=outname.rfind('/');
+              if (p != std::string::npos) outname.erase(0,p+1);
+              outname=soutdir+"/"+outname;
+            }
+            else outname+=".lm";
+
+            std::ofstream out(outname.c_str());
+            if (!out) std::cerr << "Failed to write " << outname << "!" << std::endl;
+            else out << lat->out.str();
+            nodes+=lat->nodes; links+=lat->links;
+            items++;
+          }
+          delete lat;
+        }
+        block.clear();
+      }
+    }
+    std::cerr << "%% lattices=" << items << " expanded nodes=" << nodes << " links=" << links;
+  }
+
+  std::cerr << " scores=" << calls << " lookups=" << lookups << std::endl;
+
+  if (threads>1) lmt->setConcurrent(false);
+  delete lmt;
+  return 0;
+}
@@ -335,7 +335,13 @@ dictionary::dictionary(dictionary* d, int sortflag){
     ifl=0;         //increment flag=0;
     dubv=d->dubv;  //dictionary upperbound transferred
     in_oov_lex=0;  //does not copy oovlex;
+    oovlex=(dictionary *)NULL;
 
+    is=(char*) NULL;
+    if (d->is) {
+        is=new char[strlen(d->is)+1];
+        strcpy(is,d->is);
+      }
 
     //creates a sorted copy of the table
 
@@ -80,6 +80,7 @@ lmmacro::lmmacro(string lmfilename, istream& inp, istream& inpMap){
   if (!loadmap(lmfilename, inp, inpMap))
     error((char*)"Error in loadmap\n");
 
+  microbos=dict->getcode(dict->BoS());
 };
 
 
@@ -284,15 +285,17 @@ double lmmacro::clprob(ngram micro_ng) {
 
     if (macro_ng.size>maxlev) macro_ng.size=maxlev;
 
+    ngramcache* pc=getprobcache();
+
     //cache hit
-    if (probcache && macro_ng.size==maxlev && probcache->get(macro_ng.wordp(maxlev),(char *)&logpr))
+    if (pc && macro_ng.size==maxlev && pc->get(macro_ng.wordp(maxlev),(char *)&logpr))
       return logpr;
 
     //cache miss
     logpr=lmmacro::lprob(macro_ng);
 
-    if (probcache && macro_ng.size==maxlev)
-      probcache->add(macro_ng.wordp(maxlev),(char *)&logpr);
+    if (pc && macro_ng.size==maxlev)
+      pc->add(macro_ng.wordp(maxlev),(char *)&logpr);
 
   } else {
 
@@ -316,20 +319,87 @@ double lmmacro::clprob(ngram micro_ng) {
 
     if (prevMacro_ng.size>maxlev) prevMacro_ng.size=maxlev;
 
+    ngramcache* pc=getprobcache();
+
     //cache hit
-    if (probcache && prevMacro_ng.size==maxlev && probcache->get(prevMacro_ng.wordp(maxlev),(char *)&logpr))
+    if (pc && prevMacro_ng.size==maxlev && pc->get(prevMacro_ng.wordp(maxlev),(char *)&logpr))
       return logpr;
 
     //cache miss
     logpr=lmmacro::lprob(prevMacro_ng);
 
-    if (probcache && prevMacro_ng.size==maxlev)
-      probcache->add(prevMacro_ng.wordp(maxlev),(char *)&logpr);
+    if (pc && prevMacro_ng.size==maxlev)
+      pc->add(prevMacro_ng.wordp(maxlev),(char *)&logpr);
   }
 
   return logpr;
 }; 
 
+//queries of micro n-grams with back-off outputs: the n-gram is mapped
+//and the macro LM is queried
+
+double lmmacro::maplprob(ngram micro_ng, double* bow, int* bol) {
+  ngram macro_ng(lmtable::getDict());
+  map(&micro_ng, &macro_ng);
+  return lmtable::lprob(macro_ng,bow,bol);
+}
+
+double lmmacro::lprob(const ngramview& v, double* bow, int* bol) {
+  ngram micro_ng(dict,v);
+  return maplprob(micro_ng,bow,bol);
+}
+
+void lmmacro::getstate(ngram h, lmtstate& st) {
+  if (h.size>=maxlev) h.size=maxlev-1;
+  st.size=st.lev=h.size;
+  for (int i=0;i<h.size;i++) st.word[i]=*h.wordp(h.size-i);
+  st.link=(h.size>0?lmmacro::maxsuffptr(h):NULL);
+}
+
+double lmmacro::lprob(const lmtstate& st, int w, lmtstate* outst, double* bow, int* bol) {
+  ngram micro_ng(dict);
+  for (int i=0;i<st.lev;i++) micro_ng.pushc(st.word[i]);
+  micro_ng.pushc(w);
+  double logpr=maplprob(micro_ng,bow,bol);
+  if (outst) getstate(micro_ng,*outst);
+  return logpr;
+}
+
+//as lmtable::score_sentence: the history is reset at each <s>
+
+double lmmacro::score_sentence(const int* ids, int n, float* per_word, int* bol) {
+  ngram micro_ng(dict);
+  double logpr=0.0;
+
+  for (int i=0;i<n;i++){
+    int bo=0;
+    double lpr=0.0;
+
+    micro_ng.pushc(ids[i]);
+    if (micro_ng.size>maxlev) micro_ng.size=maxlev;
+    if (ids[i]==microbos) micro_ng.size=1;
+    else lpr=maplprob(micro_ng,NULL,&bo);
+    logpr+=lpr;
+
+    if (per_word) per_word[i]=(float)lpr;
+    if (bol) bol[i]=bo;
+  }
+  return logpr;
+}
+
+void lmmacro::lprob_batch(ngram* ngs, int n, double* logpr, int* bol,
+                          const char** state, unsigned int* statesize,
+                          double* bow) {
+  for (int i=0;i<n;i++){
+    logpr[i]=maplprob(ngs[i],(bow?&bow[i]:NULL),(bol?&bol[i]:NULL));
+    if (state){
+      unsigned int sz;
+      state[i]=lmmacro::maxsuffptr(ngs[i],&sz);
+      if (statesize) statesize[i]=sz;
+    }
+  }
+}
+
 //maxsuffptr returns the largest suffix of an n-gram that is contained 
 //in the LM table. This can be used as a compact representation of the 
 //(n-1)-gram state of a n-gram LM. if the input k-gram has k>=n then it 
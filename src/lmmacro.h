@@ -47,17 +47,41 @@ public:
   int             selectedField;
   int            *lexicaltoken2classMap;
   int             lexicaltoken2classMapN;
+  int             microbos; //code of <s> among micro words (-1 if missing)
 
   lmmacro(std::string lmfilename, std::istream& inp, std::istream& inpMap);
   ~lmmacro() {};
 
   bool loadmap(std::string lmfilename, std::istream& inp, std::istream& inpMap);
+  double maplprob(ngram micro_ng, double* bow, int* bol);
   double lprob(ngram ng); 
   double clprob(ngram ng); 
 
   const char *maxsuffptr(ngram ong, unsigned int* size=NULL);
   const char *cmaxsuffptr(ngram ong, unsigned int* size=NULL);
 
+  //views of micro n-grams: mapping them to macro words needs a copy
+  double lprob(const ngramview& v, double* bow=NULL, int* bol=NULL);
+  double clprob(const ngramview& v){ ngram ng(dict,v); return clprob(ng); }
+  const char *maxsuffptr(const ngramview& v, unsigned int* size=NULL){ ngram ng(dict,v); return maxsuffptr(ng,size); }
+  const char *cmaxsuffptr(const ngramview& v, unsigned int* size=NULL){ ngram ng(dict,v); return cmaxsuffptr(ng,size); }
+
+  //queries of the table with micro words are mapped n-gram by n-gram;
+  //states keep the last maxlev-1 micro words and the entry of the
+  //largest suffix of their macro history
+  double lprob(const lmtstate& st, int w, lmtstate* outst=NULL, double* bow=NULL, int* bol=NULL);
+  double clprob(const lmtstate& st, int w, lmtstate* outst=NULL, double* bow=NULL, int* bol=NULL){
+    return lprob(st,w,outst,bow,bol);
+  }
+  void getstate(ngram h, lmtstate& st);
+  double score_sentence(const int* ids, int n, float* per_word=NULL, int* bol=NULL);
+  void lprob_batch(ngram* ngs, int n, double* logpr, int* bol=NULL,
+                   const char** state=NULL, unsigned int* statesize=NULL,
+                   double* bow=NULL);
+  void clprob_batch(ngram* ngs, int n, double* logpr){
+    for (int i=0;i<n;i++) logpr[i]=clprob(ngs[i]);
+  }
+
   void map(ngram *in, ngram *out);
   void One2OneMapping(ngram *in, ngram *out);
   void Micro2MacroMapping(ngram *in, ngram *out);
@@ -0,0 +1,756 @@
+// $Id$
+
+/******************************************************************************
+IrstLM: IRST Language Model Toolkit
+Copyright (C) 2006 Marcello Federico, ITC-irst Trento, Italy
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+
+******************************************************************************/
+#include <stdio.h>
+#include <cstdlib>
+#include <string.h>
+#include <iostream>
+#include <fstream>
+#include <stdexcept>
+#include <cassert>
+#include <vector>
+#include <algorithm>
+#include "math.h"
+#include "dictionary.h"
+#include "ngram.h"
+#include "lmtable.h"
+#include "lmmixture.h"
+#include "util.h"
+
+using namespace std;
+
+inline void error(const char* message){
+  std::cerr << message << "\n";
+  throw std::runtime_error(message);
+}
+
+//entry of a component found while merging: its word in the union
+//dictionary, its component and its position in the table of its level
+
+struct lmmixsrc{
+  int w;
+  int comp;
+  table_entry_pos_t pos;
+};
+
+static bool srcless(const lmmixsrc& a,const lmmixsrc& b){
+  return a.w<b.w || (a.w==b.w && a.comp<b.comp);
+}
+
+
+lmmixture::lmmixture(){
+  N=0;
+  maxlev=0;
+  isQtable=false;
+  known=NULL;
+  for (int l=0;l<=LMTMAXLEV;l++){
+    cursize[l]=0;
+    words[l]=NULL; bounds[l]=NULL;
+    probs[l]=NULL; bows[l]=NULL;
+    Pcenters[l]=NULL; Bcenters[l]=NULL;
+    colprob[l]=NULL; colbow[l]=NULL;
+  }
+  for (int i=0;i<LMMIXMAXLM;i++){
+    order[i]=dictsize[i]=0;
+    logOOVpenalty[i]=0.0;
+    weight[i]=0.0;
+  }
+  dict=new dictionary((char *)NULL,1000000,(char*)NULL,(char*)NULL);
+}
+
+lmmixture::~lmmixture(){
+  for (int l=1;l<=LMTMAXLEV;l++){
+    if (words[l]) delete [] words[l];
+    if (bounds[l]) delete [] bounds[l];
+    if (probs[l]) delete [] probs[l];
+    if (bows[l]) delete [] bows[l];
+    if (Pcenters[l]) delete [] Pcenters[l];
+    if (Bcenters[l]) delete [] Bcenters[l];
+  }
+  if (known) delete [] known;
+  delete dict;
+}
+
+
+//the union trie is written level by level in a single depth-first walk:
+//the successors of an entry are collected from all the components where
+//the entry is not pruned, and appended to the next level in word order
+//before those of the following entries; 1-grams are indexed by word
+
+void lmmixture::build(lmtable** lmt,int n,const float* w,const std::string* files,bool quantized){
+
+  if (n<1 || n>LMMIXMAXLM) error("lmmixture: wrong number of components");
+
+  N=n; maxlev=0; isQtable=quantized;
+  for (int i=0;i<N;i++){
+    if (lmt[i]->isReversed) error("lmmixture: reversed-context tables cannot be merged");
+    order[i]=lmt[i]->maxlev;
+    dictsize[i]=lmt[i]->dict->size();
+    logOOVpenalty[i]=lmt[i]->logOOVpenalty;
+    weight[i]=w[i];
+    lmfile[i]=files[i];
+    if (order[i]>maxlev) maxlev=order[i];
+  }
+
+  //union dictionary and codes of the words of each component in it
+  int* lookup[LMMIXMAXLM];
+  dict->incflag(1);
+  for (int i=0;i<N;i++){
+    dictionary* d=lmt[i]->dict;
+    lookup[i]=new int[d->size()];
+    for (int c=0;c<d->size();c++) lookup[i][c]=dict->encode(d->decode(c));
+  }
+  dict->genoovcode();
+  dict->incflag(0);
+
+  int V=dict->size();
+  known=new unsigned char[(table_pos_t)V * N];
+  memset(known,0,(table_pos_t)V * N);
+  for (int i=0;i<N;i++){
+    for (int c=0;c<lmt[i]->dict->size();c++) known[(table_pos_t)lookup[i][c] * N+i]=1;
+    known[(table_pos_t)dict->oovcode() * N+i]=1; //mapped to the <unk> of each component
+  }
+
+  std::vector<int> vw[LMTMAXLEV+1];
+  std::vector<table_entry_pos_t> vb[LMTMAXLEV+1];
+  std::vector<float> vp[LMTMAXLEV+1],vbow[LMTMAXLEV+1];
+  std::vector<lmmixsrc> buf[LMTMAXLEV+2];
+
+  vp[1].assign((table_pos_t)V * N,NOPROB);
+  if (maxlev>1) vbow[1].assign((table_pos_t)V * N,0.0);
+
+  for (int i=0;i<N;i++){
+    lmtable* t=lmt[i];
+    LMT_TYPE ndt=t->tbltype[1];
+    int ndsz=t->nodesize(ndt);
+    for (table_entry_pos_t p=0;p<t->cursize[1];p++){
+      node nd=t->table[1]+(table_pos_t)p * ndsz;
+      if (t->prob(nd,ndt)==NOPROB) continue;
+      lmmixsrc s; s.w=lookup[i][t->word(nd,ndt)]; s.comp=i; s.pos=p;
+      buf[1].push_back(s);
+    }
+  }
+
+  merge(lmt,lookup,1,buf,vw,vb,vp,vbow);
+  if (maxlev>1)
+    while (vb[1].size()<(size_t)V) vb[1].push_back(vw[2].size());
+
+  for (int i=0;i<N;i++) delete [] lookup[i];
+
+  //move levels into their arrays
+  for (int l=1;l<=maxlev;l++){
+    cursize[l]=(l==1?V:vw[l].size());
+    cerr << "merged " << cursize[l] << " " << l << "-grams\n";
+    if (l>1){
+      words[l]=new int[cursize[l]];
+      if (cursize[l]) memcpy(words[l],&vw[l][0],cursize[l] * sizeof(int));
+      std::vector<int>().swap(vw[l]);
+    }
+    if (l<maxlev){
+      bounds[l]=new table_entry_pos_t[cursize[l]];
+      if (cursize[l]) memcpy(bounds[l],&vb[l][0],cursize[l] * sizeof(table_entry_pos_t));
+      std::vector<table_entry_pos_t>().swap(vb[l]);
+    }
+    if (isQtable)
+      quantize(l,vp[l],vbow[l]);
+    else{
+      probs[l]=new char[(table_pos_t)cursize[l] * N * PROBSIZE];
+      if (cursize[l]) memcpy(probs[l],&vp[l][0],(table_pos_t)cursize[l] * N * PROBSIZE);
+      if (l<maxlev){
+        bows[l]=new char[(table_pos_t)cursize[l] * N * PROBSIZE];
+        if (cursize[l]) memcpy(bows[l],&vbow[l][0],(table_pos_t)cursize[l] * N * PROBSIZE);
+      }
+    }
+    std::vector<float>().swap(vp[l]);
+    std::vector<float>().swap(vbow[l]);
+  }
+}
+
+
+//appends the entries of level l collected in buf[l] (1-grams are already
+//in place), with their successors; buf[l+1] is reused by each entry
+
+void lmmixture::merge(lmtable** lmt,int** lookup,int l,std::vector<lmmixsrc>* buf,
+                      std::vector<int>* vw,std::vector<table_entry_pos_t>* vb,
+                      std::vector<float>* vp,std::vector<float>* vbow){
+
+  std::vector<lmmixsrc>& succ=buf[l];
+  std::sort(succ.begin(),succ.end(),srcless);
+
+  size_t a,b;
+  for (a=0;a<succ.size();a=b){
+    for (b=a+1;b<succ.size() && succ[b].w==succ[a].w;b++);
+
+    table_entry_pos_t e=succ[a].w;
+    if (l>1){
+      e=vw[l].size();
+      vw[l].push_back(succ[a].w);
+      vp[l].resize(vp[l].size()+N,NOPROB);
+      if (l<maxlev) vbow[l].resize(vbow[l].size()+N,0.0);
+    }
+    else if (l<maxlev)
+      while (vb[1].size()<e) vb[1].push_back(vw[2].size());
+
+    if (l<maxlev) buf[l+1].clear();
+
+    for (size_t k=a;k<b;k++){
+      int i=succ[k].comp;
+      lmtable* t=lmt[i];
+      LMT_TYPE ndt=t->tbltype[l];
+      int ndsz=t->nodesize(ndt);
+      node nd=t->table[l]+(table_pos_t)succ[k].pos * ndsz;
+
+      float pr=t->prob(nd,ndt);
+      vp[l][(table_pos_t)e * N+i]=(t->isQtable?t->Pcenters[l][(qfloat_t)pr]:pr);
+      if (l>=order[i]) continue;
+
+      float bw=t->bow(nd,ndt);
+      vbow[l][(table_pos_t)e * N+i]=(t->isQtable?t->Bcenters[l][(qfloat_t)bw]:bw);
+
+      //successors of the entry in the component
+      table_entry_pos_t offset=(succ[k].pos==0?0:t->bound(nd-ndsz,ndt));
+      table_entry_pos_t limit=t->bound(nd,ndt);
+      LMT_TYPE sndt=t->tbltype[l+1];
+      int sndsz=t->nodesize(sndt);
+      for (table_entry_pos_t q=offset;q<limit;q++){
+        node snd=t->table[l+1]+(table_pos_t)q * sndsz;
+        if (t->prob(snd,sndt)==NOPROB) continue; //pruned n-gram
+        lmmixsrc s; s.w=lookup[i][t->word(snd,sndt)]; s.comp=i; s.pos=q;
+        buf[l+1].push_back(s);
+      }
+    }
+
+    if (l<maxlev){
+      merge(lmt,lookup,l+1,buf,vw,vb,vp,vbow);
+      vb[l].push_back(vw[l+1].size());
+    }
+  }
+}
+
+
+//codebook of at most maxc centers for the values v (which are sorted):
+//the distinct values if they are not more than maxc, or the means of
+//maxc bins of the same population
+
+static int codebook(std::vector<float>& v,float* centers,int maxc){
+  std::sort(v.begin(),v.end());
+  size_t n=v.size();
+  int nc=0;
+  for (size_t j=0;j<n && nc<=maxc;j++)
+    if (j==0 || v[j]!=v[j-1]) nc++;
+
+  if (nc<=maxc){
+    nc=0;
+    for (size_t j=0;j<n;j++)
+      if (j==0 || v[j]!=v[j-1]) centers[nc++]=v[j];
+  }
+  else{
+    for (int c=0;c<maxc;c++){
+      size_t from=c * n / maxc,to=(c+1) * n / maxc;
+      double sum=0.0;
+      for (size_t j=from;j<to;j++) sum+=v[j];
+      centers[c]=(to>from?sum / (to-from):v[from]);
+    }
+    nc=maxc;
+  }
+  if (nc==0) centers[nc++]=0.0;
+  return nc;
+}
+
+//code of the center nearest to x
+
+static qfloat_t nearest(const float* centers,int nc,float x){
+  int c=std::lower_bound(centers,centers+nc,x)-centers;
+  if (c==nc) return nc-1;
+  if (c>0 && x-centers[c-1]<centers[c]-x) return c-1;
+  return c;
+}
+
+void lmmixture::quantize(int l,std::vector<float>& vp,std::vector<float>& vbow){
+
+  Pcenters[l]=new float[N * LMMIXCODES];
+  memset(Pcenters[l],0,N * LMMIXCODES * sizeof(float));
+  probs[l]=new char[(table_pos_t)cursize[l] * N];
+  if (l<maxlev){
+    Bcenters[l]=new float[N * LMMIXCODES];
+    memset(Bcenters[l],0,N * LMMIXCODES * sizeof(float));
+    bows[l]=new char[(table_pos_t)cursize[l] * N];
+  }
+
+  for (int i=0;i<N;i++){
+    std::vector<float> v;
+    for (table_entry_pos_t p=0;p<cursize[l];p++)
+      if (vp[(table_pos_t)p * N+i]!=NOPROB) v.push_back(vp[(table_pos_t)p * N+i]);
+    float* pc=Pcenters[l]+i * LMMIXCODES;
+    int npc=codebook(v,pc,LMMIXCODES-1);
+    for (table_entry_pos_t p=0;p<cursize[l];p++){
+      float x=vp[(table_pos_t)p * N+i];
+      probs[l][(table_pos_t)p * N+i]=(x==NOPROB?LMMIXNOCODE:nearest(pc,npc,x));
+    }
+    if (l==maxlev) continue;
+
+    v.clear();
+    for (table_entry_pos_t p=0;p<cursize[l];p++)
+      if (vp[(table_pos_t)p * N+i]!=NOPROB) v.push_back(vbow[(table_pos_t)p * N+i]);
+    float* bc=Bcenters[l]+i * LMMIXCODES;
+    int nbc=codebook(v,bc,LMMIXCODES-1);
+    for (table_entry_pos_t p=0;p<cursize[l];p++)
+      bows[l][(table_pos_t)p * N+i]=nearest(bc,nbc,vbow[(table_pos_t)p * N+i]);
+  }
+}
+
+
+//header line, components, union dictionary, known words, then the
+//codebooks, words, bounds, probs and bows of each level
+
+void lmmixture::save(const char* filename){
+
+  fstream out(filename,ios::out);
+  cerr << "savemix: " << filename << "\n";
+
+  out << (isQtable?"Q":"") << "mixlm " << N << " " << maxlev;
+  for (int l=1;l<=maxlev;l++) out << " " << cursize[l];
+  out << "\n";
+  for (int i=0;i<N;i++)
+    out << weight[i] << " " << order[i] << " " << dictsize[i] << " " << lmfile[i] << "\n";
+
+  dict->save(out);
+  out.write((char*)known,(table_pos_t)cursize[1] * N);
+
+  for (int l=1;l<=maxlev;l++){
+    cerr << "saving " << cursize[l] << " " << l << "-grams\n";
+    if (isQtable){
+      out.write((char*)Pcenters[l],N * LMMIXCODES * sizeof(float));
+      if (l<maxlev) out.write((char*)Bcenters[l],N * LMMIXCODES * sizeof(float));
+    }
+    if (l>1) out.write((char*)words[l],(table_pos_t)cursize[l] * sizeof(int));
+    if (l<maxlev) out.write((char*)bounds[l],(table_pos_t)cursize[l] * sizeof(table_entry_pos_t));
+    out.write(probs[l],(table_pos_t)cursize[l] * N * psize());
+    if (l<maxlev) out.write(bows[l],(table_pos_t)cursize[l] * N * psize());
+  }
+  cerr << "done\n";
+}
+
+bool lmmixture::mixheader(const char* header){
+  return strcmp(header,"mixlm")==0 || strcmp(header,"Qmixlm")==0;
+}
+
+//header is the first word of the file, already read from inp
+
+void lmmixture::load(std::istream& inp,const char* header){
+
+  if (!mixheader(header)) error("lmmixture: wrong header");
+  isQtable=(header[0]=='Q');
+
+  inp >> N >> maxlev;
+  if (N<1 || N>LMMIXMAXLM || maxlev<1 || maxlev>LMTMAXLEV) error("lmmixture: wrong header");
+  for (int l=1;l<=maxlev;l++) inp >> cursize[l];
+  for (int i=0;i<N;i++)
+    inp >> weight[i] >> order[i] >> dictsize[i] >> lmfile[i];
+
+  dict->load(inp);
+  dict->genoovcode();
+
+  known=new unsigned char[(table_pos_t)cursize[1] * N];
+  inp.read((char*)known,(table_pos_t)cursize[1] * N);
+
+  for (int l=1;l<=maxlev;l++){
+    if (isQtable){
+      Pcenters[l]=new float[N * LMMIXCODES];
+      inp.read((char*)Pcenters[l],N * LMMIXCODES * sizeof(float));
+      if (l<maxlev){
+        Bcenters[l]=new float[N * LMMIXCODES];
+        inp.read((char*)Bcenters[l],N * LMMIXCODES * sizeof(float));
+      }
+    }
+    if (l>1){
+      words[l]=new int[cursize[l]];
+      inp.read((char*)words[l],(table_pos_t)cursize[l] * sizeof(int));
+    }
+    if (l<maxlev){
+      bounds[l]=new table_entry_pos_t[cursize[l]];
+      inp.read((char*)bounds[l],(table_pos_t)cursize[l] * sizeof(table_entry_pos_t));
+    }
+    probs[l]=new char[(table_pos_t)cursize[l] * N * psize()];
+    inp.read(probs[l],(table_pos_t)cursize[l] * N * psize());
+    if (l<maxlev){
+      bows[l]=new char[(table_pos_t)cursize[l] * N * psize()];
+      inp.read(bows[l],(table_pos_t)cursize[l] * N * psize());
+    }
+  }
+  if (!inp) error("lmmixture: truncated file");
+}
+
+
+void lmmixture::setlogOOVpenalty(int dub){
+  for (int i=0;i<N;i++){
+    assert(dub > dictsize[i]);
+    logOOVpenalty[i]=log((double)(dub - dictsize[i]))/log(10.0);
+  }
+}
+
+
+//finds the entries of the n words w, level by level: it returns the
+//number of levels found
+
+int lmmixture::descend(const int* w,int n,table_entry_pos_t* pos){
+
+  if (n==0 || w[0]<0 || w[0]>=(int)cursize[1]) return 0;
+  pos[1]=w[0];
+
+  for (int l=2;l<=n;l++){
+    table_entry_pos_t p=pos[l-1];
+    table_entry_pos_t low=(p>0?bounds[l-1][p-1]:0),high=bounds[l-1][p];
+    const int* wl=words[l];
+    int key=w[l-1];
+    bool found=false;
+    while (low<high){
+      table_entry_pos_t mid=(low+high) / 2;
+      if (key<wl[mid]) high=mid;
+      else if (key>wl[mid]) low=mid+1;
+      else { pos[l]=mid; found=true; break; }
+    }
+    if (!found) return l-1;
+  }
+  return n;
+}
+
+//does entry p of level l have successors in component i?
+
+bool lmmixture::hassucc(int l,table_entry_pos_t p,int i){
+  if (l>=maxlev) return false;
+  table_entry_pos_t q=(p>0?bounds[l][p-1]:0);
+  for (;q<bounds[l][p];q++)
+    if (hasprob(l+1,q,i)) return true;
+  return false;
+}
+
+//copy of the n words w with the words unknown to component i mapped to
+//<unk>: it returns how many of the words seen by i have been mapped
+
+int lmmixture::mapunknown(const int* w,int n,int i,int* sw){
+  int oov=dict->oovcode(),mapped=0;
+  int first=(n>order[i]?n-order[i]:0);
+  for (int k=0;k<n;k++){
+    bool in=(w[k]>=0 && w[k]<(int)cursize[1] && known[(table_pos_t)w[k] * N+i]);
+    sw[k]=(in?w[k]:oov);
+    if (!in && k>=first) mapped++;
+  }
+  return mapped;
+}
+
+//lprob of the nc components comps of the n words w: back-off steps are
+//taken together, each one with a single descent for all components;
+//back-off weights are summed in the same order as lmtable::lprob
+
+void lmmixture::complprobs(const int* w,int n,const int* comps,int nc,double* lp,int* bol,double* bow){
+
+  double rbow[LMMIXMAXLM][LMTMAXLEV];
+  int nbo[LMMIXMAXLM];
+  bool done[LMMIXMAXLM];
+  table_entry_pos_t pos[LMTMAXLEV+1];
+  int oov=dict->oovcode();
+
+  for (int j=0;j<nc;j++){
+    int i=comps[j];
+    nbo[i]=0; done[i]=false;
+    bol[i]=0; bow[i]=0.0;
+  }
+
+  int left=nc;
+  for (int m=n;m>=1 && left>0;m--){
+    const int* sw=w+n-m;
+    int d=descend(sw,m,pos);
+
+    for (int j=0;j<nc;j++){
+      int i=comps[j];
+      if (done[i] || m>order[i]) continue;
+
+      if (d==m && hasprob(m,pos[m],i)){
+        lp[i]=getprob(m,pos[m],i);
+        if (w[n-1]==oov) lp[i]-=logOOVpenalty[i];
+      }
+      else if (m==1) //means an OOV word
+        lp[i]=-log(UNIGRAM_RESOLUTION)/M_LN10;
+      else{
+        double rb=0.0;
+        bol[i]++;
+        if (d>=m-1 && hasprob(m-1,pos[m-1],i) && w[n-2]!=oov)
+          rb=getbow(m-1,pos[m-1],i);
+        bow[i]+=rb;
+        rbow[i][nbo[i]++]=rb;
+        continue;
+      }
+      done[i]=true; left--;
+      while (nbo[i]>0) lp[i]=rbow[i][--nbo[i]]+lp[i];
+    }
+  }
+}
+
+//components knowing all the words are computed together, each other one
+//on the n-gram with its unknown words mapped to <unk>
+
+void lmmixture::lprobs(const int* w,int n,double* lp,int* bol,double* bow){
+
+  int ibol[LMMIXMAXLM];
+  double ibow[LMMIXMAXLM];
+  if (!bol) bol=ibol;
+  if (!bow) bow=ibow;
+
+  if (n>maxlev){ w+=n-maxlev; n=maxlev; }
+  if (n==0){
+    for (int i=0;i<N;i++){ lp[i]=0.0; bol[i]=0; bow[i]=0.0; }
+    return;
+  }
+
+  int comps[LMMIXMAXLM],nc=0,sw[LMTMAXLEV];
+  for (int i=0;i<N;i++)
+    if (!mapunknown(w,n,i,sw)) comps[nc++]=i;
+  if (nc>0) complprobs(w,n,comps,nc,lp,bol,bow);
+
+  if (nc<N)
+    for (int i=0;i<N;i++)
+      if (mapunknown(w,n,i,sw)) complprobs(sw,n,&i,1,lp,bol,bow);
+}
+
+void lmmixture::lprobs(ngram& ng,double* lp,int* bol,double* bow){
+  int w[LMTMAXLEV];
+  int n=(ng.size>maxlev?maxlev:ng.size);
+  for (int k=0;k<n;k++)
+    w[k]=(ng.dict==dict?*ng.wordp(n-k):dict->encode(ng.dict->decode(*ng.wordp(n-k))));
+  lprobs(w,n,lp,bol,bow);
+}
+
+double lmmixture::lprob(const int* w,int n,int* bol){
+  double lp[LMMIXMAXLM],pr=0.0;
+  int ibol[LMMIXMAXLM],minbol=LMTMAXLEV;
+
+  lprobs(w,n,lp,ibol);
+  for (int i=0;i<N;i++){
+    pr+=weight[i] * pow(10.0,lp[i]);
+    if (ibol[i]<minbol) minbol=ibol[i];
+  }
+  if (bol) *bol=minbol;
+  return log(pr)/M_LN10;
+}
+
+double lmmixture::lprob(ngram& ng,int* bol){
+  int w[LMTMAXLEV];
+  int n=(ng.size>maxlev?maxlev:ng.size);
+  for (int k=0;k<n;k++)
+    w[k]=(ng.dict==dict?*ng.wordp(n-k):dict->encode(ng.dict->decode(*ng.wordp(n-k))));
+  return lprob(w,n,bol);
+}
+
+
+//size of the largest suffix of the n words w (with less words than the
+//order of component i) found in i, as returned by lmtable::maxsuffptr
+
+int lmmixture::compstatesize(const int* w,int n,int i){
+  table_entry_pos_t pos[LMTMAXLEV+1];
+  for (int k=(n<order[i]?n:order[i]-1);k>0;k--)
+    if (descend(w+n-k,k,pos)==k && hasprob(k,pos[k],i))
+      return (hassucc(k,pos[k],i)?k:k-1);
+  return 0;
+}
+
+unsigned int lmmixture::statesize(const int* w,int n){
+  int sw[LMTMAXLEV],size=0;
+  if (n>maxlev){ w+=n-maxlev; n=maxlev; }
+  for (int i=0;i<N;i++){
+    mapunknown(w,n,i,sw);
+    int s=compstatesize(sw,n,i);
+    if (s>size) size=s;
+  }
+  return size;
+}
+
+
+void lmmixture::stat(){
+  table_pos_t mem=(table_pos_t)cursize[1] * N;
+  for (int l=1;l<=maxlev;l++){
+    table_pos_t lmem=(table_pos_t)cursize[l] * N * psize() * (l<maxlev?2:1);
+    if (l>1) lmem+=(table_pos_t)cursize[l] * sizeof(int);
+    if (l<maxlev) lmem+=(table_pos_t)cursize[l] * sizeof(table_entry_pos_t);
+    cerr << "level " << l << " entries " << cursize[l] << " used mem " << lmem/1048576.0 << "Mb\n";
+    mem+=lmem;
+  }
+  cerr << "total allocated mem " << mem/1048576.0 << "Mb\n";
+}
+
+
+//static mixture: the n-grams of the merged trie get the mixture prob of
+//their components (which do not include OOV penalties), then back-off
+//weights make the distribution of each history sum to one given the
+//n-grams of lower order:
+//  bow(h) = (1 - sum_w p(w|h)) / (1 - sum_w p(w|h')), w successor of h
+//where h' is h without its least recent word. Levels are computed and
+//written in turn, the bows of level l requiring the probs of level l+1;
+//probs and bows are kept in one float per entry of the merged trie.
+
+void lmmixture::collapse(const char* filename){
+
+  float sw[LMMIXMAXLM],wsum=0.0;
+  for (int i=0;i<N;i++){
+    sw[i]=weight[i]; wsum+=weight[i];
+  }
+  for (int i=0;i<N;i++) weight[i]/=wsum;
+
+  fstream out(filename,ios::out);
+  out.precision(7);
+  cerr << "collapse: " << filename << "\n";
+
+  table_entry_pos_t unigrams=0;
+  for (table_entry_pos_t p=0;p<cursize[1];p++)
+    if (isngram(1,p)) unigrams++;
+
+  out << "\n\\data\\\n";
+  for (int l=1;l<=maxlev;l++)
+    out << "ngram " << l << "= " << (l==1?unigrams:cursize[l]) << "\n";
+
+  int w[LMTMAXLEV];
+  colnomass=0;
+  colprob[1]=new float[cursize[1]];
+  collapsewalk(MIX_PROBS,1,1,w,0,cursize[1],out);
+
+  for (int l=1;l<=maxlev;l++){
+    if (l<maxlev){
+      colprob[l+1]=new float[cursize[l+1]];
+      collapsewalk(MIX_PROBS,1,l+1,w,0,cursize[1],out);
+      colbow[l]=new float[cursize[l]];
+      collapsewalk(MIX_BOWS,1,l,w,0,cursize[1],out);
+    }
+    cerr << "collapse: " << (l==1?unigrams:cursize[l]) << " " << l << "-grams\n";
+    out << "\n\\" << l << "-grams:\n";
+    collapsewalk(MIX_WRITE,1,l,w,0,cursize[1],out);
+  }
+  out << "\\end\\\n";
+
+  if (colnomass) cerr << "collapse: " << colnomass << " histories without back-off mass\n";
+  cerr << "done\n";
+
+  for (int l=1;l<=maxlev;l++){
+    if (colprob[l]) delete [] colprob[l];
+    if (colbow[l]) delete [] colbow[l];
+    colprob[l]=colbow[l]=NULL;
+  }
+  for (int i=0;i<N;i++) weight[i]=sw[i];
+}
+
+//1-grams of the merged trie are all the words of the union dictionary
+
+bool lmmixture::isngram(int l,table_entry_pos_t p){
+  for (int i=0;i<N;i++)
+    if (hasprob(l,p,i)) return true;
+  return false;
+}
+
+//visits the entries of level target, with their words in w
+
+void lmmixture::collapsewalk(MIX_ACTION action,int l,int target,int* w,
+                             table_entry_pos_t ipos,table_entry_pos_t epos,std::ostream& out){
+
+  for (table_entry_pos_t p=ipos;p<epos;p++){
+    w[l-1]=(l==1?(int)p:words[l][p]);
+    if (l==1 && !isngram(1,p)){
+      if (action==MIX_PROBS && target==1) colprob[1][p]=NOPROB;
+      continue;
+    }
+
+    if (l<target){
+      table_entry_pos_t isucc=(p>0?bounds[l][p-1]:0),esucc=bounds[l][p];
+      if (isucc<esucc) collapsewalk(action,l+1,target,w,isucc,esucc,out);
+      continue;
+    }
+
+    switch (action){
+    case MIX_PROBS:
+      colprob[l][p]=collapseprob(w,l);
+      break;
+    case MIX_BOWS:
+      colbow[l][p]=collapsebow(w,l,p);
+      break;
+    case MIX_WRITE:
+      out << colprob[l][p] << "\t";
+      for (int k=0;k<l;k++) out << (k>0?" ":"") << dict->decode(w[k]);
+      if (l<maxlev && colbow[l][p]!=0.0) out << "\t" << colbow[l][p];
+      out << "\n";
+      break;
+    }
+  }
+}
+
+//mixture prob of an n-gram: words unknown to a component get its <unk>
+//prob with its OOV penalty, while the prob of <unk> itself is kept for
+//the class of unknown words, as the collapsed LM applies its own penalty
+
+double lmmixture::collapseprob(const int* w,int n){
+  if (w[n-1]!=dict->oovcode()) return lprob(w,n);
+
+  double sp[LMMIXMAXLM];
+  for (int i=0;i<N;i++){ sp[i]=logOOVpenalty[i]; logOOVpenalty[i]=0.0; }
+  double pr=lprob(w,n);
+  for (int i=0;i<N;i++) logOOVpenalty[i]=sp[i];
+  return pr;
+}
+
+//bow of the history of l words w, entry p of level l
+
+double lmmixture::collapsebow(const int* w,int l,table_entry_pos_t p){
+
+  table_entry_pos_t isucc=(p>0?bounds[l][p-1]:0),esucc=bounds[l][p];
+  if (isucc==esucc) return 0.0;
+
+  //successors are scored after h' too
+  int v[LMTMAXLEV];
+  for (int k=1;k<l;k++) v[k-1]=w[k];
+
+  double num=1.0,den=1.0;
+  for (table_entry_pos_t q=isucc;q<esucc;q++){
+    num-=pow(10.0,colprob[l+1][q]);
+    v[l-1]=words[l+1][q];
+    den-=pow(10.0,collprob(v,l));
+  }
+
+  if (num<=0.0 || den<=0.0){ //rounding errors: no back-off
+    colnomass++;
+    return 0.0;
+  }
+  return log10(num)-log10(den);
+}
+
+//log10 prob of the n words w in the static mixture, as lmtable::lprob,
+//from the probs and bows computed so far
+
+double lmmixture::collprob(const int* w,int n){
+  table_entry_pos_t pos[LMTMAXLEV+1];
+  double bow=0.0;
+  for (int m=n;m>=1;m--){
+    int d=descend(w+n-m,m,pos);
+    if (d==m && colprob[m][pos[m]]!=NOPROB)
+      return colprob[m][pos[m]]+bow;
+    if (m==1) //means an OOV word
+      return -log(UNIGRAM_RESOLUTION)/M_LN10+bow;
+    if (d>=m-1 && colprob[m-1][pos[m-1]]!=NOPROB && w[n-2]!=dict->oovcode())
+      bow+=colbow[m-1][pos[m-1]];
+  }
+  return bow;
+}
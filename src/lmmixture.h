@@ -0,0 +1,169 @@
+// $Id$
+
+/******************************************************************************
+IrstLM: IRST Language Model Toolkit
+Copyright (C) 2006 Marcello Federico, ITC-irst Trento, Italy
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+
+******************************************************************************/
+
+
+#ifndef MF_LMMIXTURE_H
+#define MF_LMMIXTURE_H
+
+#include <string>
+#include <vector>
+
+#include "util.h"
+#include "dictionary.h"
+#include "ngram.h"
+#include "lmtable.h"
+
+#define LMMIXMAXLM  100  //max number of components
+#define LMMIXCODES  256  //codebook size of quantized columns
+#define LMMIXNOCODE 255  //quantized prob of n-grams missing in a component
+
+//source of an entry of the merged trie while building it
+struct lmmixsrc;
+
+typedef enum {MIX_PROBS,  //!< collapse: compute the probs of a level
+  MIX_BOWS,   //!< collapse: compute the bows of a level
+  MIX_WRITE   //!< collapse: write a level
+} MIX_ACTION;
+
+//merged trie of N back-off LMs: the union of their n-grams is stored
+//once, each entry with N probs and N bows (NOPROB, or LMMIXNOCODE if
+//quantized, where the n-gram is missing in a component). The probs of
+//all components are computed together: each back-off step is a single
+//descent of the merged trie, and words are encoded only once in the
+//union dictionary. Mixture weights are not part of the tables and can
+//be changed at any time.
+
+class lmmixture{
+
+ protected:
+  int  N;                           //number of components
+  int  maxlev;                      //max level of the trie
+  int  order[LMMIXMAXLM];           //max level of each component
+  int  dictsize[LMMIXMAXLM];        //dictionary size of each component
+  double logOOVpenalty[LMMIXMAXLM]; //OOV penalty of each component
+  float  weight[LMMIXMAXLM];        //mixture weights
+  std::string lmfile[LMMIXMAXLM];   //files of the components
+
+  //levels: entry p of level 1 is word p, entries of the other levels are
+  //sorted by word within the successors of each entry of the previous
+  //level, which end at its bound; probs and bows of entry p are stored
+  //at p*N, so that the N columns are read together
+  table_entry_pos_t  cursize[LMTMAXLEV+1];
+  int*               words[LMTMAXLEV+1];
+  table_entry_pos_t* bounds[LMTMAXLEV+1];
+  char*              probs[LMTMAXLEV+1];
+  char*              bows[LMTMAXLEV+1];
+
+  //quantized columns: LMMIXCODES centers per component and level
+  bool   isQtable;
+  float* Pcenters[LMTMAXLEV+1];
+  float* Bcenters[LMTMAXLEV+1];
+
+  //known[w*N+i] is set if word w is in the dictionary of component i
+  unsigned char* known;
+
+  int  psize() const {return isQtable?QPROBSIZE:PROBSIZE;}
+
+  inline bool hasprob(int l,table_entry_pos_t p,int i) const {
+    if (isQtable) return ((qfloat_t*)probs[l])[(table_pos_t)p * N+i]!=LMMIXNOCODE;
+    return ((float*)probs[l])[(table_pos_t)p * N+i]!=NOPROB;
+  }
+  inline double getprob(int l,table_entry_pos_t p,int i) const {
+    if (isQtable) return Pcenters[l][i * LMMIXCODES+((qfloat_t*)probs[l])[(table_pos_t)p * N+i]];
+    return ((float*)probs[l])[(table_pos_t)p * N+i];
+  }
+  inline double getbow(int l,table_entry_pos_t p,int i) const {
+    if (isQtable) return Bcenters[l][i * LMMIXCODES+((qfloat_t*)bows[l])[(table_pos_t)p * N+i]];
+    return ((float*)bows[l])[(table_pos_t)p * N+i];
+  }
+
+  int  descend(const int* w,int n,table_entry_pos_t* pos);
+  bool hassucc(int l,table_entry_pos_t p,int i);
+  void complprobs(const int* w,int n,const int* comps,int nc,double* lp,int* bol,double* bow);
+  int  compstatesize(const int* w,int n,int i);
+  int  mapunknown(const int* w,int n,int i,int* sw);
+
+  void merge(lmtable** lmt,int** lookup,int l,std::vector<lmmixsrc>* buf,
+             std::vector<int>* vw,std::vector<table_entry_pos_t>* vb,
+             std::vector<float>* vp,std::vector<float>* vbow);
+  void quantize(int l,std::vector<float>& vp,std::vector<float>& vbow);
+
+  //static mixture (see collapse): probs and bows of the entries
+  float* colprob[LMTMAXLEV+1];
+  float* colbow[LMTMAXLEV+1];
+  int    colnomass; //histories without mass left for back-off
+
+  bool   isngram(int l,table_entry_pos_t p);
+  void   collapsewalk(MIX_ACTION action,int l,int target,int* w,
+                      table_entry_pos_t ipos,table_entry_pos_t epos,std::ostream& out);
+  double collapseprob(const int* w,int n);
+  double collapsebow(const int* w,int l,table_entry_pos_t p);
+  double collprob(const int* w,int n);
+
+ public:
+
+  dictionary* dict; //union of the dictionaries of the components
+
+  lmmixture();
+  ~lmmixture();
+
+  //merges the tables of n LMs with weights w read from files, optionally
+  //quantizing the columns with LMMIXCODES-1 centers each
+  void build(lmtable** lmt,int n,const float* w,const std::string* files,bool quantized=false);
+
+  void save(const char* filename);
+  void load(std::istream& inp,const char* header);
+  static bool mixheader(const char* header);
+
+  int components() const {return N;}
+  int maxlevel() const {return maxlev;}
+  bool isQuantized() const {return isQtable;}
+  const std::string& getlmfile(int i) const {return lmfile[i];}
+  float getweight(int i) const {return weight[i];}
+  void  setweights(const float* w){ for (int i=0;i<N;i++) weight[i]=w[i]; }
+
+  //penalty for OOV words of each component, as lmtable::setlogOOVpenalty
+  void setlogOOVpenalty(int dub);
+
+  //log10 prob of each component for the n words w (from the least recent
+  //one, coded in dict) as lmtable::lprob of its translated n-gram, with
+  //optional back-off levels and bows
+  void lprobs(const int* w,int n,double* lp,int* bol=NULL,double* bow=NULL);
+  void lprobs(ngram& ng,double* lp,int* bol=NULL,double* bow=NULL);
+
+  //log10 prob of the mixture, with the least back-off level of the
+  //components
+  double lprob(const int* w,int n,int* bol=NULL);
+  double lprob(ngram& ng,int* bol=NULL);
+
+  //largest state size of the components, as lmtable::maxsuffptr
+  unsigned int statesize(const int* w,int n);
+
+  //writes an ARPA LM approximating the mixture with the current weights:
+  //n-grams of all components get their mixture prob, back-off weights
+  //are renormalized over the successors of each history
+  void collapse(const char* filename);
+
+  void stat();
+};
+
+#endif
@@ -27,6 +27,16 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
 #include <fstream>
 #include <stdexcept>
 #include <cassert>
+#include <vector>
+#include <algorithm>
+#include <sstream>
+#include <set>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
 #include "math.h"
 #include "mempool.h"
 #include "htable.h"
@@ -38,11 +48,20 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
 
 #define DEBUG false
 
-//special value for pruned iprobs
-const float NOPROB = -2.0;
-
 using namespace std;
 
+//successor ranges with less entries than LMTSCANSIZE are scanned with
+//keyscan, larger ones are searched with keysearch (values tuned on x86-64)
+#ifndef LMTSCANSIZE
+#if defined(__AVX2__)
+#define LMTSCANSIZE 128
+#elif defined(__SSE2__)
+#define LMTSCANSIZE 48
+#else
+#define LMTSCANSIZE 8
+#endif
+#endif
+
 inline void error(const char* message){
   std::cerr << message << "\n";
   throw std::runtime_error(message);
@@ -68,22 +87,50 @@ lmtable::lmtable(){
   probcache=NULL;
   statecache=NULL;
   statesizecache=NULL;
+  stprobcache=stprobbuf=NULL;
+  stprobbits=0;
+  stprobhit=stprobmiss=0;
+  cachebudget=0;
+  adaptperiod=LMTADAPTPERIOD;
+  cacheminhit=LMTCACHEMINHIT;
+  adapttick=0;
   
   memmap=0;
+
+  for (int i=0;i<=LMTMAXLEV;i++){
+    keyidx[i]=NULL; keyidxMapped[i]=false;
+    topord[i]=NULL; topordMapped[i]=false;
+    hashtb[i]=NULL; hashmask[i]=0;
+    revreal[i]=revext[i]=NULL;
+  }
   
   isPruned=false;
+  isQtable=false;
+  isPacked=false;
+  isColumnar=false;
+  isReversed=false;
+
+  //generic kernels until tables are loaded
+  getkernel=&lmtable::getgeneric;
+  lprobkernel=NULL;
+
+  interleave=0;
 
   //statistics
   for (int i=0;i<=LMTMAXLEV+1;i++) totget[i]=totbsearch[i]=0;
 
+  concurrent=false;
+  no_more_msg=0;
+
   logOOVpenalty=0.0; //penalty for OOV words (default 0)
+  boscode=-1;
 
   // by default, it is a standard LM, i.e. queried for score
   setOrderQuery(false);
 };
 
 void lmtable::init_probcache(){
-  assert(probcache==NULL);
+  assert(probcache==NULL && !concurrent);
   probcache=new ngramcache(maxlev,sizeof(double),400000);
 #ifdef TRACE_CACHE
   cacheout=new std::fstream(get_temp_folder()++"tracecache",std::ios::out);
@@ -92,14 +139,120 @@ void lmtable::init_probcache(){
 }
 
 void lmtable::init_statecache(){
-  assert(statecache==NULL);
+  assert(statecache==NULL && !concurrent);
   if(maxlev > 1){  // we don't need a state cache for a unigram model
     statecache=new ngramcache(maxlev-1,sizeof(char *),200000);
     statesizecache=new ngramcache(maxlev-1,sizeof(int),200000);
   }
 }
 
+//slots of the state-keyed prob cache are aligned to cache lines: buf is
+//the allocated array
+
+static lmtstprob* newstprobcache(int bits,lmtstprob** buf){
+  *buf=new lmtstprob[(1 << bits)+1];
+  lmtstprob* sc=(lmtstprob*)((char*)*buf+((64-((size_t)*buf & 63)) & 63));
+  for (int i=0;i<(1 << bits);i++){ sc[i].link=NULL; sc[i].w=-1; }
+  return sc;
+}
+
+static void clearstprobcache(lmtstprob* sc,int bits){
+  if (sc) for (int i=0;i<(1 << bits);i++){ sc[i].link=NULL; sc[i].w=-1; }
+}
+
+void lmtable::init_stprobcache(int bits){
+  assert(stprobcache==NULL && !concurrent);
+  if (bits<1 || bits>30) error("init_stprobcache: the number of slots must be 2^1 to 2^30");
+  stprobbits=bits;
+  stprobcache=newstprobcache(bits,&stprobbuf);
+}
+
+//adaptive caches: missing prob, state and level caches are created with
+//LMTADAPTMIN entries, then adapt_caches tunes all of them
+
+void lmtable::init_adaptive_caches(size_t budget,int period,double minhit){
+  assert(!concurrent);
+  if (budget==0 || period<=0) error("init_adaptive_caches: budget and period must be positive");
+  if (minhit<0 || minhit>1) error("init_adaptive_caches: min hit rate must be between 0 and 1");
+  if (!probcache) probcache=new ngramcache(maxlev,sizeof(double),LMTADAPTMIN);
+  if (!statecache && maxlev>1){
+    statecache=new ngramcache(maxlev-1,sizeof(char *),LMTADAPTMIN);
+    statesizecache=new ngramcache(maxlev-1,sizeof(int),LMTADAPTMIN);
+  }
+  for (int i=2;i<maxlev;i++)
+    if (!lmtcache[i]) lmtcache[i]=new ngramcache(i,sizeof(char *),LMTADAPTMIN);
+  if (max_cache_lev<maxlev-1) max_cache_lev=maxlev-1;
+  cachebudget=budget;
+  adaptperiod=period;
+  cacheminhit=minhit;
+  adapttick=0;
+}
+
+
+//adapt_caches samples the caches of the calling thread over the last
+//period. Hits and evictions are weighted by the searches a hit saves:
+//one for level caches, the levels of a query for the other ones.
+//Level caches hitting less than cacheminhit are dropped, as a miss
+//costs more than the search it should save; caches filling less than a
+//quarter are halved; the cache with most evictions per byte is doubled,
+//by halving caches with less hits per byte if the budget is exceeded.
+//The state and state size caches are tuned together.
+
+void lmtable::adapt_caches(){
+
+  struct{ ngramcache* c; ngramcache* c2; int l,cost; int acc,hit,ev; double v,p; } k[LMTMAXLEV+2];
+  int nk=0;
+  size_t total=0;
+
+  k[nk].c=getprobcache(); k[nk].c2=NULL; k[nk].cost=maxlev; k[nk++].l=0;
+  k[nk].c=getstatecache(); k[nk].c2=getstatesizecache(); k[nk].cost=maxlev-1; k[nk++].l=0;
+  for (int i=2;i<=max_cache_lev;i++){ k[nk].c=getlmtcache(i); k[nk].c2=NULL; k[nk].cost=1; k[nk++].l=i; }
+
+  for (int i=0;i<nk;i++){
+    if (!k[i].c) continue;
+    int a,h,e;
+    k[i].c->sample(k[i].acc,k[i].hit,k[i].ev);
+    if (k[i].c2) k[i].c2->sample(a,h,e);
+    if (k[i].l && k[i].acc>=LMTADAPTMIN && k[i].hit < cacheminhit * k[i].acc){
+      delete k[i].c; k[i].c=NULL;
+      if (concurrent) getlocal()->lmtcache[k[i].l]=NULL; else lmtcache[k[i].l]=NULL;
+      continue;
+    }
+    if (k[i].c->cursize() < k[i].c->maxsize()/4 && k[i].c->maxsize() > LMTADAPTMIN){
+      k[i].c->resize(k[i].c->maxsize()/2);
+      if (k[i].c2) k[i].c2->resize(k[i].c->maxsize());
+    }
+    size_t mem=k[i].c->memsize()+(k[i].c2?k[i].c2->memsize():0);
+    k[i].v=(double)k[i].hit * k[i].cost/mem;
+    k[i].p=(double)k[i].ev * k[i].cost/mem;
+    total+=mem;
+  }
+
+  int g=-1; //cache to grow
+  for (int i=0;i<nk;i++)
+    if (k[i].c && k[i].ev>0 && (g<0 || k[i].p>k[g].p)) g=i;
+
+  size_t need=(g<0?0:k[g].c->memsize()+(k[g].c2?k[g].c2->memsize():0));
+  for (;;){ //shrink caches worth less than the growing one, or exceeding the budget
+    if (total+need<=cachebudget) break;
+    int s=-1;
+    for (int i=0;i<nk;i++)
+      if (k[i].c && i!=g && k[i].c->maxsize()>LMTADAPTMIN && (s<0 || k[i].v<k[s].v)) s=i;
+    if (s<0 || (total<=cachebudget && k[s].v>=k[g].p)) break;
+    size_t mem=k[s].c->memsize()+(k[s].c2?k[s].c2->memsize():0);
+    k[s].c->resize(k[s].c->maxsize()/2);
+    if (k[s].c2) k[s].c2->resize(k[s].c->maxsize());
+    total-=mem-(k[s].c->memsize()+(k[s].c2?k[s].c2->memsize():0));
+  }
+  if (g>=0 && total+need<=cachebudget){
+    k[g].c->resize(k[g].c->maxsize()*2);
+    if (k[g].c2) k[g].c2->resize(k[g].c->maxsize());
+  }
+}
+
+
 void lmtable::init_lmtcaches(int uptolev){
+  assert(!concurrent);
   max_cache_lev=uptolev;
   for (int i=2;i<=max_cache_lev;i++){
     assert(lmtcache[i]==NULL);
@@ -107,24 +260,168 @@ void lmtable::init_lmtcaches(int uptolev){
   }
 }
 
+//caches are bounded and replace their entries, hence they never need to
+//be reset when full: check_cache_levels is kept for compatibility
+
 void lmtable::check_cache_levels(){
-  if (probcache && probcache->isfull()) probcache->reset(probcache->cursize());
-  if (statecache && statecache->isfull()) { 
-    statecache->reset(statecache->cursize());
-    statesizecache->reset(statesizecache->cursize());
-  }
-  for (int i=2;i<=max_cache_lev;i++)
-    if (lmtcache[i]->isfull()) lmtcache[i]->reset(lmtcache[i]->cursize());
 }
 
+//in concurrent mode reset_caches only acts on the caches of the calling
+//thread
+
 void lmtable::reset_caches(){
-  if (probcache) probcache->reset(MAX(probcache->cursize(),probcache->maxsize()));
-  if (statecache){
-    statecache->reset(MAX(statecache->cursize(),statecache->maxsize()));
-    statesizecache->reset(MAX(statesizecache->cursize(),statesizecache->maxsize()));
+  ngramcache* pc=getprobcache();
+  ngramcache* sc=getstatecache();
+  ngramcache* ssc=getstatesizecache();
+  if (pc) pc->reset(MAX(pc->cursize(),pc->maxsize()));
+  if (sc){
+    sc->reset(MAX(sc->cursize(),sc->maxsize()));
+    ssc->reset(MAX(ssc->cursize(),ssc->maxsize()));
   }
+  for (int i=2;i<=max_cache_lev;i++){
+    ngramcache* lc=getlmtcache(i);
+    if (lc) lc->reset(MAX(lc->cursize(),lc->maxsize()));
+  }
+  clearstprobcache(getstprobcache(),stprobbits);
+}
+
+
+//cache snapshots: the n-grams of the prob, state and level caches of
+//the calling thread are saved, at most maxentries per cache (if
+//positive) and the hottest ones last. Word codes are saved as they are,
+//hence a snapshot can only be loaded with the same LM. Loading replays
+//the queries of the n-grams, which fills the caches and touches the
+//memory mapped pages they need, so that a restarted process does not
+//start cold.
+
+static void savecachekeys(fstream& out,const char* name,int l,ngramcache* c,int maxentries){
+  int* keys=new int[(size_t)c->cursize() * l + 1];
+  int n=c->getkeys(keys);
+  int first=(maxentries>0 && n>maxentries?n-maxentries:0);
+  out << name << " " << l << " " << n-first << "\n";
+  out.write((char*)(keys+(size_t)first * l),(size_t)(n-first) * l * sizeof(int));
+  delete [] keys;
+}
+
+void lmtable::save_caches(const char* filename,int maxentries){
+  fstream out(filename,ios::out);
+  if (!out) error("save_caches: cannot open snapshot file");
+  out << "lmtcaches " << maxlev << " " << dict->size() << "\n";
+  if (getprobcache()) savecachekeys(out,"prob",maxlev,getprobcache(),maxentries);
+  if (getstatecache()) savecachekeys(out,"state",maxlev-1,getstatecache(),maxentries);
   for (int i=2;i<=max_cache_lev;i++)
-    lmtcache[i]->reset(MAX(lmtcache[i]->cursize(),lmtcache[i]->maxsize()));
+    if (getlmtcache(i)) savecachekeys(out,"level",i,getlmtcache(i),maxentries);
+}
+
+void lmtable::load_caches(const char* filename){
+  fstream inp(filename,ios::in);
+  string name;
+  int l,n,lev,dsize;
+  if (!(inp >> name >> lev >> dsize) || name!="lmtcaches") error("load_caches: wrong snapshot file");
+  if (lev!=maxlev || dsize!=dict->size()) error("load_caches: snapshot of a different LM");
+
+  ngram ng(dict);
+  int keys[LMTMAXLEV];
+  while (inp >> name >> l >> n){
+    inp.get(); //end of line
+    if (l<1 || l>maxlev) error("load_caches: wrong snapshot file");
+    for (int i=0;i<n && inp.read((char*)keys,l * sizeof(int));i++){
+      ng.size=0;
+      for (int j=0;j<l;j++) ng.pushc(keys[j]);
+      if (name=="prob") clprob(ng);
+      else if (name=="state") cmaxsuffptr(ng);
+      else if (name=="level" && !isReversed) get(ng,l,l);
+    }
+  }
+}
+
+//Concurrent mode: tables (either in RAM or memory mapped) are only read
+//by queries, hence they can be shared by all threads. What is written
+//during a query, i.e. caches and statistics, is instead allocated for
+//each thread the first time it queries the LM. Caches have the same
+//configuration of those initialized before switching the mode on.
+
+void lmtable::setConcurrent(bool v){
+#ifdef WIN32
+  if (v) error("lmtable::setConcurrent: concurrent mode not yet available under WIN32");
+#else
+  if (v==concurrent) return;
+
+  if (v){
+    if (pthread_key_create(&localkey,releaselocal))
+      error("lmtable::setConcurrent: cannot create thread specific key");
+    pthread_mutex_init(&localmutex,NULL);
+    concurrent=true;
+  }
+  else{
+    //threads still alive will not release their data anymore
+    pthread_key_delete(localkey);
+    concurrent=false;
+    for (size_t i=0;i<locals.size();i++) deletelocal(locals[i]);
+    locals.clear();
+    pthread_mutex_destroy(&localmutex);
+  }
+#endif
+}
+
+lmtlocal* lmtable::newlocal(){
+  lmtlocal* loc=new lmtlocal;
+
+  loc->owner=this;
+  for (int i=0;i<=LMTMAXLEV;i++){
+    loc->lmtcache[i]=(lmtcache[i]?new ngramcache(i,sizeof(char *),lmtcache[i]->maxsize()):NULL);
+    loc->totget[i]=loc->totbsearch[i]=0;
+  }
+  loc->probcache=(probcache?new ngramcache(maxlev,sizeof(double),probcache->maxsize()):NULL);
+  loc->statecache=(statecache?new ngramcache(maxlev-1,sizeof(char *),statecache->maxsize()):NULL);
+  loc->statesizecache=(statesizecache?new ngramcache(maxlev-1,sizeof(int),statesizecache->maxsize()):NULL);
+  loc->stprobcache=loc->stprobbuf=NULL;
+  if (stprobcache) loc->stprobcache=newstprobcache(stprobbits,&loc->stprobbuf);
+  loc->stprobhit=loc->stprobmiss=0;
+  loc->adapttick=0;
+
+#ifndef WIN32
+  pthread_mutex_lock(&localmutex);
+  locals.push_back(loc);
+  pthread_mutex_unlock(&localmutex);
+  pthread_setspecific(localkey,loc);
+#endif
+  return loc;
+}
+
+//called at the exit of a thread which queried the LM
+
+void lmtable::releaselocal(void* ptr){
+#ifndef WIN32
+  lmtlocal* loc=(lmtlocal*) ptr;
+  lmtable* lmt=loc->owner;
+
+  pthread_mutex_lock(&lmt->localmutex);
+  for (size_t i=0;i<lmt->locals.size();i++)
+    if (lmt->locals[i]==loc){
+      lmt->locals.erase(lmt->locals.begin()+i);
+      break;
+    }
+  lmt->deletelocal(loc);
+  pthread_mutex_unlock(&lmt->localmutex);
+#endif
+}
+
+//statistics of the thread are kept in the global counters
+
+void lmtable::deletelocal(lmtlocal* loc){
+  for (int i=0;i<=LMTMAXLEV;i++){
+    totget[i]+=loc->totget[i];
+    totbsearch[i]+=loc->totbsearch[i];
+    if (loc->lmtcache[i]) delete loc->lmtcache[i];
+  }
+  if (loc->probcache) delete loc->probcache;
+  if (loc->statecache) delete loc->statecache;
+  if (loc->statesizecache) delete loc->statesizecache;
+  if (loc->stprobbuf) delete [] loc->stprobbuf;
+  stprobhit+=loc->stprobhit;
+  stprobmiss+=loc->stprobmiss;
+  delete loc;
 }
 
 void lmtable::configure(int n,bool quantized){
@@ -139,6 +436,24 @@ void lmtable::configure(int n,bool quantized){
 
 
 
+//binary LMs start with "blmt" preceded by the letters of their options:
+//Q (quantized), P (bit-packed levels), C (columnar levels), R
+//(reversed-context tables)
+
+static bool binheader(const char* header,bool* q=NULL,bool* p=NULL,bool* c=NULL,bool* r=NULL){
+  bool fq=(*header=='Q'); header+=fq;
+  bool fp=(*header=='P'); header+=fp;
+  bool fc=(*header=='C'); header+=fc;
+  bool fr=(*header=='R'); header+=fr;
+  if (strncmp(header,"blmt",4)) return false;
+  if (q) *q=fq;
+  if (p) *p=fp;
+  if (c) *c=fc;
+  if (r) *r=fr;
+  return true;
+}
+
+
 //loadstd::istream& inp a lmtable from a lm file
 
 void lmtable::load(istream& inp,const char* filename,const char* outfilename,int keep_on_disk,OUTFILE_TYPE outtype){
@@ -155,7 +470,7 @@ void lmtable::load(istream& inp,const char* filename,const char* outfilename,int
   inp >> header;
   //cerr << header << "\n";
 
-  if (strncmp(header,"Qblmt",5)==0 || strncmp(header,"blmt",4)==0){
+  if (binheader(header)){
     //if (outtype==BINARY) {
     //cerr << "Load Error: nothing to do. Passed input file: binary. Specified output format: binary.\n";
     //exit(0);
@@ -182,6 +497,9 @@ void lmtable::load(istream& inp,const char* filename,const char* outfilename,int
     loadtxt(inp,header,outfilename,keep_on_disk);
   }
 
+  setkernels();
+  boscode=dict->getcode(dict->BoS());
+
   //cerr << "OOV code is " << lmtable::getDict()->oovcode() << "\n";
 }
 
@@ -666,7 +984,7 @@ void lmtable::printTable(int level) {
   float p;
   for (table_entry_pos_t c=0;c<printEntryN;c++){
     p=prob(tbl,ndt);
-    cout << p << " " << word(tbl) << "\n";
+    cout << p << " " << word(tbl,ndt) << "\n";
     //cout << *(float *)&p << " " << word(tbl) << "\n";
     tbl+=ndsz;
   }
@@ -748,7 +1066,6 @@ template<typename TA, typename TB>
 int lmtable::add(ngram& ng, TA iprob,TB ibow){
 
   char *found; LMT_TYPE ndt; int ndsz;
-  static int no_more_msg = 0;
 
   if (ng.size>1){
 
@@ -816,6 +1133,215 @@ int lmtable::add(ngram& ng, TA iprob,TB ibow){
 }
 
 
+//query kernels: the node type N (or I for internal levels and L for
+//the last one) is known at compile time, hence node sizes are constants
+//and fields are read without switching on the table type
+
+template<class N> char* lmtable::tsearch(int l,table_entry_pos_t offs,table_entry_pos_t n,int key){
+
+  //assume 1-grams is a 1-1 map of the vocabulary
+  if (l==1) return (key < (float) n ? table[1] + (table_pos_t)key * N::SIZE:NULL);
+
+  table_entry_pos_t idx=0;
+  countbsearch(l);
+
+  if (keyidx[l]){
+    if (n < LMTSCANSIZE){
+      if (!keyscan(keyidx[l]+offs,n,key,&idx)) return NULL;
+    }
+    else
+      if (!keysearch(keyidx[l]+offs,n,key,&idx)) return NULL;
+    return table[l]+(table_pos_t)(offs+idx) * N::SIZE;
+  }
+
+  char* tb=table[l]+(table_pos_t)offs * N::SIZE;
+  if (!nodebsearch<N>(tb,n,key,&idx)) return NULL;
+  return tb+(table_pos_t)idx * N::SIZE;
+}
+
+
+//get of byte-aligned tables (see getgeneric)
+
+template<class I,class L> int lmtable::tget(ngram& ng,int n,int lev){
+
+  table_entry_pos_t offset=0,limit=cursize[1];
+  char* found;
+  float p;
+  ng.link=NULL;
+  ng.lev=0;
+
+  for (int l=1;l<=lev;l++){
+
+    ngramcache* lc=getlmtcache(l);
+    found=NULL;
+
+    if (!(lc && lc->get(ng.wordp(n),(char *)&found))){
+      int w=*ng.wordp(n-l+1);
+      found=(l<maxlev?tsearch<I>(l,offset,limit-offset,w):tsearch<L>(l,offset,limit-offset,w));
+      //insert both found and not found items!!!
+      if (lc) lc->add(ng.wordp(n),(char *)&found);
+    }
+
+    if (!found) return 0;
+
+    if (l<maxlev){
+      if ((p=I::prob(found))==NOPROB) return 0; //pruned n-gram
+      ng.bow=I::bow(found);
+
+      //set start/end point for next search, as in getgeneric
+      if (offset+1==cursize[l]) limit=cursize[l+1];
+      else limit=I::bound(found);
+      offset=(found==table[l]?0:I::bound(found - I::SIZE));
+    }
+    else{
+      if ((p=L::prob(found))==NOPROB) return 0; //pruned n-gram
+      ng.bow=0;
+    }
+    ng.prob=p;
+    ng.link=found;
+    ng.info=tbltype[l];
+    ng.lev=l;
+  }
+
+  ng.size=n;  ng.freq=0;
+  ng.succ=(lev<maxlev?limit-offset:0);
+
+  return 1;
+}
+
+
+//get of columnar tables: word columns are searched as key indexes
+
+template<bool Q> int lmtable::cget(ngram& ng,int n,int lev){
+
+  table_entry_pos_t offset=0,limit=cursize[1],idx=0;
+  char* found;
+  ng.link=NULL;
+  ng.lev=0;
+
+  for (int l=1;l<=lev;l++){
+
+    ngramcache* lc=getlmtcache(l);
+    found=NULL;
+
+    if (!(lc && lc->get(ng.wordp(n),(char *)&found))){
+      int w=*ng.wordp(n-l+1);
+      if (l==1) //assume 1-grams is a 1-1 map of the vocabulary
+        found=(w < (float) limit ? table[1]+w:NULL);
+      else{
+        const int* keys=(const int*)colfield[l][0]+offset;
+        table_entry_pos_t m=limit-offset;
+        countbsearch(l);
+        if (m < LMTSCANSIZE?keyscan(keys,m,w,&idx):keysearch(keys,m,w,&idx))
+          found=table[l]+offset+idx;
+      }
+      //insert both found and not found items!!!
+      if (lc) lc->add(ng.wordp(n),(char *)&found);
+    }
+
+    if (!found) return 0;
+
+    table_entry_pos_t i=found-table[l];
+    float p=(Q?(float)((qfloat_t*)colfield[l][1])[i]:((float*)colfield[l][1])[i]);
+    if (p==NOPROB) return 0; //pruned n-gram
+
+    if (l<maxlev){
+      const table_entry_pos_t* bounds=(const table_entry_pos_t*)colfield[l][3];
+      ng.bow=(Q?(float)((qfloat_t*)colfield[l][2])[i]:((float*)colfield[l][2])[i]);
+
+      //set start/end point for next search, as in getgeneric
+      if (offset+1==cursize[l]) limit=cursize[l+1];
+      else limit=bounds[i];
+      offset=(i==0?0:bounds[i-1]);
+    }
+    else ng.bow=0;
+
+    ng.prob=p;
+    ng.link=found;
+    ng.info=tbltype[l];
+    ng.lev=l;
+  }
+
+  ng.size=n;  ng.freq=0;
+  ng.succ=(lev<maxlev?limit-offset:0);
+
+  return 1;
+}
+
+
+//lprob with get kernel G of tables with quantized probs (Q) or not:
+//back-off steps are iterated instead of recursive calls, and weights
+//summed in the same order of lprob
+
+template<bool Q,int (lmtable::*G)(ngram&,int,int)> double lmtable::tlprob(ngram& ng,double* bow,int* bol){
+
+  double rbow[LMTMAXLEV+1],lpr;
+  int nbo=0;
+
+  if (bow) *bow=0;
+  if (bol) *bol=0;
+
+  for (;;){
+    countget(ng.size);
+    if ((this->*G)(ng,ng.size,ng.size)){
+      lpr = (double)(Q?Pcenters[ng.size][(qfloat_t)ng.prob]:ng.prob);
+      if (*ng.wordp(1)==dict->oovcode()) lpr-=logOOVpenalty;
+      break;
+    }
+    if (ng.size==1){ //means an OOV word
+      lpr = -log(UNIGRAM_RESOLUTION)/M_LN10;
+      break;
+    }
+
+    //found history in table: use its bo weight, but not that of <unk>
+    double rb=0.0;
+    if ((ng.lev==(ng.size-1)) && (*ng.wordp(2)!=dict->oovcode()))
+      rb = (double)(Q?Bcenters[ng.lev][(qfloat_t)ng.bow]:ng.bow);
+    if (bow) (*bow)+=rb;
+    if (bol) (*bol)++;
+    rbow[nbo++]=rb;
+    ng.size--;
+  }
+
+  while (nbo>0) lpr = rbow[--nbo] + lpr;
+  return lpr;
+}
+
+
+//selects the query kernels for the current tables
+
+void lmtable::setkernels(){
+
+  getkernel=&lmtable::getgeneric;
+  lprobkernel=NULL;
+
+  if (isReversed) lprobkernel=&lmtable::revlprob;
+  else if (isColumnar){
+    if (isQtable){
+      getkernel=&lmtable::cget<true>;
+      lprobkernel=&lmtable::tlprob<true,&lmtable::cget<true> >;
+    }
+    else{
+      getkernel=&lmtable::cget<false>;
+      lprobkernel=&lmtable::tlprob<false,&lmtable::cget<false> >;
+    }
+  }
+  else if (!isPacked){
+    if (isQtable){
+      getkernel=&lmtable::tget<lmtqinode,lmtqlnode>;
+      lprobkernel=&lmtable::tlprob<true,&lmtable::tget<lmtqinode,lmtqlnode> >;
+    }
+    else{
+      getkernel=&lmtable::tget<lmtinode,lmtlnode>;
+      lprobkernel=&lmtable::tlprob<false,&lmtable::tget<lmtinode,lmtlnode> >;
+    }
+  }
+
+  //higher levels are looked up in the hash tables by get()
+  if (maxlev>1 && hashtb[maxlev]) lprobkernel=NULL;
+}
+
+
 void *lmtable::search(int lev,
                       table_entry_pos_t offs,
                       table_entry_pos_t n,
@@ -834,6 +1360,55 @@ void *lmtable::search(int lev,
   if (lev==1) return *found=(*ngp < (float) n ? table[1] + *ngp * sz:NULL);
 
 
+  //search the key index, if available
+  if (keyidx[lev] && action==LMT_FIND){
+    table_entry_pos_t idx=0;
+    *found=NULL;
+    countbsearch(lev);
+    if (n < LMTSCANSIZE){
+      if (!keyscan(keyidx[lev]+offs,n,*ngp,&idx)) return NULL;
+    }
+    else
+      if (!keysearch(keyidx[lev]+offs,n,*ngp,&idx)) return NULL;
+    return *found=table[lev]+(sz * ((table_pos_t)offs+idx));
+  }
+
+  //search the word column of a columnar level
+  if (tbltype[lev]>=COLUMNAR){
+    table_entry_pos_t idx=0;
+    const int* keys=(const int*)colfield[lev][0]+offs;
+    *found=NULL;
+    if (action!=LMT_FIND) error("lmtable::search: columnar levels cannot be changed");
+    countbsearch(lev);
+    if (n < LMTSCANSIZE){
+      if (!keyscan(keys,n,*ngp,&idx)) return NULL;
+    }
+    else
+      if (!keysearch(keys,n,*ngp,&idx)) return NULL;
+    return *found=table[lev]+offs+idx;
+  }
+
+  //search a bit-packed level
+  if (tbltype[lev]>=PACKED){
+    table_entry_pos_t idx=0;
+    *found=NULL;
+    if (action!=LMT_FIND) error("lmtable::search: bit-packed levels cannot be changed");
+    countbsearch(lev);
+    if (!packedsearch(lev,offs,n,*ngp,&idx)) return NULL;
+    return *found=table[lev]+offs+idx;
+  }
+
+  //byte-aligned levels are searched by the kernel of their node type
+  if (action==LMT_FIND){
+    switch (tbltype[lev]){
+    case INTERNAL: return *found=tsearch<lmtinode>(lev,offs,n,*ngp);
+    case QINTERNAL: return *found=tsearch<lmtqinode>(lev,offs,n,*ngp);
+    case LEAF: return *found=tsearch<lmtlnode>(lev,offs,n,*ngp);
+    case QLEAF: return *found=tsearch<lmtqlnode>(lev,offs,n,*ngp);
+    default: break;
+    }
+  }
+
   //prepare table to be searched with mybserach
   char* tb;
   tb=table[lev]+(sz * (table_pos_t)offs);
@@ -843,7 +1418,7 @@ void *lmtable::search(int lev,
   table_entry_pos_t idx=0; // index returned by mybsearch
   *found=NULL;	//initialize output variable
 
-  totbsearch[lev]++;
+  countbsearch(lev);
   switch(action){
   case LMT_FIND:
 //    if (!tb || !mybsearch(tb,n,sz,(unsigned char *)w,&idx)) return NULL;
@@ -858,6 +1433,79 @@ void *lmtable::search(int lev,
 }
 
 
+//branchless search of key in a sorted array of n word codes: the loop
+//only depends on n, and both candidates of the next probe are prefetched
+
+int lmtable::keysearch(const int *keys, table_entry_pos_t n, int key, table_entry_pos_t *idx)
+{
+  if (n==0) return 0;
+
+  const int *base=keys;
+  while (n>1){
+    table_entry_pos_t half=n/2;
+    LMTPREFETCH(base+half/2);
+    LMTPREFETCH(base+half+half/2);
+    base=(base[half]<=key?base+half:base);
+    n-=half;
+  }
+
+  *idx=base-keys;
+  return *base==key;
+}
+
+
+//binary search of key among n entries of a bit-packed level
+
+int lmtable::packedsearch(int lev, table_entry_pos_t offs, table_entry_pos_t n, int key, table_entry_pos_t *idx)
+{
+  LMT_TYPE ndt=tbltype[lev];
+  char* tb=table[lev]+offs;
+  table_entry_pos_t low=0,high=n;
+  int w;
+
+  while (low < high){
+    *idx=(low + high) / 2;
+    w=word(tb + *idx,ndt);
+    if (key < w) high=*idx;
+    else if (key > w) low=*idx + 1;
+    else return 1;
+  }
+  return 0;
+}
+
+
+//vectorized search of key in a short sorted array of n word codes: the
+//position of key is the number of codes smaller than key, which are
+//counted a block of codes at a time (8 with AVX2, 4 with SSE2)
+
+int lmtable::keyscan(const int *keys, table_entry_pos_t n, int key, table_entry_pos_t *idx)
+{
+  table_entry_pos_t i=0,c=0;
+
+#if defined(__SSE2__)
+  __m128i k4=_mm_set1_epi32(key);
+#if defined(__AVX2__)
+  __m256i k8=_mm256_set1_epi32(key),c8=_mm256_setzero_si256();
+  for (;i+8<=n;i+=8) //comparisons give -1 for smaller codes
+    c8=_mm256_sub_epi32(c8,_mm256_cmpgt_epi32(k8,_mm256_loadu_si256((const __m256i *)(keys+i))));
+  __m128i c4=_mm_add_epi32(_mm256_castsi256_si128(c8),_mm256_extracti128_si256(c8,1));
+#else
+  __m128i c4=_mm_setzero_si128();
+#endif
+  for (;i+4<=n;i+=4)
+    c4=_mm_sub_epi32(c4,_mm_cmpgt_epi32(k4,_mm_loadu_si128((const __m128i *)(keys+i))));
+  c4=_mm_add_epi32(c4,_mm_shuffle_epi32(c4,0x4e));
+  c4=_mm_add_epi32(c4,_mm_shuffle_epi32(c4,0xb1));
+  c=_mm_cvtsi128_si32(c4);
+#endif
+
+  for (;i<n;i++) c+=(keys[i]<key);
+
+  *idx=c;
+  return c<n && keys[c]==key;
+}
+
+
 //int lmtable::mybsearch(char *ar, table_pos_t n, int size, unsigned char *key, table_pos_t *idx)
 int lmtable::mybsearch(char *ar, table_entry_pos_t n, int size, char *key, table_entry_pos_t *idx)
 {
@@ -926,10 +1574,13 @@ lmtable* lmtable::cpsublm(dictionary* subdict,bool keepunigr){
 	
   //create new lmtable that inherits all features of this lmtable
 	
+  if (isPacked) error("cpsublm: bit-packed LMs cannot be filtered");
+  if (isColumnar) error("cpsublm: columnar LMs cannot be filtered");
+  if (isReversed) error("cpsublm: reversed-context LMs cannot be filtered");
+
   lmtable* slmt=new lmtable();		
+  slmt->isQtable=isQtable;
   slmt->configure(maxlev,isQtable);
-  slmt->dict=new dictionary((keepunigr?dict:subdict),0);
-  std::cerr << "subdict size: " << slmt->dict->size() << "\n";
 	
   if (isQtable){
     for (int i=1;i<=maxlev;i++)  {
@@ -944,13 +1595,28 @@ lmtable* lmtable::cpsublm(dictionary* subdict,bool keepunigr){
   //mange dictionary information
 	
   //generate OOV codes and build dictionary lookup table 
-  dict->genoovcode(); slmt->dict->genoovcode(); subdict->genoovcode();
+  dict->genoovcode(); subdict->genoovcode();
+  if (keepunigr){
+    delete slmt->dict;
+    slmt->dict=new dictionary(dict,0);
+  }
+  else{
+    //words of the LM in subdict, and the OOV word, are coded in the order
+    //of their codes in the LM, so that successors stay sorted
+    slmt->dict->incflag(1);
+    for (int c=0;c<dict->size();c++)
+      if (c == dict->oovcode() || subdict->getcode(dict->decode(c)) != -1)
+        slmt->dict->encode(dict->decode(c));
+    slmt->dict->incflag(0);
+  }
+  slmt->dict->genoovcode();
   std::cerr << "subdict size: " << slmt->dict->size() << "\n";
   int* lookup;lookup=new int [dict->size()];
   for (int c=0;c<dict->size();c++){
-    lookup[c]=subdict->encode(dict->decode(c));
-    if (c != dict->oovcode() && lookup[c] == subdict->oovcode())
+    if (c != dict->oovcode() && subdict->getcode(dict->decode(c)) == -1)
       lookup[c]=-1; // words of this->dict that are not in slmt->dict
+    else
+      lookup[c]=(keepunigr?c:slmt->dict->getcode(dict->decode(c)));
   }
 	
   //variables useful to navigate in the lmtable structure
@@ -1033,6 +1699,9 @@ lmtable* lmtable::cpsublm(dictionary* subdict,bool keepunigr){
 		
   }
 	
+  delete [] lookup;
+  slmt->setkernels();
+  slmt->boscode=slmt->dict->getcode(slmt->dict->BoS());
 	
   return slmt;
 }
@@ -1043,6 +1712,8 @@ lmtable* lmtable::cpsublm(dictionary* subdict,bool keepunigr){
 
 void lmtable::savetxt(const char *filename){
 
+  if (isReversed) error("savetxt: reversed-context LMs cannot be saved in text form");
+
   fstream out(filename,ios::out);
   table_entry_pos_t cnt[1+MAX_NGRAM];
   int l;
@@ -1090,7 +1761,7 @@ void lmtable::savetxt(const char *filename){
 }
 
 
-void lmtable::savebin(const char *filename){
+void lmtable::savebin(const char *filename,bool packed,bool columnar){
 
   if (isPruned){
     cerr << "savebin: pruned LM cannot be saved in binary form\n";
@@ -1100,17 +1771,25 @@ void lmtable::savebin(const char *filename){
   fstream out(filename,ios::out);
   cerr << "savebin: " << filename << "\n";
 
+  if (packed && columnar) error("savebin: levels cannot be both bit-packed and columnar");
+  if (packed && !isPacked) setpacklayout();
+  if (columnar && !isColumnar) setcollayout();
+
   // print header
+  out << (isQtable?"Q":"") << (packed?"P":"") << (columnar?"C":"") << (isReversed?"R":"") << "blmt " << maxlev;
+  for (int i=1;i<=maxlev;i++) out << " " << cursize[i];
+  out << "\n";
+
   if (isQtable){
-    out << "Qblmt " << maxlev;
-    for (int i=1;i<=maxlev;i++) out << " " << cursize[i];
-    out << "\nNumCenters";
+    out << "NumCenters";
     for (int i=1;i<=maxlev;i++)  out << " " << NumCenters[i];
     out << "\n";
+  }
 
-  }else{
-    out << "blmt " << maxlev;
-    for (int i=1;i<=maxlev;i++) out << " " << cursize[i] ;
+  if (packed){ //field widths of each level
+    out << "Bits";
+    for (int i=1;i<=maxlev;i++)
+      for (int f=0;f<4;f++) out << " " << pkbits[i][f];
     out << "\n";
   }
 
@@ -1123,39 +1802,921 @@ void lmtable::savebin(const char *filename){
       if (i<maxlev)
         out.write((char *)Bcenters[i],NumCenters[i] * sizeof(float));
     }
-    out.write(table[i],cursize[i]*nodesize(tbltype[i]));
+    writelevel(out,i,packed,columnar);
   }
 
+  if (isReversed) //flags of reversed-context tables
+    for (int i=1;i<=maxlev;i++){
+      out.write((char *)revreal[i],((table_pos_t)cursize[i]+7) / 8);
+      if (i<maxlev)
+        out.write((char *)revext[i],((table_pos_t)cursize[i]+7) / 8);
+    }
+
+  savesections(out);
+
   cerr << "done\n";
 }
 
 
-//manages the long header of a bin file
-//and allocates table for each n-gram level
+//number of bits needed to represent v
 
-void lmtable::loadbinheader(istream& inp,const char* header){
+static int bitsfor(unsigned int v){
+  int b=1;
+  while (b<32 && (v >> b)) b++;
+  return b;
+}
 
-  // read rest of header
-  inp >> maxlev;
 
-  if (strncmp(header,"Qblmt",5)==0) isQtable=1;
-  else if(strncmp(header,"blmt",4)==0) isQtable=0;
-  else error("loadbin: LM file is not in binary format");
+//sets the minimal field widths for bit-packing the current tables: word
+//codes of each level, codebooks of quantized probs and bows (otherwise
+//raw floats), positions of the next level for bounds
 
-  configure(maxlev,isQtable);
+void lmtable::setpacklayout(){
+
+  assert(!isPacked);
 
   for (int l=1;l<=maxlev;l++){
-    inp >> cursize[l]; maxsize[l]=cursize[l];
+    LMT_TYPE ndt=tbltype[l];
+    int ndsz=nodesize(ndt),maxw=0;
+    for (table_entry_pos_t i=0;i<cursize[l];i++)
+      maxw=MAX(maxw,word(table[l]+(table_pos_t)i * ndsz,ndt));
+
+    pkbits[l][0]=bitsfor(maxw);
+    pkbits[l][1]=(isQtable?bitsfor(NumCenters[l]-1):32);
+    pkbits[l][2]=(l<maxlev?pkbits[l][1]:0);
+    pkbits[l][3]=(l<maxlev?bitsfor(cursize[l+1]):0);
+
+    nodebits[l]=0;
+    for (int f=0;f<4;f++){
+      pkoffs[l][f]=nodebits[l];
+      nodebits[l]+=pkbits[l][f];
+    }
   }
+}
 
-  if (isQtable){
-    char header2[100];
-    inp >> header2;
+
+//bytes of the column of field f of level l
+
+int lmtable::colwidth(int l,int f){
+  switch (f){
+  case 0: return sizeof(int);
+  case 1: return (isQtable?QPROBSIZE:PROBSIZE);
+  case 2: return (l<maxlev?(isQtable?QPROBSIZE:PROBSIZE):0);
+  default: return (l<maxlev?BOUNDSIZE:0);
+  }
+}
+
+
+//sets the offsets of the columns of each level: columns start at
+//multiples of 32 bytes from the begin of the level
+
+void lmtable::setcollayout(){
+  for (int l=1;l<=maxlev;l++){
+    table_pos_t offs=0;
+    for (int f=0;f<4;f++){
+      coloffs[l][f]=offs;
+      offs+=(table_pos_t)cursize[l] * colwidth(l,f);
+      offs=(offs + 31) / 32 * 32;
+    }
+    coloffs[l][4]=offs;
+  }
+}
+
+void lmtable::setcolumns(int l){
+  for (int f=0;f<4;f++) colfield[l][f]=table[l]+coloffs[l][f];
+}
+
+
+//size in bytes of table l
+
+table_pos_t lmtable::tablesize(int l){
+  if (isColumnar) return coloffs[l][4];
+  if (isPacked) return ((table_pos_t)cursize[l] * nodebits[l] + 7) / 8;
+  return (table_pos_t)cursize[l] * nodesize(tbltype[l]);
+}
+
+
+//writes table l either bit-packed or with byte-aligned nodes,
+//converting it a block of entries at a time if needed
+
+void lmtable::writelevel(fstream& out,int l,bool packed,bool columnar){
+
+  if (packed==isPacked && columnar==isColumnar){
+    out.write(table[l],tablesize(l));
+    return;
+  }
+
+  if (columnar){
+    writecolumns(out,l);
+    return;
+  }
+
+  LMT_TYPE ndt=tbltype[l],ondt;
+  if (isQtable) ondt=(l<maxlev?QINTERNAL:QLEAF);
+  else ondt=(l<maxlev?INTERNAL:LEAF);
+  int ndsz=nodesize(ndt),ondsz=nodesize(ondt);
+
+  const table_entry_pos_t block=8 * 65536; //multiple of 8: packed blocks end at byte boundaries
+  table_pos_t bsize=(packed?(table_pos_t)block * nodebits[l] / 8:(table_pos_t)block * ondsz);
+  char* buf=new char[bsize];
+
+  for (table_entry_pos_t b=0;b<cursize[l];b+=block){
+    table_entry_pos_t n=(cursize[l]-b < block?cursize[l]-b:block);
+    memset(buf,0,bsize);
+
+    for (table_entry_pos_t i=0;i<n;i++){
+      node nd=table[l]+(table_pos_t)(b+i) * ndsz;
+      float p=prob(nd,ndt),bw=(l<maxlev?bow(nd,ndt):0);
+
+      if (packed){
+        table_pos_t pos=(table_pos_t)i * nodebits[l];
+        unsigned int v;
+        putbits(buf,pos+pkoffs[l][0],pkbits[l][0],word(nd,ndt));
+        if (isQtable) v=(unsigned int)p; else memcpy(&v,&p,sizeof(float));
+        putbits(buf,pos+pkoffs[l][1],pkbits[l][1],v);
+        if (l<maxlev){
+          if (isQtable) v=(unsigned int)bw; else memcpy(&v,&bw,sizeof(float));
+          putbits(buf,pos+pkoffs[l][2],pkbits[l][2],v);
+          putbits(buf,pos+pkoffs[l][3],pkbits[l][3],bound(nd,ndt));
+        }
+      }
+      else{
+        node ond=buf+(table_pos_t)i * ondsz;
+        word(ond,word(nd,ndt));
+        if (isQtable) prob(ond,ondt,(qfloat_t)p); else prob(ond,ondt,p);
+        if (l<maxlev){
+          if (isQtable) bow(ond,ondt,(qfloat_t)bw); else bow(ond,ondt,bw);
+          bound(ond,ondt,bound(nd,ndt));
+        }
+      }
+    }
+    out.write(buf,(packed?((table_pos_t)n * nodebits[l] + 7) / 8:(table_pos_t)n * ondsz));
+  }
+
+  delete [] buf;
+}
+
+
+//writes the columns of table l, converting a block of entries at a time
+
+void lmtable::writecolumns(fstream& out,int l){
+
+  LMT_TYPE ndt=tbltype[l];
+  int ndsz=nodesize(ndt);
+  const table_entry_pos_t block=65536;
+  char* buf=new char[block * sizeof(float)];
+  table_pos_t written=0;
+
+  for (int f=0;f<4;f++){
+    int w=colwidth(l,f);
+
+    for (table_entry_pos_t b=0;w>0 && b<cursize[l];b+=block){
+      table_entry_pos_t n=(cursize[l]-b < block?cursize[l]-b:block);
+
+      for (table_entry_pos_t i=0;i<n;i++){
+        node nd=table[l]+(table_pos_t)(b+i) * ndsz;
+        char* v=buf+(table_pos_t)i * w;
+        if (f==0){ int wd=word(nd,ndt); memcpy(v,&wd,w); }
+        else if (f==3){ table_entry_pos_t bd=bound(nd,ndt); memcpy(v,&bd,w); }
+        else{
+          float p=(f==1?prob(nd,ndt):bow(nd,ndt));
+          if (isQtable) *v=(qfloat_t)p; else memcpy(v,&p,w);
+        }
+      }
+      out.write(buf,(table_pos_t)n * w);
+      written+=(table_pos_t)n * w;
+    }
+
+    //padding up to the next column
+    memset(buf,0,32);
+    out.write(buf,coloffs[l][f+1]-written);
+    written=coloffs[l][f+1];
+  }
+
+  delete [] buf;
+}
+
+
+//optional sections are appended after the tables, each one with a
+//header line "section <name> <level> <bytes>": old readers ignore them.
+//Header lines are padded so that data are aligned to 32 bytes in the
+//file, as required by vector instructions when sections are mapped.
+
+static void sectionheader(fstream& out,const char* name,int l,table_pos_t bytes){
+  std::ostringstream hdr;
+  hdr << "\nsection " << name << " " << l << " " << bytes;
+  table_pos_t pos=(table_pos_t)out.tellp() + hdr.str().size();
+  out << hdr.str() << std::string(31 - pos % 32,' ') << "\n";
+}
+
+void lmtable::savesections(fstream& out){
+
+  for (int l=2;l<=maxlev;l++)
+    if (keyidx[l]){
+      cerr << "saving key index of " << l << "-grams\n";
+      sectionheader(out,"keyindex",l,(table_pos_t)cursize[l] * sizeof(int));
+      out.write((char *)keyidx[l],(table_pos_t)cursize[l] * sizeof(int));
+    }
+
+  for (int l=1;l<=maxlev;l++)
+    if (topord[l]){
+      cerr << "saving top-k index of " << l << "-grams\n";
+      sectionheader(out,"topk",l,(table_pos_t)cursize[l] * sizeof(table_entry_pos_t));
+      out.write((char *)topord[l],(table_pos_t)cursize[l] * sizeof(table_entry_pos_t));
+    }
+}
+
+
+void lmtable::loadsections(istream& inp){
+
+  char tag[MAX_LINE],name[MAX_LINE];
+  int l; table_pos_t bytes;
+
+  while (inp >> tag && strcmp(tag,"section")==0){
+    inp >> name >> l >> bytes;
+    inp.ignore(MAX_LINE,'\n'); //padding and end of header line
+
+    if (strcmp(name,"keyindex")==0 && l>1 && l<=maxlev &&
+        bytes==(table_pos_t)cursize[l] * sizeof(int)){
+      if (memmap == 0 || l < memmap){
+        keyidx[l]=new int[cursize[l]];
+        inp.read((char *)keyidx[l],bytes);
+      } else {
+#ifndef WIN32
+        keyidxOffs[l]=inp.tellg();
+        keyidx[l]=(int *)MMap(diskid,PROT_READ,keyidxOffs[l],bytes,&keyidxGaps[l]);
+        keyidx[l]=(int *)((char *)keyidx[l]+keyidxGaps[l]);
+        keyidxMapped[l]=true;
+        inp.seekg(bytes,ios_base::cur);
+#endif
+      }
+    } else if (strcmp(name,"topk")==0 && l>0 && l<=maxlev &&
+               bytes==(table_pos_t)cursize[l] * sizeof(table_entry_pos_t)){
+      if (memmap == 0 || l < memmap){
+        topord[l]=new table_entry_pos_t[cursize[l]];
+        inp.read((char *)topord[l],bytes);
+      } else {
+#ifndef WIN32
+        topordOffs[l]=inp.tellg();
+        topord[l]=(table_entry_pos_t *)MMap(diskid,PROT_READ,topordOffs[l],bytes,&topordGaps[l]);
+        topord[l]=(table_entry_pos_t *)((char *)topord[l]+topordGaps[l]);
+        topordMapped[l]=true;
+        inp.seekg(bytes,ios_base::cur);
+#endif
+      }
+    } else {
+      cerr << "skipping section " << name << " of level " << l << "\n";
+      inp.ignore(bytes);
+    }
+  }
+}
+
+
+//hash code of n words: word codes are mixed by FNV-1a steps (hence
+//the state of a prefix can be extended) and finalized as in
+//MurmurHash3; 0 marks empty slots
+
+#define FNVSTART 14695981039346656037ULL
+#define FNVSTEP(h,w) (((h) ^ (unsigned int)(w)) * 1099511628211ULL)
+
+static inline unsigned long long ngramkey(unsigned long long h){
+  h^=h >> 33; h*=0xff51afd7ed558ccdULL;
+  h^=h >> 33; h*=0xc4ceb9fe1a85ec53ULL;
+  h^=h >> 33;
+  return (h?h:1);
+}
+
+static inline unsigned long long ngramkey(const int* w,int n){
+  unsigned long long h=FNVSTART;
+  for (int i=0;i<n;i++) h=FNVSTEP(h,w[i]);
+  return ngramkey(h);
+}
+
+
+//builds the hash backend from the tables: only n-grams reachable by
+//get(), i.e. whose prefixes are not pruned, are stored; the number of
+//successors is computed as in get(). As codes of prefixes are extended
+//by FNV steps, the extensions of two colliding n-grams collide too:
+//both subtrees are then marked as colliding, so that queries sharing
+//their hash codes are searched in the tables
+
+void lmtable::build_hash(){
+  assert(!concurrent);
+  if (isReversed) error("build_hash: reversed-context LMs cannot be hashed");
+  if (maxlev==1 || hashtb[maxlev]) return;
+
+  for (int l=2;l<=maxlev;l++){
+    unsigned long long cap=2;
+    while (cap < (unsigned long long)cursize[l] * 3 / 2 + 1) cap*=2; //load factor <= 2/3
+    hashtb[l]=new lmthashentry[cap];
+    memset(hashtb[l],0,cap * sizeof(lmthashentry));
+    hashmask[l]=cap-1;
+  }
+
+  int w[LMTMAXLEV+1],colliding=0;
+  LMT_TYPE ndt=tbltype[1];
+  int ndsz=nodesize(ndt);
+  for (table_entry_pos_t i=0;i<cursize[1];i++){
+    node nd=table[1]+(table_pos_t)i * ndsz;
+    if (prob(nd,ndt)==NOPROB) continue;
+    w[0]=i;
+    table_entry_pos_t offset=(i==0?0:bound(nd-ndsz,ndt));
+    table_entry_pos_t limit=(cursize[1]==1?cursize[2]:bound(nd,ndt));
+    colliding+=hashlevel(2,w,offset,limit);
+  }
+  if (colliding)
+    cerr << "build_hash: " << colliding << " n-grams with colliding hash codes are searched in the tables\n";
+
+  setkernels();
+}
+
+//stores the l-grams between ipos and epos and their successors, all
+//marked as colliding if colliding is set; returns the number of marked
+//n-grams
+
+int lmtable::hashlevel(int l,int* w,table_entry_pos_t ipos,table_entry_pos_t epos,bool colliding){
+
+  LMT_TYPE ndt=tbltype[l];
+  int ndsz=nodesize(ndt);
+  int marked=0;
+
+  for (table_entry_pos_t i=ipos;i<epos;i++){
+    node nd=table[l]+(table_pos_t)i * ndsz;
+    if (prob(nd,ndt)==NOPROB) continue;
+    w[l-1]=word(nd,ndt);
+
+    unsigned long long key=ngramkey(w,l);
+    unsigned long long h=key & hashmask[l];
+    while (hashtb[l][h].key && hashtb[l][h].key!=key) h=(h+1) & hashmask[l];
+    lmthashentry* e=&hashtb[l][h];
+
+    if (e->key && e->pos!=HASH_COLLIDING && e->pos!=i){
+      //colliding n-gram: the stored one and its successors are marked
+      if (l<maxlev){
+        node sd=table[l]+(table_pos_t)e->pos * ndsz;
+        table_entry_pos_t offset=(e->pos==0?0:bound(sd-ndsz,ndt));
+        marked+=hashlevel(l+1,w,offset,bound(sd,ndt),true);
+      }
+      e->pos=HASH_COLLIDING;
+      marked++;
+    }
+
+    if (e->key || colliding){
+      e->key=key; e->pos=HASH_COLLIDING;
+      marked++;
+    }
+    else{
+      e->key=key; e->pos=i;
+      e->prob=prob(nd,ndt);
+      e->bow=(l<maxlev?bow(nd,ndt):0);
+      e->succ=0;
+    }
+
+    if (l<maxlev){
+      table_entry_pos_t offset=(i==0?0:bound(nd-ndsz,ndt));
+      table_entry_pos_t limit=(ipos+1==cursize[l]?cursize[l+1]:bound(nd,ndt));
+      if (e->pos!=HASH_COLLIDING) e->succ=limit-offset;
+      marked+=hashlevel(l+1,w,offset,limit,e->pos==HASH_COLLIDING);
+    }
+  }
+  return marked;
+}
+
+void lmtable::delete_hash(){
+  for (int l=2;l<=LMTMAXLEV;l++)
+    if (hashtb[l]){
+      delete [] hashtb[l];
+      hashtb[l]=NULL;
+    }
+  setkernels();
+}
+
+lmthashentry* lmtable::hashfind(int l,unsigned long long key){
+  unsigned long long h=key & hashmask[l];
+  while (hashtb[l][h].key){
+    if (hashtb[l][h].key==key) return &hashtb[l][h];
+    h=(h+1) & hashmask[l];
+  }
+  return NULL;
+}
+
+
+//get() on the hash backend: ng is set as by the descent, i.e. with the
+//largest found prefix of the n-gram. As prefixes of found n-grams are
+//found too, after the n-gram and its history (needed by lprob) prefixes
+//are looked for from the shortest one, which is the first to miss in
+//most failing queries
+
+int lmtable::gethash(ngram& ng,int n,int lev){
+
+  const int* w=ng.wordp(n);
+  lmthashentry* e=NULL;
+  unsigned long long key[LMTMAXLEV+1]; //hash states of the prefixes
+  int l;
+
+  ng.link=NULL;
+  ng.lev=0;
+
+  key[0]=FNVSTART;
+  for (l=1;l<=lev;l++) key[l]=FNVSTEP(key[l-1],w[l-1]);
+
+  l=lev;
+  if ((e=hashfind(l,ngramkey(key[l])))==NULL && l>2){
+    l--;
+    e=hashfind(l,ngramkey(key[l]));
+  }
+  if (e==NULL){ //prefixes shorter than l
+    int top=l;
+    lmthashentry* p;
+    for (l=1;l+1<top && (p=hashfind(l+1,ngramkey(key[l+1])))!=NULL;l++) e=p;
+  }
+
+  //extensions of colliding n-grams are marked too (see build_hash)
+  if (e && e->pos==HASH_COLLIDING) return (this->*getkernel)(ng,n,lev);
+
+  if (e){
+    ng.prob=e->prob;
+    ng.bow=e->bow;
+    ng.link=table[l]+(table_pos_t)e->pos * nodesize(tbltype[l]);
+    ng.succ=e->succ;
+  }
+  else{ //look at the 1-gram
+    LMT_TYPE ndt=tbltype[1];
+    node nd=(w[0] < (float) cursize[1]?table[1]+(table_pos_t)w[0] * nodesize(ndt):NULL);
+    if (!nd || prob(nd,ndt)==NOPROB) return 0;
+    ng.prob=prob(nd,ndt);
+    ng.bow=(maxlev>1?bow(nd,ndt):0);
+    ng.link=nd;
+    table_entry_pos_t offset=(w[0]==0?0:bound(nd-nodesize(ndt),ndt));
+    table_entry_pos_t limit=(cursize[1]==1?cursize[2]:bound(nd,ndt));
+    ng.succ=(maxlev>1?limit-offset:0);
+  }
+  ng.info=tbltype[l];
+  ng.lev=l;
+
+  if (l<lev) return 0;
+
+  ng.size=n; ng.freq=0;
+  return 1;
+}
+
+
+//the key index is built from the tables, hence after any change
+//of the tables it must be deleted and built again
+
+void lmtable::build_keyindex(){
+  assert(!concurrent);
+  for (int l=2;l<=maxlev;l++){
+    if (keyidx[l] || tbltype[l]>=COLUMNAR) continue; //word columns are searched directly
+    int sz=nodesize(tbltype[l]);
+    keyidx[l]=new int[cursize[l]];
+    for (table_entry_pos_t i=0;i<cursize[l];i++)
+      keyidx[l][i]=word(table[l]+(table_pos_t)i * sz,tbltype[l]);
+  }
+}
+
+void lmtable::delete_keyindex(){
+  for (int l=2;l<=LMTMAXLEV;l++){
+    if (!keyidx[l]) continue;
+    if (keyidxMapped[l])
+      Munmap((char *)keyidx[l]-keyidxGaps[l],(table_pos_t)cursize[l] * sizeof(int)+keyidxGaps[l],0);
+    else
+      delete [] keyidx[l];
+    keyidx[l]=NULL; keyidxMapped[l]=false;
+  }
+}
+
+
+//the top-k index is built from the tables: positions within each
+//successor range are sorted by decreasing probability, pruned n-grams
+//last, and by position for equal probabilities
+
+struct lmttoporder{
+  const double* p;
+  bool operator()(table_entry_pos_t a,table_entry_pos_t b) const {
+    return p[a]>p[b] || (p[a]==p[b] && a<b);
+  }
+};
+
+double lmtable::entrylprob(int l,table_entry_pos_t i){
+  LMT_TYPE ndt=tbltype[l];
+  float p=prob(table[l]+(table_pos_t)i * nodesize(ndt),ndt);
+  if (p==NOPROB) return -HUGE_VAL;
+  return (double)(isQtable?Pcenters[l][(qfloat_t)p]:p);
+}
+
+void lmtable::build_topk(){
+  assert(!concurrent);
+  if (isReversed) error("build_topk: successors are not available in reversed-context tables");
+  delete_topk();
+
+  for (int l=1;l<=maxlev;l++){
+    std::vector<double> p(cursize[l]);
+    topord[l]=new table_entry_pos_t[cursize[l]];
+    for (table_entry_pos_t i=0;i<cursize[l];i++){
+      topord[l][i]=i;
+      p[i]=entrylprob(l,i);
+    }
+    lmttoporder cmp; cmp.p=(cursize[l]>0?&p[0]:NULL);
+    if (l==1){
+      std::sort(topord[l],topord[l]+cursize[l],cmp);
+      continue;
+    }
+    LMT_TYPE hdt=tbltype[l-1];
+    int hsz=nodesize(hdt);
+    table_entry_pos_t first=0;
+    for (table_entry_pos_t j=0;j<cursize[l-1];j++){
+      table_entry_pos_t last=bound(table[l-1]+(table_pos_t)j * hsz,hdt);
+      if (last>first) std::sort(topord[l]+first,topord[l]+last,cmp);
+      first=last;
+    }
+  }
+}
+
+void lmtable::delete_topk(){
+  for (int l=1;l<=LMTMAXLEV;l++){
+    if (!topord[l]) continue;
+    if (topordMapped[l])
+      Munmap((char *)topord[l]-topordGaps[l],(table_pos_t)cursize[l] * sizeof(table_entry_pos_t)+topordGaps[l],0);
+    else
+      delete [] topord[l];
+    topord[l]=NULL; topordMapped[l]=false;
+  }
+}
+
+
+//n-grams of a level collected while reversing the tables
+
+struct lmtrevlevel{
+  std::vector<int> words;  //words of each n-gram, from the most recent one
+  std::vector<float> prob,bow;
+  std::vector<char> real,ext;
+  std::vector<table_entry_pos_t> order; //sorted positions
+
+  table_entry_pos_t size() const {return prob.size();}
+  const int* key(table_entry_pos_t i,int l) const {return &words[(size_t)i * l];}
+
+  void push(const int* w,int l,float p,float b,bool r,bool e){
+    words.insert(words.end(),w,w+l);
+    prob.push_back(p); bow.push_back(b);
+    real.push_back(r); ext.push_back(e);
+  }
+};
+
+//orders the n-grams of a level by their reversed words
+
+struct lmtrevless{
+  const lmtrevlevel* rl; int l;
+  lmtrevless(const lmtrevlevel* r,int n){rl=r;l=n;}
+  bool operator()(table_entry_pos_t a,table_entry_pos_t b) const {
+    const int *ka=rl->key(a,l),*kb=rl->key(b,l);
+    return std::lexicographical_compare(ka,ka+l,kb,kb+l);
+  }
+};
+
+//looks for the n words of key among the sorted n-grams of a level
+
+static bool revfind(const lmtrevlevel& rl,int l,const int* key){
+  table_entry_pos_t lo=0,hi=rl.order.size();
+  while (lo<hi){
+    table_entry_pos_t mid=lo+(hi-lo)/2;
+    const int* k=rl.key(rl.order[mid],l);
+    if (std::lexicographical_compare(k,k+l,key,key+l)) lo=mid+1;
+    else hi=mid;
+  }
+  return lo<rl.order.size() && std::equal(key,key+l,rl.key(rl.order[lo],l));
+}
+
+
+//visits the subtree of the entries ipos..epos-1 of level l and collects
+//their n-grams with reversed words; w holds the words of the path
+
+void lmtable::revcollect(lmtrevlevel* rl,int l,int* w,table_entry_pos_t ipos,table_entry_pos_t epos){
+
+  LMT_TYPE ndt=tbltype[l];
+  int ndsz=nodesize(ndt);
+  int rw[LMTMAXLEV+1];
+
+  for (table_entry_pos_t i=ipos;i<epos;i++){
+    node nd=table[l]+(table_pos_t)i * ndsz;
+    float p=prob(nd,ndt);
+    bool ext=false;
+
+    w[l-1]=word(nd,ndt);
+    for (int k=0;k<l;k++) rw[k]=w[l-1-k];
+
+    if (l<maxlev){
+      table_entry_pos_t isucc=(i>0?bound(nd-ndsz,ndt):0),esucc=bound(nd,ndt);
+      ext=(isucc<esucc);
+      //successors of missing entries are not reachable
+      if (ext && p!=NOPROB) revcollect(rl,l+1,w,isucc,esucc);
+    }
+    rl[l].push(rw,l,p,(l<maxlev?bow(nd,ndt):0),(p!=NOPROB),ext);
+  }
+}
+
+
+//reverse rebuilds the tables so that each n-gram is found by descending
+//from its most recent word. Suffixes of n-grams which are not n-grams
+//themselves are added as entries with null probs, so that every entry
+//is reached from the previous level. Level 1 is not changed.
+
+void lmtable::reverse(){
+
+  assert(!concurrent);
+  if (isReversed) return;
+  if (isPruned) error("reverse: pruned LMs cannot be reversed");
+  if (memmap>0) error("reverse: memory mapped LMs cannot be reversed");
+
+  cerr << "reversing tables\n";
+
+  delete_keyindex();
+  delete_hash();
+  delete_topk();
+  reset_caches();
+
+  lmtrevlevel* rl=new lmtrevlevel[maxlev+1];
+  int w[LMTMAXLEV+1];
+  revcollect(rl,1,w,0,cursize[1]);
+
+  for (table_entry_pos_t i=0;i<cursize[1];i++) rl[1].order.push_back(i);
+
+  //add missing suffixes and sort levels from the highest one
+  for (int l=maxlev;l>1;l--){
+
+    if (l-1>1){
+      rl[l-1].order.resize(rl[l-1].size());
+      for (table_entry_pos_t i=0;i<rl[l-1].size();i++) rl[l-1].order[i]=i;
+      std::sort(rl[l-1].order.begin(),rl[l-1].order.end(),lmtrevless(&rl[l-1],l-1));
+    }
+
+    std::set< std::vector<int> > missing;
+    for (table_entry_pos_t i=0;i<rl[l].size();i++){
+      const int* key=rl[l].key(i,l);
+      if (l-1==1){
+        if (key[0]<0 || (table_entry_pos_t)key[0]>=cursize[1])
+          error("reverse: n-gram word is missing from the 1-gram table");
+      }
+      else if (!revfind(rl[l-1],l-1,key))
+        missing.insert(std::vector<int>(key,key+l-1));
+    }
+
+    if (missing.size()>0){
+      cerr << "adding " << missing.size() << " " << l-1 << "-grams as paths\n";
+      for (std::set< std::vector<int> >::iterator it=missing.begin();it!=missing.end();it++)
+        rl[l-1].push(&(*it)[0],l-1,0,0,false,false);
+      table_entry_pos_t n=rl[l-1].order.size();
+      rl[l-1].order.resize(rl[l-1].size());
+      for (table_entry_pos_t i=n;i<rl[l-1].size();i++) rl[l-1].order[i]=i;
+      std::sort(rl[l-1].order.begin(),rl[l-1].order.end(),lmtrevless(&rl[l-1],l-1));
+    }
+  }
+
+  if (maxlev>1){
+    rl[maxlev].order.resize(rl[maxlev].size());
+    for (table_entry_pos_t i=0;i<rl[maxlev].size();i++) rl[maxlev].order[i]=i;
+    std::sort(rl[maxlev].order.begin(),rl[maxlev].order.end(),lmtrevless(&rl[maxlev],maxlev));
+  }
+
+  //build the new tables
+  configure(maxlev,isQtable);
+  isPacked=false;
+  isColumnar=false;
+
+  for (int l=1;l<=maxlev;l++){
+    LMT_TYPE ndt=tbltype[l];
+    int ndsz=nodesize(ndt);
+    table_entry_pos_t n=rl[l].size(),j=0;
+    table_pos_t bytes=((table_pos_t)n+7) / 8;
+
+    char* tb=new char[(table_pos_t)n * ndsz];
+    revreal[l]=new unsigned char[bytes];
+    memset(revreal[l],0,bytes);
+    if (l<maxlev){
+      revext[l]=new unsigned char[bytes];
+      memset(revext[l],0,bytes);
+    }
+
+    for (table_entry_pos_t i=0;i<n;i++){
+      table_entry_pos_t r=rl[l].order[i];
+      node nd=tb+(table_pos_t)i * ndsz;
+      word(nd,rl[l].key(r,l)[l-1]);
+      if (isQtable) prob(nd,ndt,(qfloat_t)rl[l].prob[r]);
+      else prob(nd,ndt,rl[l].prob[r]);
+      if (rl[l].real[r]) revreal[l][i >> 3]|=1 << (i & 7);
+
+      if (l<maxlev){
+        if (isQtable) bow(nd,ndt,(qfloat_t)rl[l].bow[r]);
+        else bow(nd,ndt,rl[l].bow[r]);
+        if (rl[l].ext[r]) revext[l][i >> 3]|=1 << (i & 7);
+
+        //successors share the words of the entry as prefix
+        while (j<rl[l+1].size() &&
+               std::equal(rl[l].key(r,l),rl[l].key(r,l)+l,rl[l+1].key(rl[l+1].order[j],l+1)))
+          j++;
+        bound(nd,ndt,j);
+      }
+    }
+
+    delete [] table[l];
+    table[l]=tb;
+    cursize[l]=maxsize[l]=n;
+  }
+
+  delete [] rl;
+  isReversed=true;
+  setkernels();
+}
+
+
+//descends the reversed tables with the words of ng from the first-th
+//most recent one, for at most n levels; links[l] is the entry reached
+//at level l. Returns the number of levels found.
+
+int lmtable::revdescend(ngram& ng,int first,int n,node* links){
+
+  table_entry_pos_t offset=0,limit=cursize[1];
+
+  for (int l=1;l<=n;l++){
+    LMT_TYPE ndt=tbltype[l];
+    char* found=NULL;
+
+    if (offset<limit)
+      search(l,offset,(limit-offset),nodesize(ndt),ng.wordp(first+l-1),LMT_FIND,&found);
+    if (!found) return l-1;
+
+    links[l]=found;
+    if (l<maxlev){
+      offset=(found==table[l]?0:bound(found-nodesize(ndt),ndt));
+      limit=bound(found,ndt);
+    }
+  }
+  return n;
+}
+
+//as revdescend, but returns the largest level whose entry is an n-gram
+
+int lmtable::revlongest(ngram& ng,int first,int n,node* links){
+  int l=revdescend(ng,first,n,links);
+  while (l>0 && !revflag(revreal,l,links[l])) l--;
+  return l;
+}
+
+//finds the longest n-gram ending with the most recent word of ng (at
+//most s words) and the histories of all n-grams of ng, i.e. hist[k] is
+//the entry of the k-1 words preceding the most recent one, if it is an
+//n-gram (NULL otherwise). Returns the size of the longest n-gram.
+
+int lmtable::revmatch(ngram& ng,int s,node* found,node* hist){
+
+  node links[LMTMAXLEV+1];
+
+  int j=revlongest(ng,1,s,links);
+  *found=(j>0?links[j]:NULL);
+
+  int m=(s>1?revdescend(ng,2,s-1,links):0);
+  for (int k=2;k<=s;k++)
+    hist[k]=(k-1<=m && revflag(revreal,k-1,links[k-1])?links[k-1]:NULL);
+
+  return j;
+}
+
+
+//lprob of reversed tables: same values, bows and back-off levels, but
+//back-off weights are collected by the walk over the history and summed
+//in the same order as the recursion of lprob
+
+double lmtable::revlprob(ngram& ong,double* bow,int* bol){
+
+  int s=(ong.size>maxlev?maxlev:ong.size);
+  node found,hist[LMTMAXLEV+1];
+  double rbow[LMTMAXLEV+1],lpr;
+
+  if (bow) *bow=0;
+  if (bol) *bol=0;
+  if (s==0) return 0.0;
+
+  int j=revmatch(ong,s,&found,hist);
+
+  if (j>0){
+    float iprob=prob(found,tbltype[j]);
+    lpr = (double)(isQtable?Pcenters[j][(qfloat_t)iprob]:iprob);
+    if (*ong.wordp(1)==dict->oovcode()) lpr-=logOOVpenalty;
+  }
+  else{ //means an OOV word
+    lpr = -log(UNIGRAM_RESOLUTION)/M_LN10;
+    j=1;
+  }
+
+  for (int k=s;k>j;k--){
+    rbow[k]=0.0;
+    //avoid wrong quantization of bow of <unk>
+    if (hist[k] && *ong.wordp(2)!=dict->oovcode()){
+      float ibow=lmtable::bow(hist[k],tbltype[k-1]);
+      rbow[k]=(double)(isQtable?Bcenters[k-1][(qfloat_t)ibow]:ibow);
+    }
+    if (bow) (*bow)+=rbow[k];
+  }
+  for (int k=j+1;k<=s;k++) lpr = rbow[k] + lpr;
+
+  if (bol) *bol=s-j;
+  return lpr;
+}
+
+//lprobx of reversed tables (ong has at most maxlev words)
+
+double lmtable::revlprobx(ngram ong,double* lkp,double* bop,int* bol){
+
+  int s=ong.size;
+  node found,hist[LMTMAXLEV+1];
+  double bo=0,lbo,pr;
+  float ipr;
+
+  int j=revmatch(ong,s,&found,hist);
+
+  for (int k=s;k>j && k>1;k--){ // back-off
+    lbo = 0.0;
+    if (hist[k]){
+      ipr = lmtable::bow(hist[k],tbltype[k-1]);
+      lbo = isQtable?Bcenters[k][(qfloat_t)ipr]:ipr; //as lprobx
+    }
+    if(bop) *bop++=lbo;
+    if(bol) ++*bol;
+    bo += lbo;
+  }
+
+  if (j>0){
+    ipr = prob(found,tbltype[j]);
+    pr = isQtable?Pcenters[j][(qfloat_t)ipr]:ipr;
+  }
+  else //OOV not included in dictionary
+    pr = -log(UNIGRAM_RESOLUTION)/M_LN10;
+
+  if(lkp) *lkp=pr;
+  pr += bo;
+  return pr;
+}
+
+//maxsuffptr of reversed tables
+
+const char *lmtable::revmaxsuffptr(ngram& ong,unsigned int* size){
+
+  node links[LMTMAXLEV+1];
+
+  if (ong.size>=maxlev) ong.size=maxlev-1;
+
+  int k=revlongest(ong,1,ong.size,links);
+  if (size!=NULL) *size=(k>0 && !revflag(revext,k,links[k])?k-1:k);
+  return (k>0?links[k]:NULL);
+}
+
+
+//manages the long header of a bin file
+//and allocates table for each n-gram level
+
+void lmtable::loadbinheader(istream& inp,const char* header){
+
+  // read rest of header
+  inp >> maxlev;
+
+  if (!binheader(header,&isQtable,&isPacked,&isColumnar,&isReversed))
+    error("loadbin: LM file is not in binary format");
+  if (isPacked && isColumnar)
+    error("loadbin: levels cannot be both bit-packed and columnar");
+
+  configure(maxlev,isQtable);
+
+  for (int l=1;l<=maxlev;l++){
+    inp >> cursize[l]; maxsize[l]=cursize[l];
+  }
+
+  if (isQtable){
+    char header2[100];
+    inp >> header2;
     for (int i=1;i<=maxlev;i++){
       inp >> NumCenters[i];
       cerr << "reading  " << NumCenters[i] << " centers\n";
     }
   }
+
+  if (isPacked){
+    char header3[100];
+    inp >> header3;
+    for (int l=1;l<=maxlev;l++){
+      nodebits[l]=0;
+      for (int f=0;f<4;f++){
+        inp >> pkbits[l][f];
+        pkoffs[l][f]=nodebits[l];
+        nodebits[l]+=pkbits[l][f];
+      }
+      tbltype[l]=(LMT_TYPE)(PACKED+l);
+    }
+  }
+
+  if (isColumnar){
+    setcollayout();
+    for (int l=1;l<=maxlev;l++) tbltype[l]=(LMT_TYPE)(COLUMNAR+l);
+  }
 }
 
 //load codebook of level l
@@ -1196,9 +2757,10 @@ void lmtable::loadbin(istream& inp, const char* header,const char* filename,int
     }
 
     //check that the LM is uncompressed
-    char miniheader[4];
-    int bytes_read = read(diskid,miniheader,4);
-    if ((bytes_read != 4) || (strncmp(miniheader,"Qblm",4) && strncmp(miniheader,"blmt",4)))
+    char miniheader[9];
+    int bytes_read = read(diskid,miniheader,8);
+    miniheader[8]=0;
+    if ((bytes_read != 8) || !binheader(miniheader))
       error("mmap functionality does not work with compressed binary LMs\n");
 #endif
   }
@@ -1207,8 +2769,8 @@ void lmtable::loadbin(istream& inp, const char* header,const char* filename,int
     if (isQtable) loadbincodebook(inp,l);
     if ((memmap == 0) || (l < memmap)){
       //cerr << "loading " << cursize[l] << " " << l << "-grams\n";
-      table[l]=new char[cursize[l] * nodesize(tbltype[l])];
-      inp.read(table[l],cursize[l] * nodesize(tbltype[l]));
+      table[l]=new char[tablesize(l)];
+      inp.read(table[l],tablesize(l));
     } else {
 
 #ifdef WIN32
@@ -1217,15 +2779,29 @@ void lmtable::loadbin(istream& inp, const char* header,const char* filename,int
       // cerr << "mapping " << cursize[l] << " " << l << "-grams\n";
       tableOffs[l]=inp.tellg();
       table[l]=(char *)MMap(diskid,PROT_READ,
-                            tableOffs[l], cursize[l]*nodesize(tbltype[l]),
+                            tableOffs[l], tablesize(l),
 			    &tableGaps[l]);
       table[l]+=tableGaps[l];
-      inp.seekg(cursize[l]*nodesize(tbltype[l]),ios_base::cur);
+      inp.seekg(tablesize(l),ios_base::cur);
 #endif
 
     }
+    if (isColumnar) setcolumns(l);
   }
 
+  if (isReversed) //flags of reversed-context tables
+    for (int l=1;l<=maxlev;l++){
+      table_pos_t bytes=((table_pos_t)cursize[l]+7) / 8;
+      revreal[l]=new unsigned char[bytes];
+      inp.read((char *)revreal[l],bytes);
+      if (l<maxlev){
+        revext[l]=new unsigned char[bytes];
+        inp.read((char *)revext[l],bytes);
+      }
+    }
+
+  loadsections(inp);
+
   // cerr << "done\n";
 }
 
@@ -1236,10 +2812,21 @@ int lmtable::get(ngram& ng,int n,int lev){
   /***
       cout << "cerco:" << ng << "\n";
   ***/
-  totget[lev]++;
+  countget(lev);
 
   if (lev > maxlev) error("get: lev exceeds maxlevel");
   if (n < lev) error("get: ngram is too small");
+  if (isReversed) error("get: n-grams of reversed-context tables are found by lprob");
+
+  if (lev>1 && hashtb[lev]) return gethash(ng,n,lev);
+
+  return (this->*getkernel)(ng,n,lev);
+}
+
+
+//get for any node type
+
+int lmtable::getgeneric(ngram& ng,int n,int lev){
 
   //set boudaries for 1-gram
   table_entry_pos_t offset=0,limit=cursize[1];
@@ -1254,8 +2841,9 @@ int lmtable::get(ngram& ng,int n,int lev){
 
     //initialize entry information
     hit = 0 ; found = NULL; ndt=tbltype[l];
+    ngramcache* lc=getlmtcache(l);
 
-    if (lmtcache[l] && lmtcache[l]->get(ng.wordp(n),(char *)&found))
+    if (lc && lc->get(ng.wordp(n),(char *)&found))
       hit=1;
     else
       search(l,
@@ -1267,8 +2855,8 @@ int lmtable::get(ngram& ng,int n,int lev){
              &found);
 
     //insert both found and not found items!!!
-    if (lmtcache[l] && hit==0)
-      lmtcache[l]->add(ng.wordp(n),(char *)&found);
+    if (lc && hit==0)
+      lc->add(ng.wordp(n),(char *)&found);
 
     if (!found) return 0;
     if (prob(found,ndt)==NOPROB) return 0; //pruned n-gram
@@ -1307,6 +2895,229 @@ int lmtable::get(ngram& ng,int n,int lev){
 }
 
 
+//orders n-grams by their words, starting from the least recent one
+
+static bool ngramprecedes(const ngram* a,const ngram* b){
+  const int *wa=a->wordp(a->size),*wb=b->wordp(b->size);
+  int m=(a->size<b->size?a->size:b->size);
+  for (int i=0;i<m;i++)
+    if (wa[i]!=wb[i]) return wa[i]<wb[i];
+  return a->size<b->size;
+}
+
+//getbatch looks up each n-gram ng of ngs like get(ng,ng.size,ng.size)
+//does. N-grams are sorted (hence ngs is reordered) so that each one
+//only searches the levels it does not share with the previous one;
+//a search that failed for the previous n-gram is not repeated either.
+
+void lmtable::getbatch(ngram** ngs,int n){
+
+  if (isReversed) error("getbatch: n-grams of reversed-context tables are found by lprob");
+
+  std::sort(ngs,ngs+n,ngramprecedes);
+
+  char* path[LMTMAXLEV+1]; //entries found along the current path
+  table_entry_pos_t offset[LMTMAXLEV+2],limit[LMTMAXLEV+2]; //ranges of each level
+  int depth=0;          //number of levels found along the path
+  bool failed=false;    //path could not be extended beyond depth
+  const int* pw=NULL;   //words of the previous n-gram
+  int psize=0;
+
+  offset[1]=0; limit[1]=cursize[1];
+
+  for (int i=0;i<n;i++){
+
+    ngram* ng=ngs[i];
+    int sz=ng->size;
+    const int* w=ng->wordp(sz); //w[l-1] is searched at level l
+
+    if (sz > maxlev) error("getbatch: lev exceeds maxlevel");
+    countget(sz);
+
+    //length of the prefix shared with the previous n-gram
+    int p=0;
+    while (p<sz && p<psize && w[p]==pw[p]) p++;
+
+    //if the previous n-gram failed within the shared prefix, so does this one
+    if (!(failed && p>depth)){
+
+      if (p<depth) depth=p;
+      failed=false;
+
+      for (int l=depth+1;l<=sz;l++){
+        LMT_TYPE ndt=tbltype[l];
+        char* found=NULL;
+
+        search(l,offset[l],(limit[l]-offset[l]),nodesize(ndt),(int *)&w[l-1],LMT_FIND,&found);
+
+        if (!found || prob(found,ndt)==NOPROB){ failed=true; break; }
+
+        path[l]=found; depth=l;
+
+        if (l<maxlev){ //set start/end point for next search, as in get()
+          if (offset[l]+1==cursize[l]) limit[l+1]=cursize[l+1];
+          else limit[l+1]=bound(found,ndt);
+
+          if (found==table[l]) offset[l+1]=0;
+          else offset[l+1]=bound((found - nodesize(ndt)),ndt);
+        }
+      }
+    }
+
+    //put information inside ng
+    ng->link=(depth>0?path[depth]:NULL);
+    ng->lev=depth;
+    if (depth>0){
+      LMT_TYPE ndt=tbltype[depth];
+      ng->bow=(depth<maxlev?bow(path[depth],ndt):0);
+      ng->prob=prob(path[depth],ndt);
+      ng->info=ndt;
+    }
+    if (depth==sz){
+      ng->freq=0;
+      ng->succ=(sz<maxlev?limit[sz+1]-offset[sz+1]:0);
+    }
+
+    pw=w; psize=sz;
+  }
+}
+
+
+//state of a lookup advanced by getinterleaved(): the next step either
+//reads entry pos of level l (found), probes position pos of the binary
+//search of [low,high) within the range of level l starting at offset
+//(probe), or searches the whole interval (search)
+
+struct lmtlookup{
+  ngram* ng;
+  const int* w; //w[l-1] is searched at level l
+  int l;
+  enum {PROBE,SEARCH,FOUND} step;
+  table_entry_pos_t offset,low,high,pos;
+};
+
+//sets the next step of a lookup within the non empty interval [low,high)
+//of level l and prefetches what it will read
+
+void lmtable::nextstep(lmtlookup& c){
+  const char* first=wordaddr(c.l,c.low);
+  const char* last=wordaddr(c.l,c.high-1);
+
+  if (last-first < LMTINTERLEAVESPAN){
+    for (const char* a=first;a<=last;a+=64) LMTPREFETCH(a); //64-byte cache lines
+    LMTPREFETCH(last+LMTCODESIZE-1);
+    c.step=lmtlookup::SEARCH;
+  }
+  else{
+    c.pos=c.low+(c.high-c.low)/2;
+    LMTPREFETCH(wordaddr(c.l,c.pos));
+    c.step=lmtlookup::PROBE;
+  }
+}
+
+//getinterleaved looks up each n-gram ng of ngs like get(ng,ng.size,ng.size)
+//does. Up to interleave lookups are advanced in turn by one step, i.e.
+//one probe of the binary search, the search of an interval within a few
+//cache lines or the reading of a found entry: what the next step of a
+//lookup reads is prefetched, so that its cache misses are overlapped
+//with the steps of the other lookups.
+
+void lmtable::getinterleaved(ngram** ngs,int n){
+
+  if (isReversed) error("getinterleaved: n-grams of reversed-context tables are found by lprob");
+
+  lmtlookup q[LMTMAXINTERLEAVE];
+  int k=(interleave>0?interleave:1);
+  int next=0,live=0;
+
+  for (int s=0;s<k;s++) q[s].ng=NULL;
+
+  while (next<n || live>0){
+    for (int s=0;s<k;s++){
+      lmtlookup& c=q[s];
+
+      if (c.ng==NULL){ //start a new lookup: 1-grams are a 1-1 map of the vocabulary
+        if (next>=n) continue;
+        ngram* ng=ngs[next++];
+        if (ng->size > maxlev) error("getinterleaved: lev exceeds maxlevel");
+        countget(ng->size);
+        ng->link=NULL;
+        ng->lev=0;
+        if (ng->size==0){ ng->freq=0; ng->succ=cursize[1]; continue; }
+        c.w=ng->wordp(ng->size);
+        if (!(c.w[0] < (float) cursize[1])) continue;
+        c.ng=ng; c.l=1; c.step=lmtlookup::FOUND;
+        c.offset=0; c.pos=c.w[0];
+        prefetchentry(1,c.pos);
+        live++;
+        continue;
+      }
+
+      if (c.step==lmtlookup::PROBE){ //one probe of the binary search
+        int key=wordat(c.l,c.pos);
+        if (c.w[c.l-1]==key){
+          c.step=lmtlookup::FOUND;
+          prefetchentry(c.l,c.pos);
+          continue;
+        }
+        if (c.w[c.l-1]<key) c.high=c.pos;
+        else c.low=c.pos+1;
+        if (c.low<c.high) nextstep(c);
+        else{ countbsearch(c.l); c.ng=NULL; live--; }
+        continue;
+      }
+
+      if (c.step==lmtlookup::SEARCH){ //the interval is in cache
+        LMT_TYPE ndt=tbltype[c.l];
+        char* found=NULL;
+        search(c.l,c.low,(c.high-c.low),nodesize(ndt),(int *)&c.w[c.l-1],LMT_FIND,&found);
+        if (!found){ c.ng=NULL; live--; continue; }
+        c.pos=(found-table[c.l])/nodesize(ndt);
+        c.step=lmtlookup::FOUND;
+        prefetchentry(c.l,c.pos);
+        continue;
+      }
+
+      //put information of the found entry inside ng, as get() does
+      ngram* ng=c.ng;
+      int l=c.l;
+      LMT_TYPE ndt=tbltype[l];
+      node found=table[l]+(table_pos_t)c.pos * nodesize(ndt);
+      float pr=prob(found,ndt);
+
+      if (pr==NOPROB){ c.ng=NULL; live--; continue; } //pruned n-gram
+
+      ng->bow=(l<maxlev?bow(found,ndt):0);
+      ng->prob=pr;
+      ng->link=found;
+      ng->info=ndt;
+      ng->lev=l;
+
+      table_entry_pos_t offset=0,limit=0;
+      if (l<maxlev){ //set start/end point for next search
+        if (c.offset+1==cursize[l]) limit=cursize[l+1];
+        else limit=bound(found,ndt);
+
+        if (c.pos==0) offset=0;
+        else offset=bound((found - nodesize(ndt)),ndt);
+      }
+
+      if (l==ng->size){
+        ng->freq=0;
+        ng->succ=(l<maxlev?limit-offset:0);
+        c.ng=NULL; live--;
+        continue;
+      }
+
+      c.l=++l;
+      c.offset=c.low=offset; c.high=limit;
+      if (c.low<c.high) nextstep(c);
+      else{ countbsearch(l); c.ng=NULL; live--; }
+    }
+  }
+}
+
+
 //recursively prints the language model table
 
 void lmtable::dumplm(fstream& out,ngram ng, int ilev, int elev, table_entry_pos_t ipos,table_entry_pos_t epos){
@@ -1319,7 +3130,7 @@ void lmtable::dumplm(fstream& out,ngram ng, int ilev, int elev, table_entry_pos_
   ng.pushc(0);
 
   for (table_entry_pos_t i=ipos;i<epos;i++){
-    *ng.wordp(1)=word(table[ilev]+i*ndsz);
+    *ng.wordp(1)=word(table[ilev]+i*ndsz,ndt);
     float ipr=prob(table[ilev]+i*ndsz,ndt);
     //int ipr=prob(table[ilev]+i*ndsz,ndt);
 
@@ -1367,6 +3178,7 @@ void lmtable::dumplm(fstream& out,ngram ng, int ilev, int elev, table_entry_pos_
 
 int lmtable::succscan(ngram& h,ngram& ng,LMT_ACTION action,int lev){
   assert(lev==h.lev+1 && h.size==lev && lev<=maxlev);
+  if (isReversed) error("succscan: successors are not available in reversed-context tables");
 
   LMT_TYPE ndt=tbltype[h.lev];
   int ndsz=nodesize(ndt);
@@ -1391,7 +3203,7 @@ int lmtable::succscan(ngram& h,ngram& ng,LMT_ACTION action,int lev){
     if (ng.midx[lev] < h.succ)
       {
         //put current word into ng
-        *ng.wordp(1)=word(h.succlink+ng.midx[lev]*nodesize(tbltype[lev]));
+        *ng.wordp(1)=word(h.succlink+ng.midx[lev]*nodesize(tbltype[lev]),tbltype[lev]);
         ng.midx[lev]++;
         return 1;
       }
@@ -1420,23 +3232,26 @@ const char *lmtable::maxsuffptr(ngram ong, unsigned int* size){
     return (char*) NULL;
   }
 	
+  if (isReversed) return revmaxsuffptr(ong,size);
+
   if (ong.size>=maxlev) ong.size=maxlev-1;
+
+  return gmaxsuffptr(ong,size);
+}
+
+//suffixes are searched from the largest one, shortening ong
+
+const char *lmtable::gmaxsuffptr(ngram& ong, unsigned int* size){
 	
-  if (size!=NULL) *size=ong.size; //will return the largest found ong.size
-	
-  ngram ng=ong;
-	
-  //ngram ng(lmtable::getDict()); //eventually use the <unk> word
-  //ng.trans(ong);
-	
-  if (get(ng,ng.size,ng.size)){
-    if (ng.succ==0) (*size)--;
-    return ng.link;
-  }
-  else{
-    ong.size--;
-    return maxsuffptr(ong,size);
+  for (;ong.size>0;ong.size--){
+    if (size!=NULL) *size=ong.size; //will return the largest found ong.size
+    if (get(ong,ong.size,ong.size)){
+      if (ong.succ==0 && size!=NULL) (*size)--;
+      return ong.link;
+    }
   }
+  if (size!=NULL) *size=0;
+  return (char*) NULL;
 }
 
 
@@ -1451,18 +3266,18 @@ const char *lmtable::cmaxsuffptr(ngram ong, unsigned int* size){
 
   char* found;
   unsigned int isize; //internal state size variable
+  ngramcache* sc=getstatecache();
 
-  if (statecache && (ong.size==maxlev-1) && statecache->get(ong.wordp(maxlev-1),(char *)&found)){
-    if (size!=NULL) statesizecache->get(ong.wordp(maxlev-1),(char *)size);
+  //the two caches replace entries independently
+  if (sc && (ong.size==maxlev-1) && sc->get(ong.wordp(maxlev-1),(char *)&found) &&
+      (size==NULL || getstatesizecache()->get(ong.wordp(maxlev-1),(char *)size)))
     return found;
-  }
   
   found=(char *)maxsuffptr(ong,&isize);
 
-  if (statecache && ong.size==maxlev-1){
-    //if (statecache->isfull()) statecache->reset();
-    statecache->add(ong.wordp(maxlev-1),(char *)&found);
-    statesizecache->add(ong.wordp(maxlev-1),(char *)&isize);
+  if (sc && ong.size==maxlev-1){
+    sc->add(ong.wordp(maxlev-1),(char *)&found);
+    getstatesizecache()->add(ong.wordp(maxlev-1),(char *)&isize);
   };
 
   if (size!=NULL) *size=isize;
@@ -1482,48 +3297,56 @@ double lmtable::lprob(ngram ong,double* bow, int* bol,int internalcall){
   if (ong.size==0) return 0.0;
   if (ong.size>maxlev) ong.size=maxlev;
 
-  if (internalcall==0){ //first call to lprob
+  if (internalcall==0 && lprobkernel) return (this->*lprobkernel)(ong,bow,bol);
+
+  return glprob(ong,bow,bol,internalcall==0);
+}
+
+//back-off weights are summed in the same order as the former recursion
+//of lprob, from the shortest n-gram
+
+double lmtable::glprob(ngram& ng,double* bow,int* bol,bool init){
+
+  if (init){ //first call to lprob
     if (bow) *bow=0;
     if (bol) *bol=0;
   }
 
-  ngram ng=ong;
-  //ngram ng(lmtable::getDict()); //avoid dictionary transfer
-  //ng.trans(ong);
-
-  double rbow,lpr=0;
+  double rbow[LMTMAXLEV+1],lpr;
+  int nbo=0;
   float ibow,iprob;
   //int ibow,iprob;
 
-  if (get(ng,ng.size,ng.size)){
-    iprob=ng.prob;
-    lpr = (double)(isQtable?Pcenters[ng.size][(qfloat_t)iprob]:iprob);
-    //lpr = (double)(isQtable?Pcenters[ng.size][iprob]:*((float *)&iprob));
-    if (*ng.wordp(1)==dict->oovcode()) lpr-=logOOVpenalty;
-    return (double)lpr;
-  }
-  else{
-    if (ng.size==1) //means an OOV word
-      return -log(UNIGRAM_RESOLUTION)/M_LN10;
-    else{ //compute backoff
-      //set backoff state, shift n-gram, set default bow prob
-      rbow=0.0;
-      if (bol) (*bol)++; //increase backoff level
-      if ((ng.lev==(ng.size-1)) && (*ng.wordp(2)!=dict->oovcode())){
-	//found history in table: use its bo weight
-	//avoid wrong quantization of bow of <unk>
-	ibow=ng.bow;
-	rbow= (double) (isQtable?Bcenters[ng.lev][(qfloat_t)ibow]:ibow);
-	//rbow= (double) (isQtable?Bcenters[ng.lev][ibow]:*((float *)&ibow));
-      }
-		
-      if (bow) (*bow)+=rbow;
-		
-      //prepare recursion step
-      ong.size--;
-      return rbow + lmtable::lprob(ong,bow,bol,internalcall=1);
+  for (;;){
+    if (get(ng,ng.size,ng.size)){
+      iprob=ng.prob;
+      lpr = (double)(isQtable?Pcenters[ng.size][(qfloat_t)iprob]:iprob);
+      //lpr = (double)(isQtable?Pcenters[ng.size][iprob]:*((float *)&iprob));
+      if (*ng.wordp(1)==dict->oovcode()) lpr-=logOOVpenalty;
+      break;
+    }
+    if (ng.size==1){ //means an OOV word
+      lpr = -log(UNIGRAM_RESOLUTION)/M_LN10;
+      break;
     }
+
+    //compute backoff: set backoff state, shift n-gram, set default bow prob
+    double rb=0.0;
+    if (bol) (*bol)++; //increase backoff level
+    if ((ng.lev==(ng.size-1)) && (*ng.wordp(2)!=dict->oovcode())){
+      //found history in table: use its bo weight
+      //avoid wrong quantization of bow of <unk>
+      ibow=ng.bow;
+      rb= (double) (isQtable?Bcenters[ng.lev][(qfloat_t)ibow]:ibow);
+      //rbow= (double) (isQtable?Bcenters[ng.lev][ibow]:*((float *)&ibow));
+    }
+    if (bow) (*bow)+=rb;
+    rbow[nbo++]=rb;
+    ng.size--;
   }
+
+  while (nbo>0) lpr = rbow[--nbo] + lpr;
+  return lpr;
 }
 
 //return log10 probsL use cache memory
@@ -1542,16 +3365,18 @@ double lmtable::clprob(ngram ong){
   }
 #endif
 
+  ngramcache* pc=getprobcache();
+
   //cache hit
-  if (probcache && ong.size==maxlev && probcache->get(ong.wordp(maxlev),(char *)&logpr)){
+  if (pc && ong.size==maxlev && pc->get(ong.wordp(maxlev),(char *)&logpr)){
     return logpr;
   }
 
   //cache miss
   logpr=lmtable::lprob(ong);
 
-  if (probcache && ong.size==maxlev){
-    probcache->add(ong.wordp(maxlev),(char *)&logpr);
+  if (pc && ong.size==maxlev){
+    pc->add(ong.wordp(maxlev),(char *)&logpr);
   };
 
   return logpr;
@@ -1559,9 +3384,687 @@ double lmtable::clprob(ngram ong){
 };
 
 
+//queries of n-gram views: the words are copied once into the n-gram
+//which is searched at all back-off steps, and not at all for cache hits
+
+double lmtable::lprob(const ngramview& v,double* bow,int* bol){
+
+  if (v.size==0) return 0.0;
+
+  ngram ng(dict,v.suffix(maxlev));
+  if (lprobkernel) return (this->*lprobkernel)(ng,bow,bol);
+  return glprob(ng,bow,bol,true);
+}
+
+double lmtable::clprob(const ngramview& v){
+
+  if (v.size==0) return 0.0;
+
+  ngramview u=v.suffix(maxlev);
+  double logpr;
+  ngramcache* pc=getprobcache();
+
+  //cache hit
+  if (pc && u.size==maxlev && pc->get(u.wordp(),(char *)&logpr))
+    return logpr;
+
+  //cache miss
+  logpr=lmtable::lprob(u);
+
+  if (pc && u.size==maxlev)
+    pc->add(u.wordp(),(char *)&logpr);
+
+  return logpr;
+}
+
+const char *lmtable::maxsuffptr(const ngramview& v,unsigned int* size){
+
+  if (v.size==0){
+    if (size!=NULL) *size=0;
+    return (char*) NULL;
+  }
+
+  ngram ng(dict,v.suffix(maxlev-1));
+  if (isReversed) return revmaxsuffptr(ng,size);
+  return gmaxsuffptr(ng,size);
+}
+
+const char *lmtable::cmaxsuffptr(const ngramview& v,unsigned int* size){
+
+  if (size!=NULL) *size=v.size; //will return the largest found size
+  if (v.size==0) return (char*) NULL;
+
+  ngramview u=v.suffix(maxlev-1);
+  char* found;
+  unsigned int isize;
+  ngramcache* sc=getstatecache();
+
+  //the two caches replace entries independently
+  if (sc && u.size==maxlev-1 && sc->get(u.wordp(),(char *)&found) &&
+      (size==NULL || getstatesizecache()->get(u.wordp(),(char *)size)))
+    return found;
+
+  found=(char *)lmtable::maxsuffptr(u,&isize);
+
+  if (sc && u.size==maxlev-1){
+    sc->add(u.wordp(),(char *)&found);
+    getstatesizecache()->add(u.wordp(),(char *)&isize);
+  }
+
+  if (size!=NULL) *size=isize;
+  return found;
+}
+
+
+//distribution: out holds the distribution minus off, the sum of the
+//back-off weights of the histories found so far, so that each order only
+//costs the scan of the successors of its history
+
+template<class T> void lmtable::filldist(ngram h,T* out){
+
+  int V=dict->size();
+
+  if (isReversed){ //no successor ranges: every word is scored by lprob
+    ngram ng=h;
+    ng.pushc(0);
+    for (int w=0;w<V;w++){
+      *ng.wordp(1)=w;
+      out[w]=(T)lmtable::lprob(ng);
+    }
+    return;
+  }
+
+  int n=(h.size+1<maxlev?h.size+1:maxlev); //order of the scored n-grams
+  double off=0.0;
+
+  T unk=-log(UNIGRAM_RESOLUTION)/M_LN10;
+  for (int w=0;w<V;w++) out[w]=unk;
+
+  for (int l=1;l<=n;l++){
+
+    table_entry_pos_t first=0,last=cursize[1];
+
+    if (l>1){ //successors of the history of l-1 words
+      ngram hg=h;
+      hg.size=l-1;
+      if (!getgeneric(hg,l-1,l-1)) continue; //back-off weight is 0
+      LMT_TYPE hdt=tbltype[l-1];
+      if (*hg.wordp(1)!=dict->oovcode())
+        off+=(double)(isQtable?Bcenters[l-1][(qfloat_t)hg.bow]:hg.bow);
+      first=(hg.link>table[l-1]?bound(hg.link-nodesize(hdt),hdt):0);
+      last=bound(hg.link,hdt);
+    }
+
+    LMT_TYPE ndt=tbltype[l];
+    int ndsz=nodesize(ndt);
+    for (table_entry_pos_t i=first;i<last;i++){
+      node nd=table[l]+(table_pos_t)i * ndsz;
+      int w=word(nd,ndt);
+      float pr=prob(nd,ndt);
+      if (w<V && pr!=NOPROB)
+        out[w]=(T)((double)(isQtable?Pcenters[l][(qfloat_t)pr]:pr)-off);
+    }
+  }
+
+  for (int w=0;w<V;w++) out[w]=(T)((double)out[w]+off);
+
+  //the OOV penalty only applies if <unk> is found
+  int oov=dict->oovcode();
+  if (oov>=0 && oov<V){
+    ngram ng=h;
+    ng.pushc(oov);
+    out[oov]=(T)lmtable::lprob(ng);
+  }
+}
+
+void lmtable::distribution(ngram h,float* out){
+  filldist(h,out);
+}
+
+void lmtable::distribution(ngram h,double* out){
+  filldist(h,out);
+}
+
+double lmtable::distmass(ngram h,double* out){
+  double* buf=(out?out:new double[dict->size()]);
+  filldist(h,buf);
+  double tot=0.0;
+  for (int w=0;w<dict->size();w++) tot+=pow(10.0,(double)buf[w]);
+  if (!out) delete [] buf;
+  return tot;
+}
+
+
+//topk: the successors of the history of l-1 words form a stream of
+//words, by decreasing probability, scored with their probability plus
+//the back-off weights of the histories from l to n-1 words. Streams are
+//merged by taking their best head at each step; a word is taken from the
+//stream of the highest order of which it is a successor, and skipped in
+//the others. <unk> is scored by lprob, because of the OOV penalty.
+
+int lmtable::topk(ngram h,int k,int* words,double* logpr){
+
+  if (isReversed) error("topk: successors are not available in reversed-context tables");
+  if (k<=0) return 0;
+
+  int n=(h.size+1<maxlev?h.size+1:maxlev); //order of the scored n-grams
+  table_entry_pos_t first[LMTMAXLEV+1],last[LMTMAXLEV+1];
+  table_entry_pos_t cur[LMTMAXLEV+1],cnt[LMTMAXLEV+1]; //next and number of successors
+  std::vector<table_entry_pos_t> sorted[LMTMAXLEV+1]; //without index
+  const table_entry_pos_t* ord[LMTMAXLEV+1];
+  double off[LMTMAXLEV+2];
+  int oov=dict->oovcode();
+
+  off[n]=0.0;
+  for (int l=n;l>=1;l--){
+    first[l]=last[l]=0;
+    if (l==1) last[l]=cursize[1];
+    else{
+      ngram hg=h;
+      hg.size=l-1;
+      if (getgeneric(hg,l-1,l-1)){
+        LMT_TYPE hdt=tbltype[l-1];
+        first[l]=(hg.link>table[l-1]?bound(hg.link-nodesize(hdt),hdt):0);
+        last[l]=bound(hg.link,hdt);
+        off[l-1]=off[l]+(*hg.wordp(1)!=oov?(double)(isQtable?Bcenters[l-1][(qfloat_t)hg.bow]:hg.bow):0.0);
+      }
+      else off[l-1]=off[l];
+    }
+    cur[l]=0;
+    cnt[l]=last[l]-first[l];
+    ord[l]=NULL;
+    if (topord[l]) ord[l]=topord[l]+first[l];
+    else if (cnt[l]>0){ //sort the successors at once
+      std::vector<double> p(cnt[l]);
+      for (table_entry_pos_t i=0;i<cnt[l];i++){
+        sorted[l].push_back(i);
+        p[i]=entrylprob(l,first[l]+i);
+      }
+      lmttoporder cmp; cmp.p=&p[0];
+      std::sort(sorted[l].begin(),sorted[l].end(),cmp);
+      for (table_entry_pos_t i=0;i<cnt[l];i++) sorted[l][i]+=first[l];
+      ord[l]=&sorted[l][0];
+    }
+  }
+
+  double oovlpr=-HUGE_VAL;
+  if (oov>=0){
+    ngram ng=h;
+    ng.pushc(oov);
+    oovlpr=lmtable::lprob(ng);
+  }
+
+  int found=0;
+  while (found<k){
+    int best=0; double bestlpr=-HUGE_VAL; int w=-1;
+    for (int l=1;l<=n;l++){
+      while (cur[l]<cnt[l] && word(table[l]+(table_pos_t)ord[l][cur[l]] * nodesize(tbltype[l]),tbltype[l])==oov) cur[l]++;
+      if (cur[l]<cnt[l]){
+        double lpr=entrylprob(l,ord[l][cur[l]]);
+        if (lpr==-HUGE_VAL) cur[l]=cnt[l]; //only pruned n-grams are left
+        else if (lpr+off[l]>bestlpr){ best=l; bestlpr=lpr+off[l]; }
+      }
+    }
+
+    if (oovlpr>-HUGE_VAL && oovlpr>=bestlpr){
+      words[found]=oov; logpr[found++]=oovlpr;
+      oovlpr=-HUGE_VAL;
+      continue;
+    }
+    if (best==0) break;
+
+    w=word(table[best]+(table_pos_t)ord[best][cur[best]] * nodesize(tbltype[best]),tbltype[best]);
+    cur[best]++;
+
+    bool higher=false; //successor of a longer history
+    for (int l=best+1;l<=n && !higher;l++){
+      char* nd=NULL;
+      if (last[l]>first[l])
+        search(l,first[l],last[l]-first[l],nodesize(tbltype[l]),&w,LMT_FIND,&nd);
+      higher=(nd && prob(nd,tbltype[l])!=NOPROB);
+    }
+    if (!higher && w<dict->size()){ words[found]=w; logpr[found++]=bestlpr; }
+  }
+  return found;
+}
+
+
+//longestmatch walks a sentence keeping the state of the history (see
+//lmtstate): the n-gram ending at ids[i] is first looked for among the
+//successors of the state entry, and only if it is missing the shorter
+//suffixes of the state are found, as in lprob(st,w). As the state grows
+//by at most one word per position, the back-off steps over the sentence
+//are at most n, so that a sentence costs about n successor searches
+//instead of up to maxlev descents per word. Reversed tables find the
+//longest n-gram ending at each word with a single descent.
+
+void lmtable::longestmatch(const int* ids,int n,int* order,const char** nodes,lmtstate* st){
+
+  ngram hist(dict); //history, for the descents of the back-off steps
+  int lev=0; char* link=NULL; //state entry
+  if (st){
+    for (int i=0;i<st->lev;i++) hist.pushc(st->word[i]);
+    lev=st->lev; link=(char*)st->link;
+  }
+
+  for (int i=0;i<n;i++){
+    int w=ids[i];
+    char* found=NULL;
+    int c=lev;
+
+    if (isReversed){
+      node links[LMTMAXLEV+1];
+      hist.pushc(w);
+      c=revlongest(hist,1,(hist.size<maxlev?hist.size:maxlev),links);
+      order[i]=c;
+      if (nodes) nodes[i]=(c>0?links[c]:NULL);
+      continue;
+    }
+
+    while (true){
+      LMT_TYPE ndt=tbltype[c+1];
+      if (c==0)
+        search(1,0,cursize[1],nodesize(ndt),&w,LMT_FIND,&found);
+      else{
+        LMT_TYPE pndt=tbltype[c];
+        table_entry_pos_t offset=(link==table[c]?0:bound(link-nodesize(pndt),pndt));
+        table_entry_pos_t limit=bound(link,pndt);
+        if (offset<limit)
+          search(c+1,offset,(limit-offset),nodesize(ndt),&w,LMT_FIND,&found);
+      }
+      if (found && prob(found,ndt)==NOPROB) found=NULL; //pruned n-gram
+      if (found || c==0) break;
+
+      //back-off: largest shorter suffix of the history in the table
+      for (c--;c>0 && !get(hist,c,c);c--);
+      link=(c>0?hist.link:NULL);
+    }
+
+    order[i]=(found?c+1:0);
+    if (nodes) nodes[i]=found;
+    hist.pushc(w);
+
+    //new state
+    if (found && c+1<maxlev){ lev=c+1; link=found; }
+    else if (found){
+      for (lev=maxlev-1;lev>0 && !get(hist,lev,lev);lev--);
+      link=(lev>0?hist.link:NULL);
+    }
+    else{ lev=0; link=NULL; }
+  }
+
+  if (st){
+    int size=(st->size+n<maxlev?st->size+n:maxlev-1);
+    if (isReversed) lmtable::getstate(hist,*st);
+    else{
+      st->lev=lev; st->link=link;
+      for (int i=0;i<lev;i++) st->word[i]=*hist.wordp(lev-i);
+    }
+    st->size=size;
+  }
+}
+
+
+//score_sentence carries the state of the history from word to word, so
+//that each word is scored by lprob(st,w), i.e. mostly by a search among
+//the successors of the state entry (through the state-keyed prob cache
+//if initialized), with the same values of lprob, including the OOV
+//penalty of <unk>. Reversed tables score each n-gram with a single
+//descent, hence they keep the history as an n-gram instead. The history
+//restarts from <s> only if this is in the dictionary of the LM.
+
+double lmtable::score_sentence(const int* ids,int n,float* per_word,int* bol){
+
+  int bos=boscode;
+  lmtstate st,next;
+  ngram ng(dict);
+  double logpr=0.0;
+
+  for (int i=0;i<n;i++){
+    int bo=0;
+    double lpr=0.0;
+
+    if (isReversed){
+      ng.pushc(ids[i]);
+      if (ng.size>maxlev) ng.size=maxlev;
+      if (ids[i]==bos) ng.size=1;
+      else lpr=lmtable::lprob(ng,NULL,&bo);
+    }
+    else if (ids[i]==bos){ //history restarts from <s>, which is not scored
+      st=lmtstate();
+      lmtable::lprob(st,bos,&next);
+      st=next;
+    }
+    else{
+      lpr=lmtable::clprob(st,ids[i],&next,NULL,&bo);
+      st=next;
+    }
+    logpr+=lpr;
+
+    if (per_word) per_word[i]=(float)lpr;
+    if (bol) bol[i]=bo;
+  }
+  return logpr;
+}
+
+
+//getstate computes the state of history h: as maxsuffptr, it looks for
+//the largest suffix of h found in the table.
+
+void lmtable::getstate(ngram h,lmtstate& st){
+
+  if (h.size>=maxlev) h.size=maxlev-1;
+  st.size=h.size;
+
+  if (isReversed){
+    node links[LMTMAXLEV+1];
+    h.size=revlongest(h,1,h.size,links);
+    h.link=(h.size>0?links[h.size]:NULL);
+  }
+  else
+    while (h.size>0 && !get(h,h.size,h.size)) h.size--;
+
+  st.lev=h.size;
+  st.link=(h.size>0?h.link:NULL);
+  for (int i=0;i<h.size;i++) st.word[i]=*h.wordp(h.size-i);
+}
+
+
+//returns log10prob of w after state st, i.e. the same value of lprob
+//for any n-gram whose history has state st. As histories larger than
+//the state are not found in the table, their back-off weights are null:
+//hence w is first looked for among the successors of the state entry.
+//Only if it is missing, the remaining back-off steps are computed by
+//lprob. The new state is also derived from the state entry whenever the
+//extended history does not exceed maxlev-1 words.
+
+double lmtable::lprob(const lmtstate& st,int w,lmtstate* outst,double* bow,int* bol){
+
+  int lev=st.lev;
+  int size=(st.size+1<maxlev?st.size+1:maxlev); //size of the scored n-gram
+  char* found=NULL;
+  LMT_TYPE ndt=tbltype[lev+1];
+  double lpr;
+
+  //state words followed by w
+  int wd[LMTMAXLEV+1];
+  memcpy(wd,st.word,lev*sizeof(int));
+  wd[lev]=w;
+
+  if (isReversed){ //state entries have no successors: score the state words and w
+    ngram ng(dict,ngramview(wd,lev+1));
+    lpr=revlprob(ng,bow,bol);
+    if (bol) *bol+=size-(lev+1);
+    if (outst){
+      lmtable::getstate(ng,*outst);
+      outst->size=(st.size+1<maxlev?st.size+1:maxlev-1);
+    }
+    return lpr;
+  }
+
+  //look for w among the successors of the state entry
+  if (lev==0)
+    search(1,0,cursize[1],nodesize(ndt),&w,LMT_FIND,&found);
+  else{
+    LMT_TYPE pndt=tbltype[lev];
+    table_entry_pos_t offset=((char*)st.link==table[lev]?0:bound((char*)st.link-nodesize(pndt),pndt));
+    table_entry_pos_t limit=bound((char*)st.link,pndt);
+    if (offset<limit)
+      search(lev+1,offset,(limit-offset),nodesize(ndt),&w,LMT_FIND,&found);
+  }
+  if (found && prob(found,ndt)==NOPROB) found=NULL; //pruned n-gram
+  int order=(found?lev+1:0); //size of the n-gram found
+
+  if (bow) *bow=0;
+  if (bol) *bol=size-(lev+1); //back-off steps over histories not in the table
+
+  if (found){
+    float iprob=prob(found,ndt);
+    lpr = (double)(isQtable?Pcenters[lev+1][(qfloat_t)iprob]:iprob);
+    if (w==dict->oovcode()) lpr-=logOOVpenalty;
+  }
+  else if (lev==0) //means an OOV word
+    lpr = -log(UNIGRAM_RESOLUTION)/M_LN10;
+  else{ //back-off from the state entry
+    double rbow=0.0;
+    if (st.word[lev-1]!=dict->oovcode()){
+      float ibow=lmtable::bow((char*)st.link,tbltype[lev]);
+      rbow=(double)(isQtable?Bcenters[lev][(qfloat_t)ibow]:ibow);
+    }
+    if (bow) (*bow)+=rbow;
+    if (bol) (*bol)++;
+
+    ngram ong(dict,ngramview(wd+1,lev)); //without the least recent word of the state
+    double ibow=0.0; int ibol=0;
+    if (lprobkernel){ //the kernel leaves ong on the n-gram found
+      lpr = rbow + (this->*lprobkernel)(ong,&ibow,&ibol);
+      if (ibol<lev) found=ong.link;
+    }
+    else
+      lpr = rbow + lmtable::lprob(ong,&ibow,&ibol);
+    if (bow) (*bow)+=ibow;
+    if (bol) (*bol)+=ibol;
+    order=lev-ibol;
+  }
+
+  if (outst){
+    //new state: largest suffix of the state words followed by w, which
+    //is not larger than the n-gram found
+    outst->size=(st.size+1<maxlev?st.size+1:maxlev-1);
+    if (found && order<maxlev){
+      outst->lev=order;
+      outst->link=found;
+      memcpy(outst->word,wd+lev+1-order,order*sizeof(int));
+    }
+    else{
+      int sz=(order<maxlev?order:maxlev-1);
+      ngram ng(dict,ngramview(wd+lev+1-sz,sz));
+      while (ng.size>0 && !get(ng,ng.size,ng.size)) ng.size--;
+      outst->lev=ng.size;
+      outst->link=(ng.size>0?ng.link:NULL);
+      for (int i=0;i<ng.size;i++) outst->word[i]=*ng.wordp(ng.size-i);
+    }
+  }
+
+  return lpr;
+}
+
+
+//clprob of a state: lprob(st,w) only depends on the state entry and w,
+//except for the back-off steps over histories larger than the state,
+//hence results are cached in the slot of (st.link,w), which is replaced
+//by a newer pair in case of conflict. The words of the new state are the
+//most recent ones of the state words and w.
+
+double lmtable::clprob(const lmtstate& st,int w,lmtstate* outst,double* bow,int* bol){
+
+  lmtstprob* sc=getstprobcache();
+  if (sc==NULL) return lmtable::lprob(st,w,outst,bow,bol);
+
+  unsigned long long h=(unsigned long long)(size_t)st.link * 0x9e3779b97f4a7c15ULL ^
+                       (unsigned long long)(unsigned int)w * 0xc2b2ae3d27d4eb4fULL;
+  lmtstprob* s=sc+(h >> (64-stprobbits));
+  int skip=(st.size+1<maxlev?st.size+1:maxlev)-(st.lev+1); //back-off steps over histories
+
+  if (s->w==w && s->link==st.link)
+    countstprob(true);
+  else{
+    countstprob(false);
+    lmtstate o;
+    double b; int bo;
+    s->lpr=lmtable::lprob(st,w,&o,&b,&bo);
+    s->link=st.link; s->w=w;
+    s->bow=b; s->bol=bo-skip;
+    s->outlev=o.lev; s->outlink=o.link;
+  }
+
+  if (bow) *bow=s->bow;
+  if (bol) *bol=s->bol+skip;
+  if (outst){
+    outst->size=(st.size+1<maxlev?st.size+1:maxlev-1);
+    outst->lev=s->outlev;
+    outst->link=s->outlink;
+    for (int i=0;i<s->outlev-1;i++) outst->word[i]=st.word[st.lev-s->outlev+1+i];
+    if (s->outlev>0) outst->word[s->outlev-1]=w;
+  }
+  return s->lpr;
+}
+
+
+//lprob_batch computes the same values of lprob for n n-grams. At each
+//round, all n-grams not found yet are looked up with getbatch() (or
+//getinterleaved()) and then backed-off. States are computed in the same way.
+
+void lmtable::lprob_batch(ngram* ngs,int n,double* logpr,int* bol,
+                          const char** state,unsigned int* statesize,
+                          double* bow){
+
+  if (isReversed){ //a single descent per n-gram already
+    for (int i=0;i<n;i++){
+      if (bol) bol[i]=0;
+      if (bow) bow[i]=0.0;
+      logpr[i]=lmtable::lprob(ngs[i],(bow?&bow[i]:NULL),(bol?&bol[i]:NULL));
+      if (state){
+        unsigned int sz=0;
+        state[i]=lmtable::maxsuffptr(ngs[i],&sz);
+        if (statesize) statesize[i]=sz;
+      }
+    }
+    return;
+  }
+
+  std::vector<ngram> ng(ngs,ngs+n);
+  std::vector<ngram*> active;
+  std::vector<double> rbow(n * maxlev); //back-off weights of each n-gram
+  std::vector<int> nbo(n,0);
+
+  for (int i=0;i<n;i++){
+    if (ng[i].size>maxlev) ng[i].size=maxlev;
+    if (ng[i].size>0) active.push_back(&ng[i]);
+    else logpr[i]=0.0;
+  }
+
+  while (active.size()>0){
+
+    if (interleave>0) getinterleaved(&active[0],active.size());
+    else getbatch(&active[0],active.size());
+
+    size_t next=0;
+    for (size_t a=0;a<active.size();a++){
+      ngram* g=active[a];
+      int i=g-&ng[0];
+      double lpr;
+
+      if (g->lev==g->size){
+        lpr=(double)(isQtable?Pcenters[g->size][(qfloat_t)g->prob]:g->prob);
+        if (*g->wordp(1)==dict->oovcode()) lpr-=logOOVpenalty;
+      }
+      else if (g->size==1) //means an OOV word
+        lpr=-log(UNIGRAM_RESOLUTION)/M_LN10;
+      else{ //back-off: use bo weight of the history if found
+        double rb=0.0;
+        if ((g->lev==(g->size-1)) && (*g->wordp(2)!=dict->oovcode()))
+          rb=(double)(isQtable?Bcenters[g->lev][(qfloat_t)g->bow]:g->bow);
+        rbow[i * maxlev + nbo[i]++]=rb;
+        g->size--;
+        active[next++]=g;
+        continue;
+      }
+
+      //sum back-off weights in the same order of lprob
+      for (int k=nbo[i]-1;k>=0;k--) lpr=rbow[i * maxlev + k] + lpr;
+      logpr[i]=lpr;
+    }
+    active.resize(next);
+  }
+
+  if (bol) for (int i=0;i<n;i++) bol[i]=nbo[i];
+  if (bow) for (int i=0;i<n;i++){ //as summed by lprob
+    bow[i]=0.0;
+    for (int k=0;k<nbo[i];k++) bow[i]+=rbow[i * maxlev + k];
+  }
+
+  if (state==NULL) return;
+
+  //states: largest suffix of each n-gram with successors (see maxsuffptr)
+  for (int i=0;i<n;i++){
+    ng[i]=ngs[i];
+    if (ng[i].size>=maxlev) ng[i].size=maxlev-1;
+    state[i]=NULL;
+    if (statesize) statesize[i]=0;
+    if (ng[i].size>0) active.push_back(&ng[i]);
+  }
+
+  while (active.size()>0){
+
+    if (interleave>0) getinterleaved(&active[0],active.size());
+    else getbatch(&active[0],active.size());
+
+    size_t next=0;
+    for (size_t a=0;a<active.size();a++){
+      ngram* g=active[a];
+      int i=g-&ng[0];
+      if (g->lev==g->size){
+        state[i]=g->link;
+        if (statesize) statesize[i]=(g->succ==0?g->size-1:g->size);
+      }
+      else if (--g->size>0)
+        active[next++]=g;
+    }
+    active.resize(next);
+  }
+}
+
+
+//clprob_batch: as clprob, n-grams of size maxlev are kept in cache
+
+void lmtable::clprob_batch(ngram* ngs,int n,double* logpr){
+
+  ngramcache* pc=getprobcache();
+  std::vector<ngram> miss;
+  std::vector<int> missidx;
+
+  for (int i=0;i<n;i++){
+    if (ngs[i].size==0){ logpr[i]=0.0; continue; }
+    if (pc && ngs[i].size>=maxlev && pc->get(ngs[i].wordp(maxlev),(char *)&logpr[i]))
+      continue;
+    miss.push_back(ngs[i]);
+    missidx.push_back(i);
+  }
+
+  if (miss.size()==0) return;
+
+  std::vector<double> misslogpr(miss.size());
+  lmtable::lprob_batch(&miss[0],miss.size(),&misslogpr[0]);
+
+  for (size_t m=0;m<miss.size();m++){
+    logpr[missidx[m]]=misslogpr[m];
+    //the same n-gram might occur more than once in the batch
+    if (pc && miss[m].size>=maxlev && !pc->get(miss[m].wordp(maxlev)))
+      pc->add(miss[m].wordp(maxlev),(char *)&misslogpr[m]);
+  }
+}
+
+
+
+void lmtable::stat_caches(std::ostream& out){
+  float mega=1024 * 1024;
+
+  out << "adaptive caches: budget " << cachebudget/mega << "Mb\n";
+  ngramcache* pc=getprobcache();
+  ngramcache* sc=getstatecache();
+  if (pc) out << "prob cache: entries " << pc->maxsize() << " used mem " << pc->memsize()/mega << "Mb\n";
+  if (sc) out << "state cache: entries " << sc->maxsize() << " used mem "
+              << (sc->memsize()+getstatesizecache()->memsize())/mega << "Mb\n";
+  for (int i=2;i<=max_cache_lev;i++){
+    ngramcache* lc=getlmtcache(i);
+    if (lc) out << "lev " << i << " cache: entries " << lc->maxsize() << " used mem " << lc->memsize()/mega << "Mb\n";
+    else out << "lev " << i << " cache: dropped\n";
+  }
+}
 
 void lmtable::stat(int level){
-  table_pos_t totmem=0,memory;
+  table_pos_t totmem=0,memory,totentries=0;
   float mega=1024 * 1024;
 
   cout.precision(2);
@@ -1570,19 +4073,71 @@ void lmtable::stat(int level){
 
   cout << "levels " << maxlev << "\n";
   for (int l=1;l<=maxlev;l++){
-    memory=cursize[l] * nodesize(tbltype[l]);
+    memory=tablesize(l);
     cout << "lev " << l
 	 << " entries "<< cursize[l]
 	 << " used mem " << memory/mega << "Mb\n";
     totmem+=memory;
+    if (keyidx[l]){
+      memory=(table_pos_t)cursize[l] * sizeof(int);
+      cout << "lev " << l << " key index used mem " << memory/mega << "Mb\n";
+      totmem+=memory;
+    }
+    if (topord[l]){
+      memory=(table_pos_t)cursize[l] * sizeof(table_entry_pos_t);
+      cout << "lev " << l << " top-k index used mem " << memory/mega << "Mb\n";
+      totmem+=memory;
+    }
+    if (l>1 && hashtb[l]){
+      memory=(hashmask[l]+1) * sizeof(lmthashentry);
+      cout << "lev " << l << " hash table used mem " << memory/mega << "Mb\n";
+      totmem+=memory;
+    }
+    if (revreal[l]){
+      memory=((table_pos_t)cursize[l]+7) / 8 * (l<maxlev?2:1);
+      cout << "lev " << l << " reversed flags used mem " << memory/mega << "Mb\n";
+      totmem+=memory;
+    }
+    totentries+=cursize[l];
   }
 
   cout << "total allocated mem " << totmem/mega << "Mb\n";
+  if (totentries) cout << "bytes per n-gram " << (float)totmem/totentries << "\n";
+
+  if (stprobcache){
+    int hit=stprobhit,miss=stprobmiss;
+#ifndef WIN32
+    if (concurrent) pthread_mutex_lock(&localmutex);
+#endif
+    for (size_t i=0;i<locals.size();i++){
+      hit+=locals[i]->stprobhit;
+      miss+=locals[i]->stprobmiss;
+    }
+#ifndef WIN32
+    if (concurrent) pthread_mutex_unlock(&localmutex);
+#endif
+    cout << "state-keyed prob cache: slots " << (1 << stprobbits)
+         << " used mem " << (1 << stprobbits) * sizeof(lmtstprob)/mega << "Mb"
+         << " hits " << hit << " misses " << miss << "\n";
+  }
+
+  if (cachebudget) stat_caches(cout);
 
   cout << "total number of get and binary search calls\n";
+#ifndef WIN32
+  if (concurrent) pthread_mutex_lock(&localmutex);
+#endif
   for (int l=1;l<=maxlev;l++){
-    cout << "level " << l << " get: " << totget[l] << " bsearch: " << totbsearch[l] << "\n";
+    int get=totget[l],bsearch=totbsearch[l];
+    for (size_t i=0;i<locals.size();i++){
+      get+=locals[i]->totget[l];
+      bsearch+=locals[i]->totbsearch[l];
+    }
+    cout << "level " << l << " get: " << get << " bsearch: " << bsearch << "\n";
   }
+#ifndef WIN32
+  if (concurrent) pthread_mutex_unlock(&localmutex);
+#endif
 
   if (level >1 ) lmtable::getDict()->stat();
 
@@ -1593,12 +4148,34 @@ void lmtable::reset_mmap(){
   if (memmap>0 and memmap<=maxlev)
     for (int l=memmap;l<=maxlev;l++){
       //std::cerr << "resetting mmap at level:" << l << "\n";
-      Munmap(table[l]-tableGaps[l],cursize[l]*nodesize(tbltype[l])+tableGaps[l],0);
+      Munmap(table[l]-tableGaps[l],tablesize(l)+tableGaps[l],0);
       table[l]=(char *)MMap(diskid,PROT_READ,
-                            tableOffs[l], cursize[l]*nodesize(tbltype[l]),
+                            tableOffs[l], tablesize(l),
                             &tableGaps[l]);
       table[l]+=tableGaps[l];
+      if (isColumnar) setcolumns(l);
+      if (keyidxMapped[l]){
+        Munmap((char *)keyidx[l]-keyidxGaps[l],(table_pos_t)cursize[l] * sizeof(int)+keyidxGaps[l],0);
+        keyidx[l]=(int *)MMap(diskid,PROT_READ,keyidxOffs[l],(table_pos_t)cursize[l] * sizeof(int),&keyidxGaps[l]);
+        keyidx[l]=(int *)((char *)keyidx[l]+keyidxGaps[l]);
+      }
+      if (topordMapped[l]){
+        table_pos_t bytes=(table_pos_t)cursize[l] * sizeof(table_entry_pos_t);
+        Munmap((char *)topord[l]-topordGaps[l],bytes+topordGaps[l],0);
+        topord[l]=(table_entry_pos_t *)MMap(diskid,PROT_READ,topordOffs[l],bytes,&topordGaps[l]);
+        topord[l]=(table_entry_pos_t *)((char *)topord[l]+topordGaps[l]);
+      }
     }
+
+  //state entries have moved: the state-keyed prob caches of all threads
+  //are emptied
+  if (memmap>0 && memmap<=maxlev && stprobcache){
+    clearstprobcache(stprobcache,stprobbits);
+    if (concurrent) pthread_mutex_lock(&localmutex);
+    for (size_t i=0;i<locals.size();i++)
+      if (locals[i]->stprobcache) clearstprobcache(locals[i]->stprobcache,stprobbits);
+    if (concurrent) pthread_mutex_unlock(&localmutex);
+  }
 #endif
 }
 
@@ -1624,6 +4201,7 @@ double lmtable::lprobx(ngram	ong,
     return 0;	// lprob ritorna 0, prima lprobx usava LOGZERO
   }
   if(ong.size>maxlev) ong.size=maxlev;
+  if(isReversed) return revlprobx(ong,lkp,bop,bol);
   ctx = ng = ong;
   bo=0;
   ctx.shift();
@@ -1665,6 +4243,10 @@ table_entry_pos_t lmtable::wdprune(float	*thr,
   int	l;
   ngram	ng(lmtable::getDict(),0);
 	
+  if (isPacked) error("wdprune: bit-packed LMs cannot be pruned");
+  if (isColumnar) error("wdprune: columnar LMs cannot be pruned");
+  if (isReversed) error("wdprune: reversed-context LMs cannot be pruned");
+
   isPruned=true;  //the table now might contain pruned n-grams
 	
   ng.size=0;
@@ -1694,7 +4276,7 @@ table_entry_pos_t lmtable::wdprune(float *thr, int aflag, ngram ng, int ilev, in
 
     //scan table at next level ilev from position ipos
     ndp = table[ilev]+(table_pos_t)i*ndsz;
-    *ng.wordp(1) = word(ndp);
+    *ng.wordp(1) = word(ndp,ndt);
 
     //get probability
     ipr = prob(ndp, ndt);
@@ -1804,7 +4386,7 @@ table_entry_pos_t lmtable::ngcnt(table_entry_pos_t *cnt, ngram	ng, int	l, table_
   ng.pushc(0);
   for(i=ipos; i<epos; i++) {
     ndp = table[l]+i*ndsz;
-    *ng.wordp(1)=word(ndp);
+    *ng.wordp(1)=word(ndp,ndt);
     ipr=prob(ndp, ndt);
     if(ipr==NOPROB) continue;
     ++cnt[l];
@@ -27,11 +27,13 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
 #ifndef WIN32
 #include <sys/types.h>
 #include <sys/mman.h>
+#include <pthread.h>
 #endif
 
 #include <math.h>
 #include <cstdlib>
 #include <limits>
+#include <vector>
 
 #include "util.h"
 #include "ngramcache.h"
@@ -40,11 +42,31 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
 
 #define MAX(a,b) (((a)>(b))?(a):(b))
 
+//hint to load the cache line of address a (no-op if not available)
+#ifdef __GNUC__
+#define LMTPREFETCH(a) __builtin_prefetch(a)
+#else
+#define LMTPREFETCH(a)
+#endif
+
 //#undef TRACE_CACHE
 
 #define LMTMAXLEV  20
+#define LMTMAXINTERLEAVE 64 //max lookups advanced in turn by getinterleaved
+
+//ranges of words spanning less bytes than LMTINTERLEAVESPAN are prefetched
+//and searched at once by getinterleaved
+#ifndef LMTINTERLEAVESPAN
+#define LMTINTERLEAVESPAN 256
+#endif
 #define MAX_LINE  1024
 
+//adaptive caches: table lookups between two adaptations, min entries of
+//a cache, default min hit rate of a level cache worth keeping
+#define LMTADAPTPERIOD 1000000
+#define LMTADAPTMIN    4096
+#define LMTCACHEMINHIT 0.2
+
 #ifndef  LMTCODESIZE
 #define  LMTCODESIZE  (int)3
 #endif
@@ -61,7 +83,9 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
 
 #define UNIGRAM_RESOLUTION 10000000.0
 
-typedef enum {INTERNAL,QINTERNAL,LEAF,QLEAF} LMT_TYPE;
+//nodes of a bit-packed level l have type PACKED+l (see isPacked),
+//nodes of a columnar level l have type COLUMNAR+l (see isColumnar)
+typedef enum {INTERNAL,QINTERNAL,LEAF,QLEAF,PACKED=32,COLUMNAR=64} LMT_TYPE;
 typedef enum {BINARY,TEXT,NONE} OUTFILE_TYPE;
 typedef char* node;
 
@@ -75,12 +99,151 @@ typedef unsigned int  table_entry_pos_t; //type for pointing to a full ngram in
 typedef unsigned long table_pos_t; // type for pointing to a single char in the table
 typedef unsigned char qfloat_t; //type for quantized probabilities
 
+//special value for pruned iprobs
+const float NOPROB = -2.0;
+
 const table_entry_pos_t BOUND_EMPTY1 = (std::numeric_limits<table_entry_pos_t>::max() - 2);
 const table_entry_pos_t BOUND_EMPTY2 = (std::numeric_limits<table_entry_pos_t>::max() - 1);
 
 //#define BOUND_EMPTY BOUND_EMPTY2
 
+class lmtable;
+
+//state of a query: the largest suffix of the history (with at most
+//maxlev-1 words) which is found in the table, and its table entry.
+//Two histories with the same state give the same probability to any
+//word, hence states can be used for hypothesis recombination.
+
+class lmtstate{
+ public:
+  int  word[LMTMAXLEV];  //words of the suffix, from the least recent one
+  int  lev;              //size of the suffix
+  int  size;             //size of the history (up to maxlev-1)
+  const char* link;      //table entry of the suffix (NULL if lev==0)
+
+  lmtstate(){lev=size=0;link=NULL;}
+
+  //hash code only depends on the words, hence it is the same across runs
+  inline unsigned int hash() const {
+    unsigned int h=lev;
+    for (int i=0;i<lev;i++) h=h * 1048583 + word[i];
+    return h;
+  }
+
+  inline bool operator==(const lmtstate& st) const {
+    return lev==st.lev && link==st.link;
+  }
+  inline bool operator!=(const lmtstate& st) const {
+    return !(*this == st);
+  }
+};
+
+//entry of the hash backend: prob and bow of an n-gram, its position
+//in the table of its level and its number of successors
+
+struct lmthashentry{
+  unsigned long long key;  //hash code of the n-gram (0 for empty slots)
+  float prob;
+  float bow;
+  table_entry_pos_t pos;   //HASH_COLLIDING if the hash code is not unique
+  table_entry_pos_t succ;
+};
+
+//n-grams whose hash code collides with another one are searched in the tables
+const table_entry_pos_t HASH_COLLIDING = std::numeric_limits<table_entry_pos_t>::max();
+
+//slot of the state-keyed prob cache (see clprob): a word scored after a
+//state entry, with what lprob computes from them only; a slot fills a
+//64-byte cache line
+
+struct lmtstprob{
+  const char* link;     //state entry (NULL for the empty state)
+  int  w;               //scored word (-1 for empty slots)
+  int  outlev;          //size of the new state
+  const char* outlink;  //entry of the new state
+  double lpr,bow;
+  int  bol;             //back-off steps from the state entry
+  char pad[20];
+};
+
+//nodes of byte-aligned levels: codes of CS bytes, then probs and bows
+//as floats or codebook indexes (Q), bounds only in internal levels.
+//Layouts are fixed at compile time, hence fields are read by fixed-width
+//loads and node sizes are constants (see the query kernels of lmtable).
+
+template<int CS,bool Q,bool LEAF> struct lmtnode{
+  enum {QUANTIZED=Q,
+        PSIZE=(Q?QPROBSIZE:PROBSIZE),
+        SIZE=CS+(LEAF?PSIZE:2*PSIZE+BOUNDSIZE)};
+
+  static inline int word(const char* nd){
+    int v=(unsigned char)nd[0];
+    for (int i=1;i<CS;i++) v|=((unsigned char)nd[i]) << (8 * i);
+    return v;
+  }
+  static inline float prob(const char* nd){
+    if (Q) return (float)(unsigned char)nd[CS];
+    float v; memcpy(&v,nd+CS,sizeof(float));
+    return v;
+  }
+  static inline float bow(const char* nd){
+    if (Q) return (float)(unsigned char)nd[CS+PSIZE];
+    float v; memcpy(&v,nd+CS+PSIZE,sizeof(float));
+    return v;
+  }
+  static inline table_entry_pos_t bound(const char* nd){
+    table_entry_pos_t v; memcpy(&v,nd+CS+2*PSIZE,sizeof(v));
+    return v;
+  }
+};
+
+typedef lmtnode<LMTCODESIZE,false,false> lmtinode;  //INTERNAL
+typedef lmtnode<LMTCODESIZE,true,false>  lmtqinode; //QINTERNAL
+typedef lmtnode<LMTCODESIZE,false,true>  lmtlnode;  //LEAF
+typedef lmtnode<LMTCODESIZE,true,true>   lmtqlnode; //QLEAF
+
+//binary search of key among the n nodes of type N starting at tb: as
+//mybsearch, idx is the position of key or of the first greater code
+
+template<class N> inline int nodebsearch(const char* tb,table_entry_pos_t n,int key,table_entry_pos_t* idx){
+  table_entry_pos_t low=0,high=n;
+  while (low < high){
+    table_entry_pos_t mid=(low + high) / 2;
+    int w=N::word(tb + (table_pos_t)mid * N::SIZE);
+    if (key < w) high=mid;
+    else if (key > w) low=mid + 1;
+    else { *idx=mid; return 1; }
+  }
+  *idx=low;
+  return 0;
+}
+
+//n-grams of a level collected while reversing the tables
+struct lmtrevlevel;
+
+//state of a lookup advanced by getinterleaved
+struct lmtlookup;
+
+//caches and statistics owned by a single thread in concurrent mode
+
+struct lmtlocal{
+  lmtable*    owner;
+  ngramcache* lmtcache[LMTMAXLEV+1];
+  ngramcache* probcache;
+  ngramcache* statecache;
+  ngramcache* statesizecache;
+  int         totget[LMTMAXLEV+1];
+  int         totbsearch[LMTMAXLEV+1];
+  lmtstprob*  stprobcache;
+  lmtstprob*  stprobbuf;
+  int         stprobhit,stprobmiss;
+  int         adapttick;
+};
+
 class lmtable{
+
+  friend class lmmixture; //merges the tables of several LMs
+  friend class lmview;    //restricts a table to a vocabulary
   
  protected:
   char*       table[LMTMAXLEV+1];  //storage of all levels
@@ -104,12 +267,29 @@ class lmtable{
 
   //Table might contain pruned n-grams
   bool      isPruned; 
+
+  //bit-packed levels: each entry takes pkbits[l][0..3] bits for word,
+  //prob, bow and bound, starting at pkoffs[l][f] bits from its begin;
+  //entries are addressed as table[l]+position and cannot be changed
+  bool      isPacked;
+  int       pkbits[LMTMAXLEV+1][4];
+  int       pkoffs[LMTMAXLEV+1][4];
+  int       nodebits[LMTMAXLEV+1];
+
+  //columnar levels: word codes (as int), probs, bows and bounds of each
+  //level are stored in separate arrays, starting at coloffs[l][f] bytes
+  //from the begin of the level (coloffs[l][4] is its size); entries are
+  //addressed as table[l]+position and cannot be changed
+  bool      isColumnar;
+  table_pos_t coloffs[LMTMAXLEV+1][5];
+  char*     colfield[LMTMAXLEV+1][4];
    
   int       NumCenters[LMTMAXLEV+1];
   float*    Pcenters[LMTMAXLEV+1];
   float*    Bcenters[LMTMAXLEV+1];
   
   double  logOOVpenalty; //penalty for OOV words (default 0)
+  int     boscode; //code of <s>, looked up at load time (-1 if missing)
   int     dictionary_upperbound; //set by user
   int     backoff_state; 
   
@@ -120,15 +300,208 @@ class lmtable{
   ngramcache* statesizecache;
   int max_cache_lev;
 
+  //state-keyed prob cache: 2^stprobbits slots, each one taking the
+  //(state entry, word) pairs of its hash code; stprobbuf is allocated
+  lmtstprob* stprobcache;
+  lmtstprob* stprobbuf;
+  int        stprobbits;
+  int        stprobhit,stprobmiss;
+
+  //adaptive caches: their sizes are tuned within cachebudget bytes (per
+  //thread) every adaptperiod table lookups (see adapt_caches)
+  size_t cachebudget;
+  int    adaptperiod;
+  double cacheminhit;
+  int    adapttick;
+  void   adapt_caches();
+
   //memory map on disk
   int memmap;  //level from which n-grams are accessed via mmap
   int diskid;
   off_t tableOffs[LMTMAXLEV+1];
   off_t tableGaps[LMTMAXLEV+1];
 
+  //sorted key index: word codes of each level (but the first) stored
+  //contiguously, so that successor ranges are searched without touching
+  //table nodes; it is saved as an optional section of binary LMs
+  int*  keyidx[LMTMAXLEV+1];
+  bool  keyidxMapped[LMTMAXLEV+1];
+  off_t keyidxOffs[LMTMAXLEV+1];
+  off_t keyidxGaps[LMTMAXLEV+1];
+
+  //top-k index: positions of the n-grams of each level sorted by
+  //decreasing probability within each successor range (the 1-grams as a
+  //whole), so that topk() reads the best successors of a history first;
+  //it is saved as an optional section of binary LMs
+  table_entry_pos_t* topord[LMTMAXLEV+1];
+  bool  topordMapped[LMTMAXLEV+1];
+  off_t topordOffs[LMTMAXLEV+1];
+  off_t topordGaps[LMTMAXLEV+1];
+
+  //hash backend: each level but the first is also stored in an open
+  //addressing hash table keyed by the 64-bit hash code of the n-grams,
+  //so that get() finds an n-gram with a single probe instead of a
+  //descent; tables are still used to scan successors
+  lmthashentry* hashtb[LMTMAXLEV+1];
+  unsigned long long hashmask[LMTMAXLEV+1];
+
+  int hashlevel(int l,int* w,table_entry_pos_t ipos,table_entry_pos_t epos,bool colliding=false);
+  lmthashentry* hashfind(int l,unsigned long long key);
+  int gethash(ngram& ng,int n,int lev);
+
+  //reversed-context tables: n-grams are stored starting from their most
+  //recent word, hence one descent finds the longest n-gram ending with a
+  //word and another one the back-off weights of all suffixes of its
+  //history; revreal[l] marks the entries which are actual n-grams (the
+  //others are only paths to them), revext[l] the n-grams which have
+  //successors in the original order (see maxsuffptr)
+  bool isReversed;
+  unsigned char* revreal[LMTMAXLEV+1];
+  unsigned char* revext[LMTMAXLEV+1];
+
+  void revcollect(lmtrevlevel* rl,int l,int* w,table_entry_pos_t ipos,table_entry_pos_t epos);
+  int revdescend(ngram& ng,int first,int n,node* links);
+  int revlongest(ngram& ng,int first,int n,node* links);
+  int revmatch(ngram& ng,int s,node* found,node* hist);
+  double revlprob(ngram& ong,double* bow,int* bol);
+  double revlprobx(ngram ong,double* lkp,double* bop,int* bol);
+  const char* revmaxsuffptr(ngram& ong,unsigned int* size);
+
+  inline bool revflag(unsigned char** flags,int l,node nd){
+    table_pos_t i=(nd-table[l]) / nodesize(tbltype[l]);
+    return (flags[l][i >> 3] >> (i & 7)) & 1;
+  }
+
+  //query kernels: get and lprob compiled for the node types of the
+  //tables (see lmtnode) or for columnar levels, selected by setkernels()
+  //whenever tables change; bit-packed levels and hash tables use the
+  //generic versions; lprob kernels and the generic lprob and maxsuffptr
+  //work on the n-gram passed by reference, which is shortened at each
+  //back-off step instead of being copied
+  int (lmtable::*getkernel)(ngram& ng,int n,int lev);
+  double (lmtable::*lprobkernel)(ngram& ong,double* bow,int* bol);
+  double glprob(ngram& ong,double* bow,int* bol,bool init);
+  const char* gmaxsuffptr(ngram& ong,unsigned int* size);
+
+  void setkernels();
+  int getgeneric(ngram& ng,int n,int lev);
+  template<class N> char* tsearch(int l,table_entry_pos_t offs,table_entry_pos_t n,int key);
+  template<class I,class L> int tget(ngram& ng,int n,int lev);
+  template<bool Q> int cget(ngram& ng,int n,int lev);
+  template<bool Q,int (lmtable::*G)(ngram&,int,int)> double tlprob(ngram& ong,double* bow,int* bol);
+  template<class T> void filldist(ngram h,T* out);
+
+  //interleaved lookups (see getinterleaved): number of lookups advanced
+  //in turn (0 means that batches are looked up by getbatch)
+  int interleave;
+
+  void nextstep(lmtlookup& c);
+
+  //address of the word of entry p of level l, as read by the searches
+  inline const char* wordaddr(int l,table_entry_pos_t p){
+    if (keyidx[l]) return (const char*)(keyidx[l]+p);
+    LMT_TYPE ndt=tbltype[l];
+    if (ndt>=COLUMNAR) return colfield[l][0]+(table_pos_t)p * sizeof(int);
+    if (ndt>=PACKED) return table[l]+(((table_pos_t)p * nodebits[l]+pkoffs[l][0]) >> 3);
+    return table[l]+(table_pos_t)p * nodesize(ndt);
+  }
+
+  //log10 prob of entry p of level l (-HUGE_VAL if pruned)
+  double entrylprob(int l,table_entry_pos_t p);
+
+  inline int wordat(int l,table_entry_pos_t p){
+    if (keyidx[l]) return keyidx[l][p];
+    LMT_TYPE ndt=tbltype[l];
+    return word(table[l]+(table_pos_t)p * nodesize(ndt),ndt);
+  }
+
+  //prefetches what get() reads of entry p of level l once found: its
+  //prob and bow, and the bounds of p-1 and p
+  inline void prefetchentry(int l,table_entry_pos_t p){
+    LMT_TYPE ndt=tbltype[l];
+    if (ndt>=COLUMNAR){
+      int psz=(isQtable?QPROBSIZE:PROBSIZE);
+      LMTPREFETCH(colfield[l][1]+(table_pos_t)p * psz);
+      if (l<maxlev){
+        LMTPREFETCH(colfield[l][2]+(table_pos_t)p * psz);
+        LMTPREFETCH(colfield[l][3]+(table_pos_t)(p>0?p-1:p) * BOUNDSIZE);
+      }
+    }
+    else if (ndt>=PACKED){
+      LMTPREFETCH(table[l]+(((table_pos_t)p * nodebits[l]) >> 3));
+      if (p>0) LMTPREFETCH(table[l]+(((table_pos_t)(p-1) * nodebits[l]) >> 3));
+    }
+    else{
+      LMTPREFETCH(table[l]+(table_pos_t)p * nodesize(ndt));
+      if (p>0) LMTPREFETCH(table[l]+(table_pos_t)(p-1) * nodesize(ndt));
+    }
+  }
+
   // is this LM queried for knowing the matching order or (standard
   // case) for score?
   bool      orderQuery;
+
+  //concurrent mode: many threads query the same tables, each one
+  //with its own caches and statistics (see lmtlocal)
+  bool      concurrent;
+#ifndef WIN32
+  pthread_key_t   localkey;
+  pthread_mutex_t localmutex;
+#endif
+  std::vector<lmtlocal*> locals; //thread data still alive
+
+  //counts warnings about missing back-off n-grams while loading
+  int       no_more_msg;
+
+  lmtlocal* newlocal();
+  static void releaselocal(void* loc);
+  void deletelocal(lmtlocal* loc);
+
+  inline lmtlocal* getlocal(){
+#ifndef WIN32
+    lmtlocal* loc=(lmtlocal*) pthread_getspecific(localkey);
+    return (loc?loc:newlocal());
+#else
+    return NULL;
+#endif
+  }
+
+  //caches to be used by the calling thread
+  inline ngramcache* getlmtcache(int l){
+    return concurrent?getlocal()->lmtcache[l]:lmtcache[l];
+  }
+  inline ngramcache* getprobcache(){
+    return concurrent?getlocal()->probcache:probcache;
+  }
+  inline ngramcache* getstatecache(){
+    return concurrent?getlocal()->statecache:statecache;
+  }
+  inline lmtstprob* getstprobcache(){
+    return concurrent?getlocal()->stprobcache:stprobcache;
+  }
+  inline void countstprob(bool hit){
+    lmtlocal* loc=(concurrent?getlocal():NULL);
+    if (hit){ if (loc) loc->stprobhit++; else stprobhit++; }
+    else { if (loc) loc->stprobmiss++; else stprobmiss++; }
+  }
+  inline ngramcache* getstatesizecache(){
+    return concurrent?getlocal()->statesizecache:statesizecache;
+  }
+
+  //statistics are kept per thread to avoid write sharing
+  inline void countget(int lev){
+    int* tick=&adapttick;
+    if (concurrent){
+      lmtlocal* loc=getlocal();
+      loc->totget[lev]++;
+      tick=&loc->adapttick;
+    }
+    else totget[lev]++;
+    if (cachebudget && ++*tick>=adaptperiod){ *tick=0; adapt_caches(); }
+  }
+  inline void countbsearch(int lev){
+    if (concurrent) getlocal()->totbsearch[lev]++; else totbsearch[lev]++;
+  }
   
 public:
     
@@ -142,6 +515,17 @@ public:
   lmtable();
   
   virtual ~lmtable(){
+    if (concurrent) setConcurrent(false);
+
+    delete_keyindex();
+    delete_hash();
+    delete_topk();
+
+    for (int l=1;l<=LMTMAXLEV;l++){
+      if (revreal[l]) delete [] revreal[l];
+      if (revext[l]) delete [] revext[l];
+    }
+
     for (int i=2;i<=LMTMAXLEV;i++)
     if (lmtcache[i]){
       //std::cerr << i <<"-gram cache: "; lmtcache[i]->stat();
@@ -162,12 +546,13 @@ public:
       delete statecache;
 	  delete statesizecache;
     }
+    if (stprobbuf) delete [] stprobbuf;
 
 
     for (int l=1;l<=maxlev;l++){
       if (table[l]){
           if (memmap > 0 && l >= memmap)
-            Munmap(table[l]-tableGaps[l],cursize[l]*nodesize(tbltype[l])+tableGaps[l],0);
+            Munmap(table[l]-tableGaps[l],tablesize(l)+tableGaps[l],0);
         else
           delete [] table[l];
       }
@@ -200,9 +585,13 @@ public:
   void init_probcache();
   void init_statecache();
   void init_lmtcaches(int uptolev);
+  void init_stprobcache(int bits=16);
+  void init_adaptive_caches(size_t budget,int period=LMTADAPTPERIOD,double minhit=LMTCACHEMINHIT);
   
   void check_cache_levels();
   void reset_caches();
+  void save_caches(const char* filename,int maxentries=0);
+  void load_caches(const char* filename);
  
   void reset_mmap();
        
@@ -229,7 +618,7 @@ public:
   
   
   void savetxt(const char *filename);
-  void savebin(const char *filename);
+  void savebin(const char *filename,bool packed=false,bool columnar=false);
   //void dumplm(std::fstream& out,ngram ng, int ilev, int elev, table_pos_t ipos,table_pos_t epos);
   void dumplm(std::fstream& out,ngram ng, int ilev, int elev, table_entry_pos_t ipos,table_entry_pos_t epos);
   
@@ -240,7 +629,36 @@ public:
   void loadbin(std::istream& inp,const char* header,const char* filename=NULL,int mmap=0);
   
   void loadbinheader(std::istream& inp, const char* header);
+  table_pos_t tablesize(int l);
+  void setpacklayout();
+  void setcollayout();
+  void setcolumns(int l);
+  int colwidth(int l,int f);
+  void writelevel(std::fstream& out,int l,bool packed,bool columnar=false);
+  void writecolumns(std::fstream& out,int l);
   void loadbincodebook(std::istream& inp,int l);
+
+  //optional sections following the tables of a binary LM
+  void savesections(std::fstream& out);
+  void loadsections(std::istream& inp);
+
+  void build_keyindex();
+  void delete_keyindex();
+  bool is_keyindex_active(){return keyidx[maxlev]!=NULL;}
+
+  void build_hash();
+  void delete_hash();
+  bool is_hash_active(){return maxlev>1 && hashtb[maxlev]!=NULL;}
+
+  void build_topk();
+  void delete_topk();
+  bool is_topk_active(){return topord[1]!=NULL;}
+
+  //converts the tables into reversed-context tables
+  void reverse();
+  bool isReversedTable() const {return isReversed;}
+  bool isPackedTable() const {return isPacked;}
+  bool isColumnarTable() const {return isColumnar;}
   
   lmtable* cpsublm(dictionary* subdict,bool keepunigr=true);
   
@@ -255,6 +673,62 @@ public:
   virtual double lprob(ngram ng, double* bow=NULL,int* bol=NULL,int internalcall=0);
   //virtual double lprob(ngram ng);
   virtual double clprob(ngram ng); 
+
+  //the same for n-gram views: words are copied once for the search, and
+  //not at all for cache hits
+  virtual double lprob(const ngramview& v,double* bow=NULL,int* bol=NULL);
+  virtual double clprob(const ngramview& v);
+  virtual const char *maxsuffptr(const ngramview& v,unsigned int* size=NULL);
+  virtual const char *cmaxsuffptr(const ngramview& v,unsigned int* size=NULL);
+
+  //stateful lprob: log10 prob of word w after state st, optionally
+  //returning the state of the extended history; the search of w starts
+  //from the successors of the state entry
+  virtual double lprob(const lmtstate& st,int w,lmtstate* outst=NULL,double* bow=NULL,int* bol=NULL);
+  //the same, through the state-keyed prob cache (if initialized)
+  virtual double clprob(const lmtstate& st,int w,lmtstate* outst=NULL,double* bow=NULL,int* bol=NULL);
+  //state of history h
+  virtual void getstate(ngram h,lmtstate& st);
+
+  //distribution of the word following history h: out[w] is set to the
+  //lprob of (h w) for all the dictionary words w, by filling the back-off
+  //distribution from lower orders and then the explicit successors of
+  //each history (reversed tables, which have no successor ranges, call
+  //lprob for each word); distmass returns the total probability of the
+  //distribution, which should be 1, summed from its values in double
+  //precision (out is allocated if NULL)
+  void distribution(ngram h,float* out);
+  void distribution(ngram h,double* out);
+  double distmass(ngram h,double* out=NULL);
+
+  //the k most probable words following history h, by decreasing lprob
+  //of (h w), merging the successors of the histories of all orders; it
+  //returns the number of words found (at most k). Successors are read in
+  //order from the top-k index if present, or sorted otherwise.
+  int topk(ngram h,int k,int* words,double* logpr);
+
+  //longest match of a sentence: order[i] is the size of the largest
+  //n-gram ending with ids[i] which has a probability in the table (the
+  //n-gram used by lprob, 0 for words not in the table) and nodes[i] its
+  //table entry. The sentence is walked once, each position starting from
+  //the context matched at the previous one. If given, st is the state of
+  //the history preceding the sentence, and is set to the state after it.
+  void longestmatch(const int* ids,int n,int* order,const char** nodes=NULL,lmtstate* st=NULL);
+
+  //log10 prob of a sentence of n words, optionally with the lprob and
+  //the back-off level of each word: the history starts empty and is
+  //reset at each <s>, which is not scored (as in compile-lm --eval),
+  //hence sentences are usually given with their <s> and </s>
+  virtual double score_sentence(const int* ids,int n,float* per_word=NULL,int* bol=NULL);
+
+  //batch versions of lprob/clprob: n-grams sharing the same history
+  //are grouped so that their common prefix is searched only once, or
+  //looked up in turn if interleaving is set; bol, state (see maxsuffptr)
+  //and bow are optional outputs
+  virtual void lprob_batch(ngram* ngs,int n,double* logpr,int* bol=NULL,
+                           const char** state=NULL,unsigned int* statesize=NULL,
+                           double* bow=NULL);
+  virtual void clprob_batch(ngram* ngs,int n,double* logpr);
   
   
   //void *search(int lev,table_pos_t offs,table_pos_t n,int sz,int *w, LMT_ACTION action,char **found=(char **)NULL);
@@ -263,6 +737,9 @@ public:
 //  int mybsearch(char *ar, table_pos_t n, int size, unsigned char *key, table_pos_t *idx);   
   //int mybsearch(char *ar, table_pos_t n, int size, char *key, table_pos_t *idx);   
   int mybsearch(char *ar, table_entry_pos_t n, int size, char *key, table_entry_pos_t *idx);   
+  int keysearch(const int *keys, table_entry_pos_t n, int key, table_entry_pos_t *idx);
+  int keyscan(const int *keys, table_entry_pos_t n, int key, table_entry_pos_t *idx);
+  int packedsearch(int lev, table_entry_pos_t offs, table_entry_pos_t n, int key, table_entry_pos_t *idx);
  
 
 //int add(ngram& ng,int prob,int bow);
@@ -272,6 +749,12 @@ template<typename TA, typename TB> int add(ngram& ng, TA prob,TB bow);
 
   int get(ngram& ng){return get(ng,ng.size,ng.size);}
   int get(ngram& ng,int n,int lev);
+  void getbatch(ngram** ngs,int n);
+  void getinterleaved(ngram** ngs,int n);
+
+  //k lookups advanced in turn by lprob_batch (0 disables interleaving)
+  void setInterleave(int k){ interleave=(k<LMTMAXINTERLEAVE?(k>0?k:0):LMTMAXINTERLEAVE); }
+  int getInterleave(){ return interleave; }
   
   int succscan(ngram& h,ngram& ng,LMT_ACTION action,int lev);
   
@@ -319,7 +802,46 @@ template<typename T>
   };
 
   
+  //reads width bits (up to 32) at bit position pos of tb
+  inline unsigned int getbits(const char* tb,table_pos_t pos,int width){
+    const unsigned char* p=(const unsigned char*)tb+(pos >> 3);
+    unsigned long long v=0;
+    for (int i=(((pos & 7)+width+7) >> 3)-1;i>=0;i--) v=(v << 8) | p[i];
+    return (unsigned int)((v >> (pos & 7)) & ((1ULL << width)-1));
+  };
+
+  inline void putbits(char* tb,table_pos_t pos,int width,unsigned int value){
+    unsigned char* p=(unsigned char*)tb+(pos >> 3);
+    unsigned long long v=0,mask=((1ULL << width)-1) << (pos & 7);
+    int n=((pos & 7)+width+7) >> 3;
+    for (int i=n-1;i>=0;i--) v=(v << 8) | p[i];
+    v=(v & ~mask) | (((unsigned long long)value << (pos & 7)) & mask);
+    for (int i=0;i<n;i++){ p[i]=v & 0xff; v>>=8; }
+  };
+
+  //field f (0 word, 1 prob, 2 bow, 3 bound) of a packed node
+  inline unsigned int getfield(node nd,LMT_TYPE ndt,int f){
+    int l=ndt-PACKED;
+    return getbits(table[l],(table_pos_t)(nd-table[l]) * nodebits[l] + pkoffs[l][f],pkbits[l][f]);
+  };
+
+  //packed fields of probs and bows are codes or raw floats
+  inline float getpackedfloat(node nd,LMT_TYPE ndt,int f){
+    unsigned int v=getfield(nd,ndt,f);
+    if (isQtable) return (float) v;
+    float fv; memcpy(&fv,&v,sizeof(float));
+    return fv;
+  };
+
+  //field f (1 prob, 2 bow) of a columnar node
+  inline float getcolumnfloat(node nd,LMT_TYPE ndt,int f){
+    int l=ndt-COLUMNAR;
+    if (isQtable) return (float)((qfloat_t*)colfield[l][f])[nd-table[l]];
+    return ((float*)colfield[l][f])[nd-table[l]];
+  };
+
   int nodesize(LMT_TYPE ndt){
+    if (ndt>=PACKED) return 1; //positions are used as addresses
     switch (ndt){
       case INTERNAL:
         return LMTCODESIZE + PROBSIZE + PROBSIZE + BOUNDSIZE;
@@ -346,10 +868,19 @@ template<typename T>
     
     return value;
   };
+
+  inline int word(node nd,LMT_TYPE ndt)
+  {
+    if (ndt>=COLUMNAR) return ((int*)colfield[ndt-COLUMNAR][0])[nd-table[ndt-COLUMNAR]];
+    if (ndt>=PACKED) return getfield(nd,ndt,0);
+    return word(nd);
+  };
   
   inline float prob(node nd,LMT_TYPE ndt)
   {
     int offs=LMTCODESIZE;
+    if (ndt>=COLUMNAR) return getcolumnfloat(nd,ndt,1);
+    if (ndt>=PACKED) return getpackedfloat(nd,ndt,1);
 
     float fv;
     unsigned char cv;
@@ -406,6 +937,8 @@ template<typename T>
  inline float bow(node nd,LMT_TYPE ndt)
   {
     int offs=LMTCODESIZE+(ndt==QINTERNAL?QPROBSIZE:PROBSIZE);
+    if (ndt>=COLUMNAR) return getcolumnfloat(nd,ndt,2);
+    if (ndt>=PACKED) return getpackedfloat(nd,ndt,2);
 
     float fv;
     unsigned char cv;
@@ -472,6 +1005,8 @@ template<typename T>
  inline table_entry_pos_t bound(node nd,LMT_TYPE ndt)
   {
     int offs=LMTCODESIZE+2*(ndt==QINTERNAL?QPROBSIZE:PROBSIZE);
+    if (ndt>=COLUMNAR) return ((table_entry_pos_t*)colfield[ndt-COLUMNAR][3])[nd-table[ndt-COLUMNAR]];
+    if (ndt>=PACKED) return getfield(nd,ndt,3);
 
     table_entry_pos_t v;
     getmem(nd,&v,offs);
@@ -520,6 +1055,8 @@ template<typename T>
 */
   
   void stat(int lev=0);
+  //sizes of the adaptive caches of the calling thread
+  void stat_caches(std::ostream& out);
 
 
   void printTable(int level);
@@ -536,6 +1073,14 @@ template<typename T>
     {
       return orderQuery;
     }
+
+  //switch concurrent mode on/off; caches must be initialized before
+  //switching it on and no query can run while switching
+  void setConcurrent(bool v);
+  inline bool isConcurrent() const
+    {
+      return concurrent;
+    }
 };
 
 
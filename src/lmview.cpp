@@ -0,0 +1,142 @@
+// $Id$
+
+/******************************************************************************
+IrstLM: IRST Language Model Toolkit
+Copyright (C) 2006 Marcello Federico, ITC-irst Trento, Italy
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+
+******************************************************************************/
+#include <stdio.h>
+#include <string.h>
+#include <iostream>
+#include <stdexcept>
+#include "math.h"
+#include "dictionary.h"
+#include "ngram.h"
+#include "lmtable.h"
+#include "lmview.h"
+
+using namespace std;
+
+inline void error(const char* message){
+  std::cerr << message << "\n";
+  throw std::runtime_error(message);
+}
+
+
+//words of subdict are looked up in the LM dictionary, which is not
+//extended; the size of the filtered LM dictionary is that of cpsublm,
+//i.e. without unigrams, the words of the view and the OOV word
+
+lmview::lmview(lmtable* t,dictionary* subdict,bool keepunigrams){
+
+  if (t->isReversed) error("lmview: reversed-context LMs cannot be filtered");
+
+  lmt=t;
+  keepunigr=keepunigrams;
+  V=lmt->dict->size();
+  oov=lmt->dict->oovcode();
+
+  mask=new unsigned char[(V+7)/8];
+  memset(mask,0,(V+7)/8);
+
+  subdict->genoovcode();
+  int n=0;
+  for (int c=0;c<subdict->size();c++){
+    int w=lmt->dict->encode(subdict->decode(c));
+    if (w==oov || isin(w)) continue;
+    mask[w>>3]|=(1<<(w & 7));
+    n++;
+  }
+
+  viewsize=(keepunigr?V:n+1);
+  logOOVpenalty=0.0;
+  std::cerr << "view: " << n << " words of " << V << "\n";
+}
+
+lmview::~lmview(){
+  delete [] mask;
+}
+
+
+int lmview::get(ngram& ng,int n,int lev){
+
+  //the lev least recent of the n words are searched
+  if (!keepunigr || lev>1)
+    for (int i=n-lev+1;i<=n;i++)
+      if (!inview(*ng.wordp(i))) return 0;
+
+  return lmt->get(ng,n,lev);
+}
+
+
+//as lmtable::glprob: an s-gram is in the view if all its words are, or
+//if it is a kept unigram, which keeps its bow too
+
+double lmview::lprob(ngram ng,double* bow,int* bol){
+
+  if (bow) *bow=0;
+  if (bol) *bol=0;
+
+  if (ng.size==0) return 0.0;
+  if (ng.size>lmt->maxlev) ng.size=lmt->maxlev;
+
+  bool last=true; //last word in the view
+  int hlim=ng.size+1; //s-grams with s<hlim have their history in the view
+  if (keepunigr){
+    last=inview(*ng.wordp(1));
+    for (int i=2;i<=ng.size;i++)
+      if (!inview(*ng.wordp(i))){ hlim=i; break; }
+  }
+  else
+    for (int i=1;i<=ng.size;i++)
+      *ng.wordp(i)=code(*ng.wordp(i));
+
+  double rbow[LMTMAXLEV+1],lpr;
+  int nbo=0;
+  float ibow,iprob;
+
+  for (;;){
+    int s=ng.size;
+    bool full=(s<hlim && last) || (s==1 && keepunigr);
+    bool hist=(s<hlim) || (s==2 && keepunigr);
+
+    if (full && lmt->get(ng,s,s)){
+      iprob=ng.prob;
+      lpr = (double)(lmt->isQtable?lmt->Pcenters[s][(qfloat_t)iprob]:iprob);
+      if (*ng.wordp(1)==oov) lpr-=logOOVpenalty;
+      break;
+    }
+    if (s==1){ //means an OOV word
+      lpr = -log(UNIGRAM_RESOLUTION)/M_LN10;
+      break;
+    }
+
+    //back-off: the history was searched with the n-gram if this is in the view
+    double rb=0.0;
+    if (bol) (*bol)++;
+    if (hist && *ng.wordp(2)!=oov && (full?ng.lev==s-1:lmt->get(ng,s,s-1))){
+      ibow=ng.bow;
+      rb= (double) (lmt->isQtable?lmt->Bcenters[s-1][(qfloat_t)ibow]:ibow);
+    }
+    if (bow) (*bow)+=rb;
+    rbow[nbo++]=rb;
+    ng.size--;
+  }
+
+  while (nbo>0) lpr = rbow[--nbo] + lpr;
+  return lpr;
+}
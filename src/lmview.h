@@ -0,0 +1,87 @@
+// $Id$
+
+/******************************************************************************
+IrstLM: IRST Language Model Toolkit
+Copyright (C) 2006 Marcello Federico, ITC-irst Trento, Italy
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+
+******************************************************************************/
+
+
+#ifndef MF_LMVIEW_H
+#define MF_LMVIEW_H
+
+#include <cassert>
+
+#include "util.h"
+#include "dictionary.h"
+#include "ngram.h"
+#include "lmtable.h"
+
+//view of a loaded LM restricted to the words of a list, scoring as the
+//table copied by lmtable::cpsublm: n-grams including words out of the
+//list are not found. The view only keeps one bit per word of the LM
+//dictionary, so that it is built in O(V) time and memory while the
+//table, possibly memory mapped, is shared by any number of views.
+//Words are coded in the dictionary of the LM; if unigrams are not kept,
+//those out of the list are scored as OOV words.
+
+class lmview{
+
+ protected:
+  lmtable* lmt;           //table of the LM (not owned)
+  unsigned char* mask;    //bit w is set if word w is in the view
+  int    V;               //size of the LM dictionary when the view was built
+  int    oov;             //OOV code of the LM dictionary
+  bool   keepunigr;       //words out of the view keep their unigrams
+  int    viewsize;        //dictionary size of the filtered LM
+  double logOOVpenalty;   //penalty for OOV words (default 0)
+
+  inline bool isin(int w) const {
+    return w>=0 && w<V && (mask[w>>3] & (1<<(w & 7)));
+  }
+
+ public:
+
+  lmview(lmtable* lmt,dictionary* subdict,bool keepunigr=true);
+  ~lmview();
+
+  lmtable* table() const {return lmt;}
+  int  size() const {return viewsize;}
+  bool keepunigrams() const {return keepunigr;}
+
+  //whether word w of the LM dictionary is in the view
+  bool inview(int w) const {return w==oov || isin(w);}
+
+  //code used to score word w: the OOV code for words out of the view
+  //if unigrams are not kept
+  int code(int w) const {return (keepunigr || inview(w)?w:oov);}
+
+  double getlogOOVpenalty() const { return logOOVpenalty; }
+  double setlogOOVpenalty(int dub){
+    assert(dub > viewsize);
+    return logOOVpenalty=log((double)(dub - viewsize))/log(10.0);
+  }
+
+  //as lmtable::get, but n-grams with words out of the view are not found
+  //(1-grams are found if unigrams are kept)
+  int get(ngram& ng,int n,int lev);
+
+  //as lmtable::lprob on the filtered LM
+  double lprob(ngram ng,double* bow=NULL,int* bol=NULL);
+};
+
+#endif
@@ -60,6 +60,22 @@ ngram::ngram(const ngram& ng){
 
 }
 
+//only the words of the view are copied: midx is left uninitialized, as
+//it is only used by scans of n-gram tables
+
+ngram::ngram(dictionary* d,const ngramview& v){
+  assert(v.size<=MAX_NGRAM);
+  dict=d;
+  size=v.size;
+  succ=0;
+  freq=0;
+  info=0;
+  pinfo=0;
+  link=NULL;
+  isym=-1;
+  memcpy(&word[MAX_NGRAM-size],v.w,sizeof(int)*size);
+}
+
 void ngram::trans (const ngram& ng){
   size=ng.size;
   freq=ng.freq;
@@ -38,6 +38,7 @@
 #endif
 
 class dictionary;
+class ngramview;
 
 //typedef int code;
 
@@ -63,6 +64,7 @@ class ngram{
 
   ngram(dictionary* d,int sz=0);
   ngram(const ngram& ng);
+  ngram(dictionary* d,const ngramview& v);
 
   int *wordp()// n-gram pointer
     {return wordp(size);}
@@ -127,6 +129,25 @@ class ngram{
 
 };
 
+//non-owning view of the size words of an n-gram, from the least recent
+//one, as laid out by ngram::wordp(): it can be passed to queries instead
+//of an ngram, which takes about 200 bytes
+
+class ngramview{
+ public:
+  const int* w;
+  int size;
+
+  ngramview(const int* wp,int sz):w(wp),size(sz){}
+  ngramview(const ngram& ng):w(ng.wordp()),size(ng.size){}
+
+  const int *wordp() const {return w;}
+  const int *wordp(int k) const {return size>=k?w+size-k:0;}
+
+  //view of the k most recent words
+  ngramview suffix(int k) const {return k<size?ngramview(w+size-k,k):*this;}
+};
+
 #endif
 
 
@@ -28,9 +28,6 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
 #include <cstring>
 #include <string.h>
 #include "math.h"
-#include "mempool.h"
-#include "htable.h"
-
 #include "ngramcache.h"
 
 using namespace std;
@@ -38,56 +35,166 @@ using namespace std;
 ngramcache::ngramcache(int n,int size,int maxentries){
 	ngsize=n;
 	infosize=size;
-	maxn=maxentries;
-	entries=0;
-	ht=new htable(maxn * 2, ngsize * sizeof(int),INT,NULL); //lower load factor to reduce collisions 
-	mp=new mempool(ngsize * sizeof(int)+infosize,1000000); 
+	assert(infosize<=NGCMAXINFO);
+	slotsize=((ngsize * sizeof(int) + infosize + 2 + 3) / 4) * 4; //n-gram, info, ref and used flags
+	alloc(maxentries);
 	accesses=0;
 	hits=0;
+	evictions=0;
+	waccesses=whits=wevictions=0;
 };
   
 ngramcache::~ngramcache(){
-    //ht->stat();
-    //mp->stat();
-    delete ht;delete mp;
+    delete [] slots;
+    delete [] seq;
+    delete [] hand;
 };
 
 
-//resize cache to specified number of entries
-void ngramcache::reset(int n){
-    //ht->stat();
-    delete ht;delete mp;  
-    if (n>0) maxn=n;
-    ht=new htable(maxn * 2, ngsize * sizeof(int),INT,NULL); //load factor 2   
-    mp=new mempool(ngsize * sizeof(int)+infosize,1000000); 
+//sets are a power of two, with room for at least maxentries entries
+
+void ngramcache::alloc(int maxentries){
+    maxn=maxentries;
+    nsets=1;
+    while ((long long)nsets * NGCWAYS < maxn) nsets*=2;
+    slots=new char[(size_t)nsets * NGCWAYS * slotsize];
+    memset(slots,0,(size_t)nsets * NGCWAYS * slotsize);
+    seq=new unsigned int[nsets];
+    hand=new unsigned char[nsets];
+    for (int s=0;s<nsets;s++){ seq[s]=0; hand[s]=0; }
     entries=0;
+}
+
+
+//resize cache to specified number of entries, or just empty it; no
+//other thread can access the cache meanwhile
+
+void ngramcache::reset(int n){
+    if (n>0 && n!=maxn){
+        delete [] slots; delete [] seq; delete [] hand;
+        alloc(n);
+    }
+    else{
+        memset(slots,0,(size_t)nsets * NGCWAYS * slotsize);
+        for (int s=0;s<nsets;s++) hand[s]=0;
+        entries=0;
+    }
 };
 
 
+//resize cache to specified number of entries, keeping as many entries
+//as possible; no other thread can access the cache meanwhile
+
+void ngramcache::resize(int n){
+    if (n<=0 || n==maxn) return;
+    char* oslots=slots;
+    int onsets=nsets;
+    delete [] seq; delete [] hand;
+    alloc(n);
+    int keysize=ngsize * sizeof(int);
+    int ev=evictions;
+    for (size_t i=0;i<(size_t)onsets * NGCWAYS;i++){
+        char* e=oslots+i * slotsize;
+        if (e[keysize+infosize+1]) add((int*)e,e+keysize);
+    }
+    evictions=ev;
+    wevictions=0; //not due to queries
+    delete [] oslots;
+};
 
 
-char* ngramcache::get(const int* ngp,char* info) {
-    char *found;
+//copies the n-grams of the entries to keys, with room for cursize()
+//n-grams: unreferenced entries come first, so that the hottest ones are
+//the last
+
+int ngramcache::getkeys(int* keys) const {
+    int keysize=ngsize * sizeof(int);
+    int n=0;
+    for (int ref=0;ref<=1;ref++)
+        for (size_t i=0;i<(size_t)nsets * NGCWAYS && n<entries;i++){
+            char* e=slots+i * slotsize;
+            if (e[keysize+infosize+1] && e[keysize+infosize]==ref)
+                memcpy(keys+(size_t)(n++) * ngsize,e,keysize);
+        }
+    return n;
+}
+
+
+int ngramcache::setof(const int* ngp) const {
+    unsigned long long h=0;
+    for (int i=0;i<ngsize;i++) h=(h + (unsigned int)ngp[i]) * 0x9e3779b97f4a7c15ULL;
+    return (int)((h >> 32) & (nsets-1));
+}
+
 
-    accesses++;
-    if ((found=ht->search((char *)ngp,HT_FIND))){
-        if (info) memcpy(info,found+ngsize*sizeof(int),infosize);
-        hits++;
+//info is only set if the entry is found; the returned value is only
+//meaningful as a flag, as the entry can be replaced afterwards
+
+char* ngramcache::get(const int* ngp,char* info) {
+    int keysize=ngsize * sizeof(int);
+    int s=setof(ngp);
+    char *found=NULL;
+    char buf[NGCMAXINFO];
+
+    accesses++; waccesses++;
+    unsigned int v=seq[s];
+    if (v & 1) return NULL; //set is being written
+    NGCBARRIER();
+    for (int i=0;i<NGCWAYS;i++){
+        char* e=slot(s,i);
+        if (e[keysize+infosize+1] && !memcmp(e,ngp,keysize)){
+            memcpy(buf,e+keysize,infosize);
+            found=e;
+            break;
+        }
     }
+    NGCBARRIER();
+    if (!found || seq[s]!=v) return NULL; //missing, or set changed while reading
+    found[keysize+infosize]=1; //referenced
+    if (info) memcpy(info,buf,infosize);
+    hits++; whits++;
     return found;
 }
 
+
+//the entry of the n-gram is replaced if present, otherwise it takes a
+//free slot of the set or the first unreferenced one met by the hand;
+//entries is only changed while the set is owned
+
 int ngramcache::add(const int* ngp,const char* info){
+    int keysize=ngsize * sizeof(int);
+    int s=setof(ngp);
+    unsigned int v;
+
+    do v=seq[s];
+    while ((v & 1) || !NGCCAS(&seq[s],v,v+1));
+
+    char* e=NULL;
+    for (int i=0;i<NGCWAYS && !e;i++)
+        if (slot(s,i)[keysize+infosize+1] && !memcmp(slot(s,i),ngp,keysize)) e=slot(s,i);
+    for (int i=0;i<NGCWAYS && !e;i++)
+        if (!slot(s,i)[keysize+infosize+1]){ e=slot(s,i); NGCINC(&entries); }
+    if (!e){
+        //readers can reference slots again meanwhile: after two turns the
+        //entry at the hand is evicted anyway
+        for (int k=0;k<2 * NGCWAYS && slot(s,hand[s])[keysize+infosize];k++){
+            slot(s,hand[s])[keysize+infosize]=0; //second chance
+            hand[s]=(hand[s]+1) % NGCWAYS;
+        }
+        e=slot(s,hand[s]);
+        hand[s]=(hand[s]+1) % NGCWAYS;
+        evictions++; wevictions++;
+    }
+    memcpy(e,(char*) ngp,keysize);
+    memcpy(e+keysize,(char *)info,infosize);
+    e[keysize+infosize]=0;
+    e[keysize+infosize+1]=1;
 
-    char* entry=mp->allocate();
-    memcpy(entry,(char*) ngp,sizeof(int) * ngsize);    
-    memcpy(entry + ngsize * sizeof(int),(char *)info,infosize);
-    char *found=ht->search((char *)entry,HT_ENTER);
-    assert(found == entry); //false if key is already insided
-    entries++;
+    NGCBARRIER();
+    seq[s]=v+2;
     return 1;
   }
   
 void ngramcache::stat() const {
-   cerr << "ngramcache stats: entries=" << entries << " acc=" << accesses << " hits=" << hits << "\n";
+   cerr << "ngramcache stats: entries=" << entries << " acc=" << accesses << " hits=" << hits << " evictions=" << evictions << "\n";
 };
@@ -23,19 +23,54 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
 #ifndef MF_NGRAMCACHE_H
 #define MF_NGRAMCACHE_H
 
-#include "mempool.h"
-#include "htable.h"
+//Bounded cache of n-grams: entries are kept in sets of NGCWAYS slots
+//selected by the hash of the n-gram, and a full set evicts one entry
+//with the CLOCK policy (entries hit since the last pass of the hand
+//get a second chance). Hence the cache never needs to be rebuilt.
+//Each set is guarded by a sequence number, which is odd while the set
+//is written: readers never block, and only report a hit (and copy the
+//info of the entry) if the set did not change while they were reading
+//it. The number of entries is updated atomically by writers; the other
+//counters are only statistics, which are approximate if the cache is
+//shared by threads (lmtable gives each thread its own caches).
+
+#define NGCWAYS 8
+#define NGCMAXINFO 16 //max size of the info of an entry
+
+//memory barrier, compare-and-swap and atomic increment; without the GCC
+//builtins they are plain operations, which is enough as long as LMs
+//cannot be shared by threads (concurrent mode is not available there)
+#ifdef __GNUC__
+#define NGCBARRIER() __sync_synchronize()
+#define NGCCAS(p,o,n) __sync_bool_compare_and_swap(p,o,n)
+#define NGCINC(p) __sync_fetch_and_add(p,1)
+#else
+#define NGCBARRIER()
+#define NGCCAS(p,o,n) (*(p)==(o)?(*(p)=(n),true):false)
+#define NGCINC(p) ((*(p))++)
+#endif
 
 class ngramcache{
 private:
-  htable* ht;
-  mempool *mp;
+  char* slots;            //nsets * NGCWAYS slots: n-gram, info, ref, used
+  volatile unsigned int* seq; //sequence numbers of sets
+  unsigned char* hand;    //CLOCK hands of sets
+  int nsets;
+  int slotsize;
   int maxn;
   int ngsize;
   int infosize;
   int accesses;
   int hits;
-  int entries;
+  volatile int entries;
+  int evictions;
+  int waccesses,whits,wevictions; //since the last sample
+
+  void alloc(int maxentries);
+  inline char* slot(int s,int i) const {
+    return slots + ((size_t)s * NGCWAYS + i) * slotsize;
+  }
+  int setof(const int* ngp) const;
 
 public:
   ngramcache(int n,int size,int maxentries);
@@ -49,7 +84,19 @@ public:
   int add(const int* ngp, const char* info);
 
   void reset(int n=0);
+  void resize(int n);
+  int getkeys(int* keys) const;
   void stat() const;
+
+  //bytes allocated by the cache
+  size_t memsize() const {
+    return (size_t)nsets * (NGCWAYS * slotsize + sizeof(int) + 1);
+  }
+  //accesses, hits and evictions since the previous call
+  void sample(int& acc,int& hit,int& evict){
+    acc=waccesses; hit=whits; evict=wevictions;
+    waccesses=whits=wevictions=0;
+  }
 };
 
 #endif